@@ -0,0 +1,335 @@
+/*
+ * Loopback load test and latency benchmark for httpd.c
+ *
+ * The MATLAB callback is replaced by a C stub which serves a mix of small HTML,
+ * template, file and large data endpoints.  A multi-connection load generator drives
+ * the server over loopback, with keep-alive on or off, and reports requests per second
+ * and a latency histogram for each case.
+ *
+ * usage: bench [-c connections] [-d seconds] [-p port] [-k 0|1] [endpoint ...]
+ */
+
+#define _GNU_SOURCE     // for strcasestr
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "stl.h"
+#include "httpd.h"
+
+// parameters
+#define NBUCKETS        24          // latency histogram buckets, powers of 2 microseconds
+#define MAXCONNS        256
+#define LARGESIZE       (1024*1024) // size of the large data response
+#define RXBUFSIZ        (64*1024)
+
+#define TEMPLATE_FILE   "/tmp/bench-template.html"
+#define DATA_FILE       "/tmp/bench-file.bin"
+#define DATA_FILE_SIZE  (64*1024)
+
+static const char *endpoints[] = {"/small", "/template", "/file", "/large"};
+#define NENDPOINTS  (sizeof(endpoints)/sizeof(endpoints[0]))
+
+static char *large_data;
+
+// per connection results
+typedef struct _client {
+    pthread_t   thread;
+    const char *url;
+    int         keepalive;
+    int         port;
+    double      duration;
+    long        requests;
+    long        errors;
+    long        bytes;
+    long        hist[NBUCKETS];
+    double      maxlatency;
+} client;
+
+//------------------- stub of the user's MATLAB callback
+
+void
+bench_callback()
+{
+    char url[256];
+
+    web_url(url, sizeof(url));
+
+    if (strcmp(url, "/small") == 0)
+        web_html("<html><body>hello <b>from</b> /small</body></html>");
+    else if (strcmp(url, "/template") == 0) {
+        web_setvalue("a", "1");
+        web_setvalue("b", "2");
+        web_template(TEMPLATE_FILE);
+    } else if (strcmp(url, "/file") == 0)
+        web_file(DATA_FILE, "application/octet-stream");
+    else if (strcmp(url, "/large") == 0)
+        web_data(large_data, LARGESIZE, "application/octet-stream");
+}
+
+static void
+make_files()
+{
+    FILE *fp;
+
+    fp = fopen(TEMPLATE_FILE, "w");
+    fprintf(fp, "<html>\n<body>\n<p>a = <TMPL_VAR name=\"a\"></p>\n<p>b = <TMPL_VAR name=\"b\"></p>\n</body>\n</html>\n");
+    fclose(fp);
+
+    fp = fopen(DATA_FILE, "w");
+    for (int i=0; i<DATA_FILE_SIZE; i++)
+        fputc(i & 0xff, fp);
+    fclose(fp);
+
+    large_data = malloc(LARGESIZE);
+    memset(large_data, 'x', LARGESIZE);
+}
+
+//------------------- load generator
+
+static double
+now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int
+client_connect(int port)
+{
+    struct sockaddr_in addr;
+    int    sock, one = 1;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static long
+client_request(int sock, const char *url, int keepalive, int *closed)
+{
+    // send one GET and read the whole response, return body length or -1 on error
+    char    req[512];
+    char    buf[RXBUFSIZ];
+    int     len, n, have = 0;
+    long    clen = -1, body;
+    char   *end;
+
+    len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: %s\r\n\r\n",
+            url, keepalive ? "keep-alive" : "close");
+    if (send(sock, req, len, MSG_NOSIGNAL) != len)
+        return -1;
+
+    // read until the end of the header
+    for (;;) {
+        n = recv(sock, buf+have, sizeof(buf)-1-have, 0);
+        if (n <= 0)
+            return -1;
+        have += n;
+        buf[have] = 0;
+        if ((end = strstr(buf, "\r\n\r\n")))
+            break;
+        if (have == sizeof(buf)-1)
+            return -1;
+    }
+    if (strncmp(buf, "HTTP/1.1 200", 12) != 0)
+        return -1;
+
+    char *p = strcasestr(buf, "\r\nContent-Length:");
+    if (p)
+        clen = strtol(p+17, NULL, 10);
+    *closed = !keepalive || strcasestr(buf, "\r\nConnection: close") != NULL;
+
+    // read the rest of the body, or until close if the length is unknown
+    body = have - (end + 4 - buf);
+    while (clen < 0 || body < clen) {
+        n = recv(sock, buf, sizeof(buf), 0);
+        if (n < 0)
+            return -1;
+        if (n == 0) {
+            *closed = 1;
+            break;
+        }
+        body += n;
+    }
+    return body;
+}
+
+static void *
+client_thread(void *arg)
+{
+    client *cp = (client *)arg;
+    int     sock = -1;
+    double  start = now(), t0, dt;
+
+    while ((t0 = now()) - start < cp->duration) {
+        int  closed = 0;
+        long n;
+
+        if (sock < 0 && (sock = client_connect(cp->port)) < 0) {
+            cp->errors++;
+            continue;
+        }
+        n = client_request(sock, cp->url, cp->keepalive, &closed);
+        dt = now() - t0;   // includes connection setup when keep-alive is off
+
+        if (n < 0) {
+            cp->errors++;
+            closed = 1;
+        } else {
+            int b = 0;
+            long us = (long)(dt * 1e6);
+
+            while (us > 1 && b < NBUCKETS-1) {
+                us >>= 1;
+                b++;
+            }
+            cp->hist[b]++;
+            cp->requests++;
+            cp->bytes += n;
+            if (dt > cp->maxlatency)
+                cp->maxlatency = dt;
+        }
+        if (closed) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    if (sock >= 0)
+        close(sock);
+    return NULL;
+}
+
+static double
+percentile(long *hist, long total, double pc)
+{
+    // upper edge of the bucket holding the percentile, in microseconds
+    long target = (long)(total * pc / 100.0), sum = 0;
+
+    for (int b=0; b<NBUCKETS; b++) {
+        sum += hist[b];
+        if (sum > target)
+            return (double)(2L << b);
+    }
+    return (double)(2L << (NBUCKETS-1));
+}
+
+static void
+run(const char *url, int keepalive, int nconns, double duration, int port)
+{
+    client  clients[MAXCONNS];
+    long    hist[NBUCKETS] = {0};
+    long    requests = 0, errors = 0, bytes = 0, peak = 0;
+    double  maxlatency = 0;
+    double  start, elapsed;
+
+    memset(clients, 0, sizeof(clients));
+    start = now();
+    for (int i=0; i<nconns; i++) {
+        clients[i].url = url;
+        clients[i].keepalive = keepalive;
+        clients[i].port = port;
+        clients[i].duration = duration;
+        pthread_create(&clients[i].thread, NULL, client_thread, &clients[i]);
+    }
+    for (int i=0; i<nconns; i++) {
+        pthread_join(clients[i].thread, NULL);
+        requests += clients[i].requests;
+        errors += clients[i].errors;
+        bytes += clients[i].bytes;
+        for (int b=0; b<NBUCKETS; b++)
+            hist[b] += clients[i].hist[b];
+        if (clients[i].maxlatency > maxlatency)
+            maxlatency = clients[i].maxlatency;
+    }
+    elapsed = now() - start;
+
+    printf("\n%-10s keep-alive %-3s  %d connections  %.1fs\n", url, keepalive ? "on" : "off", nconns, elapsed);
+    printf("  %10.0f req/s  %8.2f MB/s  %ld requests  %ld errors\n",
+            requests / elapsed, bytes / elapsed / 1e6, requests, errors);
+    if (requests == 0)
+        return;
+    printf("  latency us: p50 < %.0f  p90 < %.0f  p99 < %.0f  max %.0f\n",
+            percentile(hist, requests, 50), percentile(hist, requests, 90),
+            percentile(hist, requests, 99), maxlatency * 1e6);
+
+    for (int b=0; b<NBUCKETS; b++)
+        if (hist[b] > peak)
+            peak = hist[b];
+    for (int b=0; b<NBUCKETS; b++) {
+        if (hist[b] == 0)
+            continue;
+        printf("  %8ld us |", 2L << b);
+        for (int i=0; i<(int)(50 * hist[b] / peak); i++)
+            putchar('#');
+        printf(" %ld\n", hist[b]);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    int     nconns = 8, port = 8090, keepalive = -1;
+    double  duration = 5;
+    int     opt;
+
+    while ((opt = getopt(argc, argv, "c:d:p:k:")) != -1) {
+        switch (opt) {
+            case 'c': nconns = atoi(optarg); break;
+            case 'd': duration = atof(optarg); break;
+            case 'p': port = atoi(optarg); break;
+            case 'k': keepalive = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-c connections] [-d seconds] [-p port] [-k 0|1] [endpoint ...]\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (nconns < 1 || nconns > MAXCONNS) {
+        fprintf(stderr, "connections must be 1 to %d\n", MAXCONNS);
+        exit(1);
+    }
+
+    stl_initialize(argc, argv, NULL);
+    stl_debug(0);
+    web_debug(0);
+    make_files();
+    web_start(port, "bench_callback", NULL, NULL);
+
+    for (int k=0; k<2; k++) {
+        if (keepalive >= 0 && keepalive != k)
+            continue;
+        if (optind < argc) {
+            for (int i=optind; i<argc; i++)
+                run(argv[i], k, nconns, duration, port);
+        } else {
+            for (int i=0; i<(int)NENDPOINTS; i++)
+                run(endpoints[i], k, nconns, duration, port);
+        }
+    }
+
+    unlink(TEMPLATE_FILE);
+    unlink(DATA_FILE);
+    return 0;
+}
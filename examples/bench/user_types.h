@@ -0,0 +1,10 @@
+/*
+ * Stand-in for the header generated by MATLAB Coder, the benchmark has no
+ * MATLAB code so there are no user types.
+ */
+#ifndef __user_types_h__
+#define __user_types_h__
+
+#include <stdint.h>
+
+#endif
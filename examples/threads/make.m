@@ -36,7 +36,9 @@ cfg.InlineThreshold = 0;  % tone down the aggressive inlining
 codegen user.m thread1.m thread2.m thread3.m -O disable:inline -config cfg
 %}
 
-codegen user.m thread1.m thread2.m thread3.m  -config cfg
+% thread4 takes the struct shared with user.m
+arg = struct('count', int32(0), 'done', int32(0));
+codegen user.m thread1.m thread2.m thread3.m thread4.m -args {arg} -config cfg
 %MAKE  = gmake
 %MAKE_FLAGS           = -f $(MAKEFILE) 
 % hw = coder.hardware('Raspberry Pi');
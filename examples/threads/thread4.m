@@ -0,0 +1,9 @@
+function arg = thread4(arg) %#codegen
+    % arg is returned under the same name so that it is passed by reference,
+    % and the atomics update the struct shared with user.m
+    for i=1:100000
+        arg = stl.atomic_add(arg, 'count', 1, 'relaxed');
+    end
+    stl.log('hello from thread4, id #%d', stl.self());
+    arg = stl.atomic_add(arg, 'done', 1);
+end
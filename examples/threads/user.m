@@ -48,6 +48,17 @@ function user  %#codegen
     stl.semaphore_post(0);  % wake up thread 3
     stl.sleep(2);
     
+    % two threads add to a shared counter, see thread4.m
+    %  the atomic add needs no mutex, and no count is lost
+    s = struct('count', int32(0), 'done', int32(0));
+    t4 = stl.launch('thread4', s);
+    t5 = stl.launch('thread4', s);
+    stl.log('thread ids %d %d', t4, t5);
+    while stl.atomic_load(s, 'done') < 2
+        stl.sleep(0.1);
+    end
+    stl.log('count is %d, expecting 200000', stl.atomic_load(s, 'count'));
+    
     % done, exiting will tear down all the threads
     
 end
@@ -9,11 +9,16 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <pthread.h>
+#include <poll.h>
+#include <strings.h>
+#include <time.h>
 
 #include <sys/types.h>
 #ifndef _WIN32
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
 #else
 #include <winsock2.h>
 #endif
@@ -28,18 +33,60 @@
 
 // forward defines
 static       struct MHD_Daemon *daemon;
+static void  queue_response(int status, struct MHD_Response *response, uint64_t bytes);
+static uint64_t now_ns(clockid_t clock);
+static void  metrics_record(uint64_t start);
+static void  metrics_send();
+static void  profile_send();
+static int   metrics_enabled = 0;
+static int   rate_check(struct MHD_Connection *connection);
+static double rate_limit = 0;   // requests per second per client, 0 for no limit
+static double rate_burst = 1;
+static int   cache_lookup(struct MHD_Connection *connection, const char *url, const char *method);
+static void  cache_store(const void *body, size_t len, const char *type);
+static uint64_t cache_hits, cache_misses;
+static uint32_t postvar_hash(const char *key);
 static       void (*request_matlab_callback)(void);
 static void  send_data(void *s, int len, char *type);
 static int   print_key (void *cls, enum MHD_ValueKind kind, const char *key,
                const char *value);
 
+#define NPARAMS         8       // max number of path parameters in a route
+#define NMETRICS        64      // max number of distinct paths with metrics
+#define NLATENCY        14      // number of latency histogram buckets, plus one for +Inf
+#define NLOGRECORDS     4096    // access log ring buffer size, a power of 2
+#define NDEFERRED       16      // max number of requests awaiting a deferred response
+#define NCLIENTS        256     // number of client addresses tracked by the rate limiter
+#define NCACHE          64      // number of cached responses
+#define NCACHERULES     16      // number of URL prefixes with a cache lifetime
+#define CACHE_KEYLEN    1024    // max length of method, URL and GET arguments
+#define NRANGES         16      // max number of byte ranges in a file request
+#define RANGE_BOUNDARY  "stlbyterange"
+
+#ifndef MHD_HTTP_RANGE_NOT_SATISFIABLE      // older versions of libmicrohttpd
+#define MHD_HTTP_RANGE_NOT_SATISFIABLE  MHD_HTTP_REQUESTED_RANGE_NOT_SATISFIABLE
+#endif
+
 // variables that hold state during the request
 static struct MHD_Connection  *req_connection;
 static int                     req_response_status;
 static char                   *req_url;
 static char                   *req_method;
 static TMPL_varlist           *req_varlist = NULL;  // list of template variables for this request
-struct MHD_PostProcessor *pp;
+static int                     req_status;       // HTTP status code of the response
+static uint64_t                req_bytes;        // size of the response body
+static uint64_t                req_start;        // time the request arrived, ns
+static const char             *req_route;        // pattern of the matching route, or NULL
+static struct _deferred       *req_deferred;     // set if the callback deferred the response
+static int                     req_nparams;      // number of path parameters matched by the route
+static struct _param {
+    const char *name;
+    const char *value;  // points into req_url, not null terminated
+    int         len;
+}                              req_params[NPARAMS];
+static struct _request        *req_request;     // per-connection state, POST requests only
+static char                    req_cachekey[CACHE_KEYLEN];  // key of the current request, if cacheable
+static double                  req_cachettl;     // 0 if the current request is not cacheable
 
 // local variables
 int web_debug_flag = 1;
@@ -47,35 +94,193 @@ int page_request_once = 0;
 int page_request_responses = 0;
 
 
+// per-request memory arena, everything for a request is freed in one go
+typedef struct _arena_block {
+    struct _arena_block *next;
+    size_t  size;
+    size_t  used;
+    int     own;        // holds a single growing allocation
+    char    data[];
+} arena_block;
+
+typedef struct _arena {
+    arena_block *head;
+    char    *last;      // most recent allocation, can be grown in place
+} arena;
+
+// POST variable, held in an open addressing hash table
+typedef struct _postvar {
+    char    *key;       // NULL if the slot is empty
+    char    *value;     // null terminated
+    size_t  len;
+    uint32_t hash;
+} postvar;
+
+// state for a POST request, which spans several calls to page_request
+typedef struct _request {
+    arena   arena;
+    struct MHD_PostProcessor *pp;
+    postvar *table;
+    int     size;       // number of slots, a power of 2
+    int     nvars;
+    int     upload_fd;  // file currently being uploaded
+    struct _upload *uploads;
+    uint64_t start;     // time the request arrived, ns
+} request;
+
+// file uploaded during a request
+typedef struct _upload {
+    char    *path;
+    struct _upload *next;
+} upload;
+
+// node in the route trie, one per path segment
+typedef struct _route {
+    char    *segment;       // literal path segment, or parameter name for a parameter node
+    char    *pattern;       // full pattern of the route ending at this node
+    int     isparam;        // segment is :name, matches any single segment
+    int     iswild;         // segment is *, matches the rest of the path
+    void    (*handler[5])(void);  // entrypoint for each method, indexed by route_method()
+    struct _route *child;   // first child
+    struct _route *next;    // next sibling
+} route;
+
+// request whose response will be completed later, possibly by another thread
+typedef struct _deferred {
+    struct MHD_Connection *connection;
+    struct MHD_Response *response;  // set by web_complete
+    int     status;
+    uint64_t bytes;
+    uint64_t start;     // for the metrics
+    char    *url;
+    char    *method;
+    const char *route;
+    int     busy;
+    int     generation; // distinguishes successive uses of the slot
+    int     completed;  // web_complete has been called
+} deferred;
+
 // forward defines
-static void postvar_add(char *key, char *value);
-static char *postvar_find(char *key);
-static void postvar_free();
+static int   deferred_answer(deferred *dp);
+static void (*route_match(const char *url, const char *method))(void);
+static request *request_new(struct MHD_Connection *connection);
+static void request_free(request *rp);
+static void upload_close(request *rp);
+static void *arena_alloc(arena *a, size_t n);
+static char *arena_strdup(arena *a, const char *s);
+static void postvar_set(request *rp, const char *key, const char *value, size_t len);
+static void postvar_append(request *rp, const char *key, const char *value, size_t len);
+static char *postvar_find(request *rp, char *key);
 void *malloc();  // stdlib.h clashes with microhttpd.h
 void *calloc(size_t count, size_t size);
 void free(void *);
+void *realloc(void *ptr, size_t size);
+double strtod(const char *s, char **end);
+int pipe(int fds[2]);    // unistd.h clashes with the daemon variable
+ssize_t read(int fd, void *buf, size_t count);
+ssize_t write(int fd, const void *buf, size_t count);
+int close(int fd);
+int unlink(const char *path);
+int mkstemp(char *template);
+ssize_t pread(int fd, void *buf, size_t count, off_t offset);
+unsigned long long strtoull(const char *s, char **end, int base);
 
-int
+// parameters
+#define NSTREAMS        8       // max number of concurrent streaming responses
+#define NSTREAMCHUNKS   16      // max number of chunks queued per stream
+#define MJPEG_BOUNDARY  "stlframe"
+#define NWEBSOCKETS     8       // max number of concurrent websocket connections
+#define NWSMESSAGES     16      // max number of received messages queued per websocket
+#define WS_MAXMSG       (64*1024) // max size of a received websocket message
+#define WS_SENDTIMEOUT  5000    // ms to wait for a client to accept a frame before closing
+#define POST_BUFSIZ     1024    // post processor buffer, only needs to hold a key
+#define ARENA_BLOCK     4096    // size of a request arena block
+#define NPOSTVARS       16      // initial size of the POST variable table
+
+static char *upload_dir = NULL;     // if set, file uploads are streamed here
+
+static deferred deferlist[NDEFERRED];
+static pthread_mutex_t deferlist_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+is_deferred(void *p)
+{
+    // con_cls is either a POST request or, once deferred, a slot in deferlist
+    return (deferred *)p >= deferlist && (deferred *)p < deferlist + NDEFERRED;
+}
+
+static void
+deferred_release(deferred *dp)
+{
+    pthread_mutex_lock(&deferlist_mutex);
+    if (dp->response)
+        MHD_destroy_response(dp->response);
+    dp->response = NULL;
+    free(dp->url);
+    free(dp->method);
+    dp->busy = 0;
+    pthread_mutex_unlock(&deferlist_mutex);
+}
+
+static int
 post_data_iterator(void *cls, enum MHD_ValueKind kind, 
         const char *key, 
         const char *filename, const char *type, const char *encoding, 
         const char *data, uint64_t off, size_t size)
 {
-    // Called on every POST variable uploaded
-    
-    // make null terminated heap copy of the value
-    char *value = (char *)calloc(size+1, 1);
-    strncpy(value, data, size);
-    
-    // add to the list of POST variables
-    postvar_add(stl_stralloc(key), value);
+    // Called on every block of POST data uploaded, a long value arrives as several
+    // blocks with increasing offset
+    request *rp = (request *)cls;
+
+    if (filename && upload_dir) {
+        // file upload, stream it to disk rather than holding it in memory
+        if (off == 0) {
+            char path[1024];
+
+            upload_close(rp);
+            snprintf(path, sizeof(path), "%s/upload-XXXXXX", upload_dir);
+            rp->upload_fd = mkstemp(path);
+            if (rp->upload_fd < 0) {
+                stl_log("POST upload: couldn't create file in %s %s", upload_dir, strerror(errno));
+                return MHD_NO;
+            }
+            upload *up = (upload *)arena_alloc(&rp->arena, sizeof(upload));
+            up->path = arena_strdup(&rp->arena, path);
+            up->next = rp->uploads;
+            rp->uploads = up;
+            postvar_set(rp, key, path, strlen(path));
+            WEB_DEBUG("POST upload [%s] %s -> %s", key, filename, path);
+        }
+        if (rp->upload_fd >= 0 && write(rp->upload_fd, data, size) != (ssize_t)size) {
+            stl_log("POST upload: write failed %s", strerror(errno));
+            return MHD_NO;
+        }
+        return MHD_YES;
+    }
+
+    if (off == 0)
+        postvar_set(rp, key, data, size);
+    else
+        postvar_append(rp, key, data, size);
 
-    stl_log("POST [%s] = %s", key, value);
+    WEB_DEBUG("POST [%s] %d bytes at offset %d", key, (int)size, (int)off);
 
     return MHD_YES;
 }
 
-
+static void
+request_completed(void *cls, struct MHD_Connection *connection,
+                  void **con_cls, enum MHD_RequestTerminationCode toe)
+{
+    // called by MHD when a request is finished, including when the client aborts it
+    if (is_deferred(*con_cls)) {
+        deferred_release((deferred *)*con_cls);
+        *con_cls = NULL;
+    } else if (*con_cls) {
+        request_free((request *)*con_cls);
+        *con_cls = NULL;
+    }
+}
 
 //------------------- handle the page request
 static int
@@ -84,6 +289,8 @@ page_request (void *cls, struct MHD_Connection *connection,
                       const char *version, const char *upload_data,
                       size_t *upload_data_size, void **con_cls)
 {
+    uint64_t start = now_ns(CLOCK_MONOTONIC);
+
     WEB_DEBUG("web: %s request using %s for URL %s ", method, version, url);
 
 
@@ -97,48 +304,106 @@ page_request (void *cls, struct MHD_Connection *connection,
     req_connection = connection;
     req_url = (char *)url;
     req_method = (char *)method;
+    req_deferred = NULL;
+
+    if (is_deferred(*con_cls)) {
+        // connection has been resumed by web_complete, send the response
+        return deferred_answer((deferred *)*con_cls);
+    }
+
+    if (*con_cls == NULL && rate_limit > 0 && !rate_check(connection)) {
+        // client is over its request rate, reject before doing any work
+        struct MHD_Response *response;
+        static char msg[] = "Too many requests";
+
+        WEB_DEBUG("web: rate limit exceeded for URL %s", url);
+        req_route = NULL;
+        response = MHD_create_response_from_buffer(strlen(msg), msg, MHD_RESPMEM_PERSISTENT);
+        MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, "text/plain");
+        MHD_add_response_header(response, MHD_HTTP_HEADER_RETRY_AFTER, "1");
+        queue_response(MHD_HTTP_TOO_MANY_REQUESTS, response, strlen(msg));
+        metrics_record(start);
+        return req_response_status;
+    }
     
     if (strcmp(method, MHD_HTTP_METHOD_POST) == 0) {
 
-        pp = *con_cls;
-        if (pp == NULL) {
+        req_request = *con_cls;
+        if (req_request == NULL) {
             // new POST request
-            pp = MHD_create_post_processor(connection, 32*1024, post_data_iterator, pp);
-            *con_cls = (void *)pp;
+            *con_cls = (void *)request_new(connection);
             return MHD_YES;
         }
 
         if (*upload_data_size) {
             // deal with POST data, feed the post processor
-            MHD_post_process(pp, upload_data, *upload_data_size);
+            if (req_request->pp)
+                MHD_post_process(req_request->pp, upload_data, *upload_data_size);
             *upload_data_size = 0; // flag that we've dealt with the data
             return MHD_YES;
         }
-    }
+
+        // all data received, finish any file upload
+        upload_close(req_request);
+        start = req_request->start;
+    } else
+        req_request = NULL;
 
     // set the template varlist to empty
     req_varlist = NULL;
 
     // set the return status to fail, it will be set by any of the callbacks
     req_response_status = MHD_NO;
+    req_status = 0;
+    req_bytes = 0;
+    req_start = start;
     
     // call the user's MATLAB code
     page_request_responses = 0;
 
-    request_matlab_callback();
+    // serve from the cache if we can, without entering MATLAB code
+    if (cache_lookup(connection, url, method)) {
+        metrics_record(start);
+        return req_response_status;
+    }
+
+    // dispatch to the handler for a matching route, otherwise the catch-all callback
+    void (*handler)(void) = route_match(url, method);
+    if (handler)
+        handler();
+    else if (metrics_enabled && strcmp(url, "/metrics") == 0)
+        metrics_send();
+    else if (metrics_enabled && strcmp(url, "/profile") == 0)
+        profile_send();
+    else if (request_matlab_callback)
+        request_matlab_callback();
     
     // free up the template varlist
     if (req_varlist)
         TMPL_free_varlist(req_varlist);
     
-    // free up the POST var list
-    postvar_free();
+    // free up the POST variables and any uploaded files
+    if (req_request) {
+        request_free(req_request);
+        *con_cls = NULL;
+        req_request = NULL;
+    }
+
+    if (req_deferred) {
+        // the response will come later, from web_complete
+        req_deferred->start = start;
+        req_deferred->route = req_route;
+        *con_cls = req_deferred;
+        return MHD_YES;
+    }
     
     if (strcmp(method, MHD_HTTP_METHOD_GET) == 0) {
         // GET        // check whether user code responded
         if (page_request_responses == 0)
             web_error(404, "URL not found");
     }
+
+    metrics_record(start);
         
 
         // return the status  MHD_YES=1, MHD_NO=0
@@ -151,10 +416,28 @@ page_request (void *cls, struct MHD_Connection *connection,
 /**
  * Return the URL for this request
  */
-void
+int32_t
 web_url(char *buf, int buflen)
 {
     strncpy(buf, req_url, buflen);
+    return strlen(req_url);
+}
+
+/**
+ * Return the value of a path parameter matched by the route
+ */
+int32_t
+web_param(char *buf, int len, char *name)
+{
+    for (int i=0; i<req_nparams; i++) {
+        if (strcmp(req_params[i].name, name) == 0) {
+            int n = req_params[i].len < len-1 ? req_params[i].len : len-1;
+            memcpy(buf, req_params[i].value, n);
+            buf[n] = 0;
+            return n;
+        }
+    }
+    return -1;   // key not found
 }
 
 int
@@ -179,7 +462,7 @@ web_getarg(char *buf, int len, char *name)
 int32_t
 web_postarg(char *buf, int len, char *name)
 {
-    char *value = postvar_find(name);
+    char *value = req_request ? postvar_find(req_request, name) : NULL;
     
     if (value) {
         strncpy(buf, value, len);
@@ -211,8 +494,7 @@ void web_error(int errcode, char *errmsg)
     response = MHD_create_response_from_buffer(strlen(errmsg), errmsg, MHD_RESPMEM_MUST_COPY);
     
     MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, "text/html");
-    req_response_status = MHD_queue_response(req_connection, errcode, response);
-    MHD_destroy_response(response);
+    queue_response(errcode, response, strlen(errmsg));
 }
 
 void web_show_request_header()
@@ -252,6 +534,170 @@ void web_template(char *filename)
     send_data(buffer, strlen(buffer), "text/html");
 }
 
+//------------------- file responses and byte ranges
+//
+// Files are sent from the file descriptor so that MHD can use sendfile.  A Range header
+// with a single range gives a 206 response for just that part of the file, several ranges
+// give a multipart/byteranges response which is read from the file piece by piece.
+
+typedef struct _byterange {
+    uint64_t first;
+    uint64_t last;      // inclusive
+} byterange;
+
+// a multipart response is a sequence of part headers, file data and a trailer
+typedef struct _segment {
+    uint64_t start;     // offset of the segment in the response body
+    uint64_t len;
+    const char *text;   // part header or trailer, NULL for file data
+    uint64_t offset;    // offset in the file if text is NULL
+} segment;
+
+typedef struct _multipart {
+    int     fd;
+    int     nsegs;
+    segment segs[2*NRANGES+1];
+    char    text[];     // part headers and trailer
+} multipart;
+
+static int
+range_parse(const char *header, uint64_t size, byterange *ranges)
+{
+    // parse "bytes=a-b, c-, -n" into ranges, clipped to the file size.  Return the
+    // number of ranges that overlap the file, or -1 if the header is malformed or has
+    // too many ranges in which case it is ignored.
+    const char *p = header;
+    char *end;
+    int  n = 0;
+
+    if (strncasecmp(p, "bytes=", 6) != 0)
+        return -1;
+    p += 6;
+
+    for (;;) {
+        uint64_t first, last;
+        int      ok;
+
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '-') {
+            // suffix range, the last n bytes
+            if (p[1] < '0' || p[1] > '9')
+                return -1;
+            uint64_t suffix = strtoull(p+1, &end, 10);
+            ok = suffix > 0 && size > 0;
+            first = suffix >= size ? 0 : size - suffix;
+            last = size - 1;
+        } else {
+            if (*p < '0' || *p > '9')
+                return -1;
+            first = strtoull(p, &end, 10);
+            if (*end++ != '-')
+                return -1;
+            if (*end >= '0' && *end <= '9') {
+                last = strtoull(end, &end, 10);
+                if (last < first)
+                    return -1;
+            } else
+                last = UINT64_MAX;
+            if (last >= size)
+                last = size - 1;
+            ok = first < size;
+        }
+        if (ok) {
+            if (n == NRANGES)
+                return -1;
+            ranges[n].first = first;
+            ranges[n].last = last;
+            n++;
+        }
+
+        p = end;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == 0)
+            return n;
+        if (*p++ != ',')
+            return -1;
+    }
+}
+
+static ssize_t
+multipart_reader(void *cls, uint64_t pos, char *buf, size_t max)
+{
+    multipart *mp = (multipart *)cls;
+
+    for (int i=0; i<mp->nsegs; i++) {
+        segment *sp = &mp->segs[i];
+        uint64_t off, n;
+
+        if (pos >= sp->start + sp->len)
+            continue;
+        off = pos - sp->start;
+        n = sp->len - off;
+        if (n > max)
+            n = max;
+        if (sp->text) {
+            memcpy(buf, sp->text + off, n);
+            return n;
+        }
+        ssize_t got = pread(mp->fd, buf, n, sp->offset + off);
+        return got > 0 ? got : MHD_CONTENT_READER_END_WITH_ERROR;
+    }
+    return MHD_CONTENT_READER_END_OF_STREAM;
+}
+
+static void
+multipart_free(void *cls)
+{
+    multipart *mp = (multipart *)cls;
+
+    close(mp->fd);
+    free(mp);
+}
+
+static struct MHD_Response *
+multipart_response(int fd, const char *type, uint64_t size, byterange *ranges, int nranges, uint64_t *len)
+{
+    // build the segment list for a multipart/byteranges response, return its length in len
+    size_t     hdrsize = strlen(type) + 128;
+    multipart *mp = (multipart *)malloc(sizeof(multipart) + (nranges+1) * hdrsize);
+    char      *text = mp->text;
+    uint64_t   pos = 0;
+    segment   *sp = mp->segs;
+
+    mp->fd = fd;
+    for (int i=0; i<=nranges; i++) {
+        int n;
+
+        if (i < nranges)
+            n = snprintf(text, hdrsize, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %llu-%llu/%llu\r\n\r\n",
+                RANGE_BOUNDARY, type, (unsigned long long)ranges[i].first,
+                (unsigned long long)ranges[i].last, (unsigned long long)size);
+        else
+            n = snprintf(text, hdrsize, "\r\n--%s--\r\n", RANGE_BOUNDARY);
+        sp->start = pos;
+        sp->len = n;
+        sp->text = text;
+        pos += n;
+        text += n;
+        sp++;
+
+        if (i < nranges) {
+            sp->start = pos;
+            sp->len = ranges[i].last - ranges[i].first + 1;
+            sp->text = NULL;
+            sp->offset = ranges[i].first;
+            pos += sp->len;
+            sp++;
+        }
+    }
+    mp->nsegs = sp - mp->segs;
+    *len = pos;
+
+    return MHD_create_response_from_callback(pos, 64*1024, multipart_reader, mp, multipart_free);
+}
+
 void
 web_file(char *filename, char *type)
 {
@@ -262,6 +708,12 @@ web_file(char *filename, char *type)
     int fd;
     struct stat statbuf;
     int ret;
+    byterange ranges[NRANGES];
+    int nranges = -1;
+    uint64_t size, len;
+    char etag[64], modified[64], contentrange[128];
+    const char *range, *ifrange;
+    struct tm tm;
     
     fd = open(filename, O_RDONLY);  // file is closed by MHD_destroy_response
     if (fd == -1)
@@ -269,13 +721,51 @@ web_file(char *filename, char *type)
     ret = fstat(fd, &statbuf);
     if (ret != 0)
         stl_error("web_file: couldn't stat file %s", filename);
-    
-    stl_log("file is %llu bytes", statbuf.st_size);
-    response = MHD_create_response_from_fd(statbuf.st_size, fd);
-    MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, type);
+    size = statbuf.st_size;
+    WEB_DEBUG("file is %llu bytes", (unsigned long long)size);
+
+    // validators, If-Range must match one of these for the Range header to be honoured
+    snprintf(etag, sizeof(etag), "\"%llx-%llx\"", (unsigned long long)size, (unsigned long long)statbuf.st_mtime);
+    gmtime_r(&statbuf.st_mtime, &tm);
+    strftime(modified, sizeof(modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+    range = MHD_lookup_connection_value(req_connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_RANGE);
+    ifrange = MHD_lookup_connection_value(req_connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_IF_RANGE);
+    if (range && strcmp(req_method, MHD_HTTP_METHOD_GET) == 0 &&
+            (ifrange == NULL || strcmp(ifrange, etag) == 0 || strcmp(ifrange, modified) == 0))
+        nranges = range_parse(range, size, ranges);
+
+    if (nranges == 0) {
+        // no range overlaps the file
+        WEB_DEBUG("web_file: range %s not satisfiable", range);
+        close(fd);
+        response = MHD_create_response_from_buffer(0, "", MHD_RESPMEM_PERSISTENT);
+        snprintf(contentrange, sizeof(contentrange), "bytes */%llu", (unsigned long long)size);
+        MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_RANGE, contentrange);
+        len = 0;
+    } else if (nranges == 1) {
+        WEB_DEBUG("web_file: range %llu-%llu", (unsigned long long)ranges[0].first, (unsigned long long)ranges[0].last);
+        len = ranges[0].last - ranges[0].first + 1;
+        response = MHD_create_response_from_fd_at_offset64(len, fd, ranges[0].first);
+        snprintf(contentrange, sizeof(contentrange), "bytes %llu-%llu/%llu", (unsigned long long)ranges[0].first,
+            (unsigned long long)ranges[0].last, (unsigned long long)size);
+        MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_RANGE, contentrange);
+        MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, type);
+    } else if (nranges > 1) {
+        WEB_DEBUG("web_file: %d ranges", nranges);
+        response = multipart_response(fd, type, size, ranges, nranges, &len);
+        MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, "multipart/byteranges; boundary=" RANGE_BOUNDARY);
+    } else {
+        len = size;
+        response = MHD_create_response_from_fd_at_offset64(size, fd, 0);
+        MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, type);
+    }
+    MHD_add_response_header(response, MHD_HTTP_HEADER_ACCEPT_RANGES, "bytes");
+    MHD_add_response_header(response, MHD_HTTP_HEADER_ETAG, etag);
+    MHD_add_response_header(response, MHD_HTTP_HEADER_LAST_MODIFIED, modified);
     MHD_add_response_header(response, MHD_HTTP_HEADER_CONNECTION, "close");
-    req_response_status = MHD_queue_response(req_connection, MHD_HTTP_OK, response);
-    MHD_destroy_response(response);
+    queue_response(nranges == 0 ? MHD_HTTP_RANGE_NOT_SATISFIABLE :
+                   nranges > 0  ? MHD_HTTP_PARTIAL_CONTENT : MHD_HTTP_OK, response, len);
 }
 
 void
@@ -287,118 +777,2336 @@ web_data(void *data, int len, char *type)
     send_data(data, len, type);
 }
 
-//------------------- support
+
+//------------------- JSON and binary encoding of numeric arrays
+//
+// The JSON response is built up field by field in a heap buffer which is reused
+// between requests.  Numbers use the shortest %g precision that reads back exactly.
+
+// element types, must match webserver.typecode
+enum { WEB_DOUBLE=0, WEB_SINGLE=1, WEB_INT32=2, WEB_UINT8=3, WEB_LOGICAL=4, WEB_INT64=5 };
+
+static char   *json_buf;
+static size_t  json_len;
+static size_t  json_size;
+
+static char *
+json_reserve(size_t n)
+{
+    // make sure there is room for n more bytes, return pointer to the end
+    if (json_len + n > json_size) {
+        json_size = (json_len + n) * 2;
+        json_buf = (char *)realloc(json_buf, json_size);
+    }
+    return json_buf + json_len;
+}
+
+static void
+json_append(const char *s, size_t n)
+{
+    memcpy(json_reserve(n), s, n);
+    json_len += n;
+}
+
+static void
+json_string(const char *s)
+{
+    // quoted and escaped string
+    json_append("\"", 1);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            char esc[2] = {'\\', c};
+            json_append(esc, 2);
+        } else if (c < 0x20) {
+            char esc[8];
+            json_append(esc, snprintf(esc, sizeof(esc), "\\u%04x", c));
+        } else
+            json_append((char *)&c, 1);
+    }
+    json_append("\"", 1);
+}
+
+static void
+json_double(double v, int single)
+{
+    char *p = json_reserve(32);
+    int   n, prec;
+
+    if (v != v || v - v != 0) {
+        // NaN and Inf are not representable in JSON
+        json_append("null", 4);
+        return;
+    }
+    if (v > -1e15 && v < 1e15 && v == (int64_t)v) {
+        // integer valued, the common case for counters and indices
+        n = snprintf(p, 32, "%lld", (long long)v);
+    } else if (single) {
+        for (prec=6; prec<9; prec++) {
+            n = snprintf(p, 32, "%.*g", prec, v);
+            if ((float)strtod(p, NULL) == (float)v)
+                break;
+        }
+        if (prec == 9)
+            n = snprintf(p, 32, "%.9g", v);
+    } else {
+        for (prec=15; prec<17; prec++) {
+            n = snprintf(p, 32, "%.*g", prec, v);
+            if (strtod(p, NULL) == v)
+                break;
+        }
+        if (prec == 17)
+            n = snprintf(p, 32, "%.17g", v);
+    }
+    json_len += n;
+}
+
+static void
+json_element(const void *data, int type, int i)
+{
+    char tmp[24];
+
+    switch (type) {
+        case WEB_DOUBLE:  json_double(((const double *)data)[i], 0); break;
+        case WEB_SINGLE:  json_double(((const float *)data)[i], 1); break;
+        case WEB_INT32:   json_append(tmp, snprintf(tmp, sizeof(tmp), "%d", ((const int32_t *)data)[i])); break;
+        case WEB_INT64:   json_append(tmp, snprintf(tmp, sizeof(tmp), "%lld", (long long)((const int64_t *)data)[i])); break;
+        case WEB_UINT8:   json_append(tmp, snprintf(tmp, sizeof(tmp), "%d", ((const uint8_t *)data)[i])); break;
+        case WEB_LOGICAL:
+            if (((const uint8_t *)data)[i])
+                json_append("true", 4);
+            else
+                json_append("false", 5);
+            break;
+        default:
+            stl_error("web_json: unknown type code %d", type);
+    }
+}
+
+static void
+json_key(const char *name)
+{
+    // separator and key for the next field of the top level object
+    json_append(json_len > 1 ? "," : "", json_len > 1);
+    json_string(name);
+    json_append(":", 1);
+}
 
 /**
- * Set a value for the template processor
+ * Start building a JSON object response
  */
-void web_setvalue(char *name, char *value)
+void
+web_json_begin()
 {
-    WEB_DEBUG("web_setvalue: %s %s", name, value);
-    
-    // this function copies name/value to the heap
-    req_varlist = TMPL_add_var(req_varlist, name, value, NULL);
+    json_len = 0;
+    json_append("{", 1);
 }
 
+/**
+ * Add a numeric field to the JSON object
+ *
+ * A scalar is a number, a vector is an array, a matrix is an array of rows.  Data is
+ * in MATLAB column-major order.
+ */
 void
-web_start(int32_t port, char *callback, void *arg)
+web_json_number(char *name, void *data, int32_t type, int32_t rows, int32_t cols)
 {
-    if (daemon)
-        stl_error("web server already launched");
-        
-    request_matlab_callback = stl_get_functionptr(callback);
-    if (request_matlab_callback == NULL)
-        stl_error("MATLAB entrypoint named [%s] not found", callback);
-        
-    daemon = MHD_start_daemon (MHD_USE_INTERNAL_POLLING_THREAD, port,
-                             NULL, NULL,
-                             &page_request, arg,
-                             MHD_OPTION_END);
-    
-    // this starts a POSIX thread but its handle is very well buried
-    // its name will be MHD-single but this is not gettable under MacOS
-    
-    if (daemon == NULL)
-        stl_error("web server failed to launch: %s", strerror(errno));
-    
-     stl_log("web server starting on port %u", port);
+    json_key(name);
+
+    if (rows == 1 && cols == 1) {
+        json_element(data, type, 0);
+    } else if (rows == 1 || cols == 1) {
+        int n = rows * cols;
+
+        json_append("[", 1);
+        for (int i=0; i<n; i++) {
+            if (i)
+                json_append(",", 1);
+            json_element(data, type, i);
+        }
+        json_append("]", 1);
+    } else {
+        json_append("[", 1);
+        for (int r=0; r<rows; r++) {
+            json_append(r ? ",[" : "[", r ? 2 : 1);
+            for (int c=0; c<cols; c++) {
+                if (c)
+                    json_append(",", 1);
+                json_element(data, type, r + c*rows);
+            }
+            json_append("]", 1);
+        }
+        json_append("]", 1);
+    }
 }
 
-static void
-send_data(void *s, int len, char *type)
+/**
+ * Add a string field to the JSON object
+ */
+void
+web_json_string(char *name, char *value)
+{
+    json_key(name);
+    json_string(value);
+}
+
+/**
+ * Send the JSON object to the browser
+ */
+void
+web_json_end()
 {
     struct MHD_Response *response;
-    
-    response = MHD_create_response_from_buffer(len, s, MHD_RESPMEM_MUST_COPY);
-    MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, type);
-    req_response_status = MHD_queue_response(req_connection, MHD_HTTP_OK, response);
-    MHD_destroy_response(response);
+
+    json_append("}", 1);
+    WEB_DEBUG("web_json: %d bytes", (int)json_len);
+    page_request_responses++; // indicate a reponse to the request
+
+    response = MHD_create_response_from_buffer(json_len, json_buf, MHD_RESPMEM_MUST_COPY);
+    MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, "application/json");
+    queue_response(MHD_HTTP_OK, response, json_len);
+    cache_store(json_buf, json_len, "application/json");
 }
 
+/**
+ * Send a numeric array to the browser in binary form
+ *
+ * The body is a header followed by the raw little-endian elements in MATLAB column-major
+ * order.  The header is the 3 characters "STL", a type character ('d' float64,
+ * 'f' float32, 'i' int32, 'l' int64, 'B' uint8), a uint32 number of dimensions and a
+ * uint32 for each dimension, zero padded to a multiple of 8 bytes so the elements can be
+ * viewed in place by a JavaScript typed array.  If outtype is WEB_SINGLE double data is
+ * converted to float32.
+ */
 void
-web_debug(int32_t debug)
+web_binary(void *data, int32_t type, int32_t outtype, int32_t ndims, int32_t *dims)
 {
-    web_debug_flag = debug;
+    struct MHD_Response *response;
+    static const char typechar[] = "dfiBBl";
+    static const int  typesize[] = {8, 4, 4, 1, 1, 8};
+    size_t  n = 1, hlen, len;
+    char   *buf;
+    uint32_t *hdr;
+
+    if (type < 0 || type > WEB_INT64)
+        stl_error("web_binary: unknown type code %d", type);
+    if (outtype != WEB_SINGLE || type != WEB_DOUBLE)
+        outtype = type;
+
+    for (int i=0; i<ndims; i++)
+        n *= dims[i];
+    hlen = (8 + 4*ndims + 7) & ~7;
+    len = hlen + n * typesize[outtype];
+
+    WEB_DEBUG("web_binary: %d elements, %d bytes", (int)n, (int)len);
+    page_request_responses++; // indicate a reponse to the request
+
+    buf = (char *)calloc(len, 1);
+    memcpy(buf, "STL", 3);
+    buf[3] = typechar[outtype];
+    hdr = (uint32_t *)(buf + 4);
+    hdr[0] = ndims;
+    for (int i=0; i<ndims; i++)
+        hdr[1+i] = dims[i];
+
+    if (outtype == type)
+        memcpy(buf + hlen, data, n * typesize[type]);
+    else {
+        float  *f = (float *)(buf + hlen);
+        double *d = (double *)data;
+        for (size_t i=0; i<n; i++)
+            f[i] = (float)d[i];
+    }
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    // the wire format is little-endian
+    for (int i=0; i<=ndims; i++)
+        hdr[i] = __builtin_bswap32(hdr[i]);
+    if (typesize[outtype] > 1) {
+        for (size_t i=0; i<n; i++) {
+            char *e = buf + hlen + i * typesize[outtype];
+            for (int j=0; j<typesize[outtype]/2; j++) {
+                char t = e[j];
+                e[j] = e[typesize[outtype]-1-j];
+                e[typesize[outtype]-1-j] = t;
+            }
+        }
+    }
+#endif
+
+    if (req_cachettl > 0) {
+        // cacheable, MHD gets a copy so the buffer is still ours to cache once queued
+        response = MHD_create_response_from_buffer(len, buf, MHD_RESPMEM_MUST_COPY);
+        MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, "application/octet-stream");
+        queue_response(MHD_HTTP_OK, response, len);
+        cache_store(buf, len, "application/octet-stream");
+        free(buf);
+    } else {
+        // MHD takes ownership of the buffer, no copy
+        response = MHD_create_response_from_buffer(len, buf, MHD_RESPMEM_MUST_FREE);
+        MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, "application/octet-stream");
+        queue_response(MHD_HTTP_OK, response, len);
+    }
 }
 
-static int
-print_key (void *cls, enum MHD_ValueKind kind, const char *key,
-               const char *value)
+//------------------- metrics and access log
+//
+// Every request is timed from arrival to queueing of the response, and recorded by
+// path into a fixed table of histograms.  The path is the route pattern if a route
+// matched, otherwise the URL.  Counters are updated with atomic operations so they can
+// be read from any thread without a lock.  Optionally each request is also written to
+// a binary access log by a background thread, via a lock-free single producer ring.
+
+static const double metrics_bounds[NLATENCY] = {   // histogram bucket upper bounds, seconds
+    50e-6, 100e-6, 250e-6, 500e-6, 1e-3, 2.5e-3, 5e-3, 10e-3, 25e-3, 50e-3, 100e-3, 250e-3, 500e-3, 1.0
+};
+
+typedef struct _metric {
+    const char *path;       // NULL if the slot is free
+    uint64_t    count;
+    uint64_t    sum_ns;
+    uint64_t    bytes;
+    uint64_t    bucket[NLATENCY+1];  // last bucket is +Inf
+    uint64_t    status[6];          // 1xx to 5xx, index 0 for no response
+} metric;
+
+static metric metrics[NMETRICS];
+
+// access log record, fixed size, host byte order
+typedef struct _logrecord {
+    uint64_t    time_ns;    // CLOCK_REALTIME at arrival
+    uint32_t    duration_us;
+    uint16_t    status;
+    char        method[2];  // first two characters of the method
+    uint64_t    bytes;
+    char        url[40];    // truncated, null terminated unless exactly 40 characters
+} logrecord;
+
+static logrecord    accesslog_ring[NLOGRECORDS];
+static uint32_t     accesslog_head;     // next slot to write, only written by the web thread
+static uint32_t     accesslog_tail;     // next slot to read, only written by the log thread
+static uint64_t     accesslog_dropped;
+static FILE        *accesslog_fp;
+static pthread_t    accesslog_thread;
+
+static uint64_t
+now_ns(clockid_t clock)
 {
-  stl_log ("%s: %s=%s", (char *)cls, key, value);
-  return MHD_YES;
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-// manage list of POST variables
-typedef struct _postvars {
-    char *key;
-    char *value;
-    struct _postvars *next;
-} postvar;
-        
-static postvar *pvhead = NULL;
+static metric *
+metrics_find(const char *path)
+{
+    // find or claim the slot for this path, the last slot collects any overflow
+    uint32_t h = postvar_hash(path);
 
-void 
-postvar_add(char *key, char *value)
+    for (int i=0; i<NMETRICS-1; i++) {
+        metric *mp = &metrics[(h + i) % (NMETRICS-1)];
+        const char *p = __atomic_load_n(&mp->path, __ATOMIC_ACQUIRE);
+
+        if (p == NULL) {
+            char *copy = stl_stralloc((char *)path);
+            if (__atomic_compare_exchange_n(&mp->path, &p, copy, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                return mp;
+            free(copy);     // lost the race, p is now the winner's path
+        }
+        if (strcmp(p, path) == 0)
+            return mp;
+    }
+    return &metrics[NMETRICS-1];
+}
+
+static void
+metrics_record(uint64_t start)
 {
-    // expect both args to on the heap
-    
-    // create an entry for the list of POST vars
-    postvar *pv = (postvar *) malloc(sizeof(postvar));
-    pv->key = key;
-    pv->value = value;
-    
-    // insert at head of list
-    pv->next = pvhead;
-    pvhead = pv;
+    uint64_t dur = now_ns(CLOCK_MONOTONIC) - start;
+    metric  *mp = metrics_find(req_route ? req_route : req_url);
+    int      b;
+
+    for (b=0; b<NLATENCY; b++)
+        if (dur <= metrics_bounds[b] * 1e9)
+            break;
+    __atomic_fetch_add(&mp->bucket[b], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&mp->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&mp->sum_ns, dur, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&mp->bytes, req_bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&mp->status[req_status/100 < 6 ? req_status/100 : 0], 1, __ATOMIC_RELAXED);
+
+    if (accesslog_fp) {
+        uint32_t head = accesslog_head;
+
+        if (head - __atomic_load_n(&accesslog_tail, __ATOMIC_ACQUIRE) == NLOGRECORDS) {
+            accesslog_dropped++;    // log thread has fallen behind
+            return;
+        }
+        logrecord *lp = &accesslog_ring[head % NLOGRECORDS];
+        lp->time_ns = now_ns(CLOCK_REALTIME) - dur;
+        lp->duration_us = dur / 1000;
+        lp->status = req_status;
+        lp->method[0] = req_method[0];
+        lp->method[1] = req_method[1];
+        lp->bytes = req_bytes;
+        strncpy(lp->url, req_url, sizeof(lp->url));
+        __atomic_store_n(&accesslog_head, head+1, __ATOMIC_RELEASE);
+    }
 }
 
-char *
-postvar_find(char *key)
+static void *
+accesslog_writer(void *arg)
 {
-    postvar *pv = pvhead;
-    
-    while (pv) {
-        if (strcmp(pv->key, key) == 0) {
-            // found it
-            return pv->value;
+    stl_thread_add("WEBLOG");
+
+    for (;;) {
+        uint32_t head = __atomic_load_n(&accesslog_head, __ATOMIC_ACQUIRE);
+        uint32_t tail = accesslog_tail;
+
+        if (head == tail) {
+            stl_sleep(0.1);
+            fflush(accesslog_fp);
+            continue;
         }
-        pv = pv->next;
+        // write the contiguous run of records up to the end of the ring
+        uint32_t n = head - tail;
+        uint32_t first = tail % NLOGRECORDS;
+        if (first + n > NLOGRECORDS)
+            n = NLOGRECORDS - first;
+        fwrite(&accesslog_ring[first], sizeof(logrecord), n, accesslog_fp);
+        __atomic_store_n(&accesslog_tail, tail+n, __ATOMIC_RELEASE);
     }
     return NULL;
 }
 
-void 
-postvar_free()
+/**
+ * Enable the built-in /metrics page
+ */
+void
+web_metrics(int32_t enable)
 {
-    postvar *pv = pvhead;
-    
-    while (pv) {
-        free(pv->key);
-        free(pv->value);
-        postvar *next = pv->next;
-        free(pv);
-        pv = next;
-    }
-    pvhead = NULL;
-}
\ No newline at end of file
+    metrics_enabled = enable;
+}
+
+/**
+ * Write a binary record of every request to the specified file
+ */
+void
+web_accesslog(char *filename)
+{
+    if (accesslog_fp)
+        stl_error("web_accesslog: access log already open");
+    accesslog_fp = fopen(filename, "ab");
+    if (accesslog_fp == NULL)
+        stl_error("web_accesslog: couldn't open %s %s", filename, strerror(errno));
+    if (pthread_create(&accesslog_thread, NULL, accesslog_writer, NULL))
+        stl_error("web_accesslog: thread create failed");
+}
+
+static void
+metrics_label(FILE *fp, const char *s)
+{
+    // label value with Prometheus escapes
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', fp);
+        if (*s == '\n')
+            fputs("\\n", fp);
+        else
+            fputc(*s, fp);
+    }
+}
+
+static void
+metrics_send()
+{
+    struct MHD_Response *response;
+    char   *buf;
+    size_t  len;
+    FILE   *fp = open_memstream(&buf, &len);
+    static const char *status_class[] = {"none", "1xx", "2xx", "3xx", "4xx", "5xx"};
+
+    page_request_responses++; // indicate a reponse to the request
+
+    fprintf(fp, "# HELP web_request_duration_seconds Time from request arrival to response queued.\n");
+    fprintf(fp, "# TYPE web_request_duration_seconds histogram\n");
+    for (int i=0; i<NMETRICS; i++) {
+        metric *mp = &metrics[i];
+        const char *path = i == NMETRICS-1 ? "other" : __atomic_load_n(&mp->path, __ATOMIC_ACQUIRE);
+        uint64_t cum = 0;
+
+        if (path == NULL || mp->count == 0)
+            continue;
+        for (int b=0; b<=NLATENCY; b++) {
+            cum += __atomic_load_n(&mp->bucket[b], __ATOMIC_RELAXED);
+            fprintf(fp, "web_request_duration_seconds_bucket{path=\"");
+            metrics_label(fp, path);
+            if (b < NLATENCY)
+                fprintf(fp, "\",le=\"%g\"} %llu\n", metrics_bounds[b], (unsigned long long)cum);
+            else
+                fprintf(fp, "\",le=\"+Inf\"} %llu\n", (unsigned long long)cum);
+        }
+        fprintf(fp, "web_request_duration_seconds_sum{path=\"");
+        metrics_label(fp, path);
+        fprintf(fp, "\"} %.9f\n", mp->sum_ns * 1e-9);
+        fprintf(fp, "web_request_duration_seconds_count{path=\"");
+        metrics_label(fp, path);
+        fprintf(fp, "\"} %llu\n", (unsigned long long)cum);
+    }
+
+    fprintf(fp, "# HELP web_responses_total Responses by path and status class.\n");
+    fprintf(fp, "# TYPE web_responses_total counter\n");
+    for (int i=0; i<NMETRICS; i++) {
+        metric *mp = &metrics[i];
+        const char *path = i == NMETRICS-1 ? "other" : __atomic_load_n(&mp->path, __ATOMIC_ACQUIRE);
+
+        if (path == NULL || mp->count == 0)
+            continue;
+        for (int c=0; c<6; c++) {
+            if (mp->status[c] == 0)
+                continue;
+            fprintf(fp, "web_responses_total{path=\"");
+            metrics_label(fp, path);
+            fprintf(fp, "\",code=\"%s\"} %llu\n", status_class[c], (unsigned long long)mp->status[c]);
+        }
+    }
+
+    fprintf(fp, "# HELP web_response_bytes_total Response body bytes by path.\n");
+    fprintf(fp, "# TYPE web_response_bytes_total counter\n");
+    for (int i=0; i<NMETRICS; i++) {
+        metric *mp = &metrics[i];
+        const char *path = i == NMETRICS-1 ? "other" : __atomic_load_n(&mp->path, __ATOMIC_ACQUIRE);
+
+        if (path == NULL || mp->count == 0)
+            continue;
+        fprintf(fp, "web_response_bytes_total{path=\"");
+        metrics_label(fp, path);
+        fprintf(fp, "\"} %llu\n", (unsigned long long)mp->bytes);
+    }
+
+    fprintf(fp, "# TYPE web_cache_hits_total counter\nweb_cache_hits_total %llu\n", (unsigned long long)cache_hits);
+    fprintf(fp, "# TYPE web_cache_misses_total counter\nweb_cache_misses_total %llu\n", (unsigned long long)cache_misses);
+    fprintf(fp, "# TYPE web_accesslog_dropped_total counter\n");
+    fprintf(fp, "web_accesslog_dropped_total %llu\n", (unsigned long long)accesslog_dropped);
+
+    // thread, mutex and semaphore counters from the thread library
+    stl_metrics(fp);
+
+    fclose(fp);
+
+    response = MHD_create_response_from_buffer(len, buf, MHD_RESPMEM_MUST_FREE);
+    MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, "text/plain; version=0.0.4");
+    queue_response(MHD_HTTP_OK, response, len);
+}
+
+static void
+profile_send()
+{
+    // samples from the thread library's profiler as folded stacks
+    struct MHD_Response *response;
+    char   *buf;
+    size_t  len;
+    FILE   *fp = open_memstream(&buf, &len);
+
+    page_request_responses++; // indicate a reponse to the request
+
+    stl_profile_write(fp);
+    fclose(fp);
+
+    response = MHD_create_response_from_buffer(len, buf, MHD_RESPMEM_MUST_FREE);
+    MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, "text/plain");
+    queue_response(MHD_HTTP_OK, response, len);
+}
+
+//------------------- deferred responses
+//
+// The MATLAB callback can defer its response, the connection is suspended so the
+// polling thread carries on serving other clients.  Any thread can later complete
+// the request, which stores the response and resumes the connection.  MHD then calls
+// page_request again for the connection, and the response is queued from there since
+// MHD only allows that from within the access handler.
+
+/**
+ * Defer the response to the current request, return a token for web_complete
+ */
+int32_t
+web_defer()
+{
+    deferred *p, *dp = NULL;
+    int slot;
+
+    page_request_responses++; // indicate a reponse to the request
+
+    pthread_mutex_lock(&deferlist_mutex);
+    for (p=deferlist, slot=0; slot<NDEFERRED; slot++, p++) {
+        if (p->busy == 0) {
+            dp = p;
+            dp->busy = 1;
+            // wrap so that the token stays positive on a long running server
+            dp->generation = (dp->generation + 1) % (INT32_MAX / NDEFERRED);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&deferlist_mutex);
+    if (dp == NULL)
+        stl_error("web_defer: too many deferred requests, increase NDEFERRED (currently %d)", NDEFERRED);
+
+    dp->connection = req_connection;
+    dp->response = NULL;
+    dp->completed = 0;
+    dp->url = stl_stralloc(req_url);
+    dp->method = stl_stralloc(req_method);
+
+    WEB_DEBUG("web_defer: #%d for URL %s", slot, req_url);
+
+    MHD_suspend_connection(req_connection);
+    req_deferred = dp;
+    req_response_status = MHD_YES;
+
+    // the token encodes the generation so a stale token is detected
+    return dp->generation * NDEFERRED + slot;
+}
+
+/**
+ * Complete a deferred request with the given status and body, callable from any thread
+ *
+ * Returns false if the client has gone away or the request was already completed.
+ */
+int32_t
+web_complete(int32_t token, int32_t status, void *data, int len, char *type)
+{
+    struct MHD_Response *response;
+    deferred *dp;
+    int slot = token % NDEFERRED;
+
+    if (token < 0)
+        stl_error("web_complete: bad token %d", token);
+    dp = &deferlist[slot];
+
+    WEB_DEBUG("web_complete: #%d status %d, %d bytes, type %s", slot, status, len, type);
+
+    response = MHD_create_response_from_buffer(len, data, MHD_RESPMEM_MUST_COPY);
+    MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, type);
+
+    pthread_mutex_lock(&deferlist_mutex);
+    if (dp->busy == 0 || dp->generation != token / NDEFERRED || dp->completed) {
+        pthread_mutex_unlock(&deferlist_mutex);
+        MHD_destroy_response(response);
+        WEB_DEBUG("web_complete: #%d no longer pending", slot);
+        return 0;
+    }
+    dp->response = response;
+    dp->status = status;
+    dp->bytes = len;
+    dp->completed = 1;
+
+    // have MHD call page_request again for this connection
+    MHD_resume_connection(dp->connection);
+    pthread_mutex_unlock(&deferlist_mutex);
+
+    return 1;
+}
+
+static int
+deferred_answer(deferred *dp)
+{
+    struct MHD_Response *response;
+
+    pthread_mutex_lock(&deferlist_mutex);
+    response = dp->response;
+    dp->response = NULL;
+    pthread_mutex_unlock(&deferlist_mutex);
+    if (response == NULL)
+        return MHD_YES;     // spurious wakeup, still waiting
+
+    req_url = dp->url;
+    req_method = dp->method;
+    req_route = dp->route;
+    queue_response(dp->status, response, dp->bytes);
+    metrics_record(dp->start);
+
+    // the slot is released when MHD reports the request completed
+    return req_response_status;
+}
+
+//------------------- rate limiting
+//
+// Each client address has a token bucket which fills at rate_limit tokens per second
+// up to rate_burst.  A request takes a token, or is rejected if there are none.  The
+// table is only touched by the polling thread so needs no lock, when it is full the
+// least recently seen client is replaced.
+
+typedef struct _client {
+    unsigned char addr[16];     // IPv4 or IPv6 address
+    int     used;
+    double  tokens;
+    uint64_t last;      // time of last refill, ns
+} client;
+
+static client clientlist[NCLIENTS];
+
+static int
+rate_check(struct MHD_Connection *connection)
+{
+    const union MHD_ConnectionInfo *info;
+    const struct sockaddr *sa;
+    unsigned char addr[16] = {0};
+    uint64_t now = now_ns(CLOCK_MONOTONIC);
+    client  *cp, *oldest = &clientlist[0];
+    uint32_t h = 2166136261u;
+    int      i;
+
+    info = MHD_get_connection_info(connection, MHD_CONNECTION_INFO_CLIENT_ADDRESS);
+    if (info == NULL || info->client_addr == NULL)
+        return 1;
+    sa = info->client_addr;
+    if (sa->sa_family == AF_INET)
+        memcpy(addr, &((const struct sockaddr_in *)sa)->sin_addr, 4);
+    else if (sa->sa_family == AF_INET6)
+        memcpy(addr, &((const struct sockaddr_in6 *)sa)->sin6_addr, 16);
+
+    // FNV-1a hash of the address, then linear probe
+    for (i=0; i<16; i++)
+        h = (h ^ addr[i]) * 16777619u;
+    for (i=0; i<NCLIENTS; i++) {
+        cp = &clientlist[(h + i) % NCLIENTS];
+        if (!cp->used || memcmp(cp->addr, addr, 16) == 0)
+            break;
+        if (cp->last < oldest->last)
+            oldest = cp;
+    }
+    if (i == NCLIENTS)
+        cp = oldest;    // table full, forget the least recent client
+    if (!cp->used || memcmp(cp->addr, addr, 16) != 0) {
+        memcpy(cp->addr, addr, 16);
+        cp->used = 1;
+        cp->tokens = rate_burst;
+        cp->last = now;
+    }
+
+    // refill the bucket for the time since the last request
+    cp->tokens += (now - cp->last) * 1e-9 * rate_limit;
+    if (cp->tokens > rate_burst)
+        cp->tokens = rate_burst;
+    cp->last = now;
+
+    if (cp->tokens < 1)
+        return 0;
+    cp->tokens -= 1;
+    return 1;
+}
+
+//------------------- response cache
+//
+// GET responses for URLs matching a cache rule are kept for the rule's lifetime and
+// served by the polling thread without calling MATLAB code.  The key is the URL plus
+// GET arguments.  Only in-memory 200 responses are cached: HTML, templates, data, JSON
+// and binary.  Entries can be dropped early by web_invalidate from any thread, so the
+// table is protected by a mutex which is only held briefly.  The table is small, so it
+// is simply scanned comparing hashes.
+
+typedef struct _cacherule {
+    char    *prefix;
+    size_t  len;
+    double  ttl;        // seconds
+} cacherule;
+
+typedef struct _cacheentry {
+    char    *key;       // NULL if the slot is free
+    uint32_t hash;
+    uint64_t expires;   // ns, CLOCK_MONOTONIC
+    char    *body;
+    size_t  len;
+    char    *type;
+} cacheentry;
+
+static cacherule  cacherules[NCACHERULES];
+static int        ncacherules;
+static cacheentry cachelist[NCACHE];
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+cache_addarg(void *cls, enum MHD_ValueKind kind, const char *key, const char *value)
+{
+    // append key=value to the cache key, give up if it is too long
+    size_t len = strlen(req_cachekey);
+    int    n = snprintf(req_cachekey+len, CACHE_KEYLEN-len, "%s=%s&", key, value ? value : "");
+
+    if (len + n >= CACHE_KEYLEN) {
+        req_cachettl = 0;
+        return MHD_NO;
+    }
+    return MHD_YES;
+}
+
+static void
+cache_drop(cacheentry *cp)
+{
+    free(cp->key);
+    free(cp->body);
+    free(cp->type);
+    cp->key = NULL;
+}
+
+static int
+cache_lookup(struct MHD_Connection *connection, const char *url, const char *method)
+{
+    // return true if the request was answered from the cache
+    struct MHD_Response *response;
+    cacherule *best = NULL;
+    uint32_t hash;
+    uint64_t now;
+    int      i;
+
+    req_cachettl = 0;
+    if (ncacherules == 0 || strcmp(method, MHD_HTTP_METHOD_GET) != 0)
+        return 0;
+
+    // longest matching prefix gives the lifetime
+    for (i=0; i<ncacherules; i++)
+        if (strncmp(url, cacherules[i].prefix, cacherules[i].len) == 0 && (!best || cacherules[i].len > best->len))
+            best = &cacherules[i];
+    if (best == NULL || best->ttl <= 0)
+        return 0;
+
+    req_cachettl = best->ttl;
+    snprintf(req_cachekey, CACHE_KEYLEN, "%s?", url);
+    MHD_get_connection_values(connection, MHD_GET_ARGUMENT_KIND, cache_addarg, NULL);
+    if (req_cachettl == 0)
+        return 0;   // key too long
+
+    hash = postvar_hash(req_cachekey);
+    now = now_ns(CLOCK_MONOTONIC);
+
+    pthread_mutex_lock(&cache_mutex);
+    for (i=0; i<NCACHE; i++) {
+        cacheentry *cp = &cachelist[i];
+
+        if (cp->key && cp->hash == hash && strcmp(cp->key, req_cachekey) == 0) {
+            if (cp->expires < now) {
+                cache_drop(cp);
+                break;
+            }
+            size_t len = cp->len;   // the entry can be replaced once the lock is dropped
+
+            WEB_DEBUG("web: cache hit for %s", req_cachekey);
+            page_request_responses++; // indicate a reponse to the request
+            response = MHD_create_response_from_buffer(len, cp->body, MHD_RESPMEM_MUST_COPY);
+            MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, cp->type);
+            pthread_mutex_unlock(&cache_mutex);
+            queue_response(MHD_HTTP_OK, response, len);
+            req_cachettl = 0;
+            cache_hits++;
+            return 1;
+        }
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    cache_misses++;
+    return 0;
+}
+
+static void
+cache_store(const void *body, size_t len, const char *type)
+{
+    // remember the response to the current request if it is cacheable
+    cacheentry *cp, *victim = NULL, *oldest = NULL;
+    uint32_t hash;
+    uint64_t now;
+
+    if (req_cachettl <= 0 || req_status != MHD_HTTP_OK || req_response_status != MHD_YES)
+        return;
+    hash = postvar_hash(req_cachekey);
+    now = now_ns(CLOCK_MONOTONIC);
+
+    pthread_mutex_lock(&cache_mutex);
+    for (int i=0; i<NCACHE; i++) {
+        cp = &cachelist[i];
+
+        if (cp->key && cp->hash == hash && strcmp(cp->key, req_cachekey) == 0) {
+            victim = cp;    // replace an earlier response for the same key
+            break;
+        }
+        if (victim == NULL && (cp->key == NULL || cp->expires < now))
+            victim = cp;    // first free slot
+        if (oldest == NULL || (cp->key && cp->expires < oldest->expires))
+            oldest = cp;
+    }
+    if (victim == NULL)
+        victim = oldest;    // table is full, replace the entry closest to expiry
+    if (victim->key)
+        cache_drop(victim);
+    victim->key = stl_stralloc(req_cachekey);
+    victim->hash = hash;
+    victim->expires = now + (uint64_t)(req_cachettl * 1e9);
+    victim->body = (char *)malloc(len ? len : 1);
+    memcpy(victim->body, body, len);
+    victim->len = len;
+    victim->type = stl_stralloc((char *)type);
+    pthread_mutex_unlock(&cache_mutex);
+
+    req_cachettl = 0;   // only one response per request
+}
+
+/**
+ * Cache GET responses for URLs starting with prefix for ttl seconds
+ */
+void
+web_cache(char *prefix, double ttl)
+{
+    int i;
+
+    pthread_mutex_lock(&cache_mutex);
+    for (i=0; i<ncacherules; i++)
+        if (strcmp(cacherules[i].prefix, prefix) == 0)
+            break;
+    if (i == ncacherules) {
+        if (ncacherules == NCACHERULES)
+            stl_error("web_cache: too many cache rules, increase NCACHERULES (currently %d)", NCACHERULES);
+        cacherules[i].prefix = stl_stralloc(prefix);
+        cacherules[i].len = strlen(prefix);
+        ncacherules++;
+    }
+    cacherules[i].ttl = ttl;
+    pthread_mutex_unlock(&cache_mutex);
+
+    WEB_DEBUG("web_cache: %s for %gs", prefix, ttl);
+}
+
+/**
+ * Drop cached responses for URLs starting with prefix, callable from any thread
+ */
+void
+web_invalidate(char *prefix)
+{
+    size_t len = strlen(prefix);
+    int    n = 0;
+
+    pthread_mutex_lock(&cache_mutex);
+    for (int i=0; i<NCACHE; i++) {
+        if (cachelist[i].key && strncmp(cachelist[i].key, prefix, len) == 0) {
+            cache_drop(&cachelist[i]);
+            n++;
+        }
+    }
+    pthread_mutex_unlock(&cache_mutex);
+
+    WEB_DEBUG("web_invalidate: %s, %d entries dropped", prefix, n);
+}
+
+//------------------- streaming responses
+//
+// A streaming response is created by the MATLAB callback and then fed with chunks
+// by any thread, typically a producer thread launched with stl.launch.  Each stream
+// has a bounded queue of chunks which is drained by MHD as the client accepts data.
+// When the queue is empty the connection is suspended, so the polling thread does not
+// spin, and it is resumed by the next push.
+
+typedef struct _chunk {
+    char    *data;
+    size_t  len;
+} chunk;
+
+typedef struct _stream {
+    struct MHD_Connection *connection;
+    pthread_mutex_t lock;
+    int     lock_init;  // lock has been initialized, slots are reused
+    int     busy;       // number of parties (MHD, producer) still using the slot
+    int     closed;     // producer has closed the stream
+    int     gone;       // client has disconnected
+    int     suspended;  // connection is suspended waiting for data
+    chunk   queue[NSTREAMCHUNKS];
+    int     head;       // index of next chunk to send
+    int     count;      // number of chunks in queue
+    size_t  offset;     // bytes of head chunk already sent
+    int     dropped;    // number of chunks dropped because queue was full
+} stream;
+
+static stream streamlist[NSTREAMS];
+static pthread_mutex_t streamlist_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+stream_release(stream *sp)
+{
+    // drop one reference to the stream, free the slot when nobody is using it
+    pthread_mutex_lock(&sp->lock);
+    if (--sp->busy == 0) {
+        while (sp->count > 0) {
+            free(sp->queue[sp->head].data);
+            sp->head = (sp->head + 1) % NSTREAMCHUNKS;
+            sp->count--;
+        }
+    }
+    pthread_mutex_unlock(&sp->lock);
+}
+
+static ssize_t
+stream_reader(void *cls, uint64_t pos, char *buf, size_t max)
+{
+    // called by MHD when the client can accept more data
+    stream *sp = (stream *)cls;
+    chunk  *cp;
+    size_t  n;
+
+    pthread_mutex_lock(&sp->lock);
+    if (sp->count == 0) {
+        if (sp->closed) {
+            pthread_mutex_unlock(&sp->lock);
+            return MHD_CONTENT_READER_END_OF_STREAM;
+        }
+        // nothing to send, park the connection until the producer pushes
+        sp->suspended = 1;
+        MHD_suspend_connection(sp->connection);
+        pthread_mutex_unlock(&sp->lock);
+        return 0;
+    }
+
+    // copy as much of the head chunk as will fit
+    cp = &sp->queue[sp->head];
+    n = cp->len - sp->offset;
+    if (n > max)
+        n = max;
+    memcpy(buf, cp->data + sp->offset, n);
+    sp->offset += n;
+
+    if (sp->offset == cp->len) {
+        // chunk completely sent, dequeue it
+        free(cp->data);
+        sp->head = (sp->head + 1) % NSTREAMCHUNKS;
+        sp->count--;
+        sp->offset = 0;
+    }
+    pthread_mutex_unlock(&sp->lock);
+
+    return n;
+}
+
+static void
+stream_free(void *cls)
+{
+    // called by MHD when the response is finished or the client went away
+    stream *sp = (stream *)cls;
+    int     dropped;
+
+    pthread_mutex_lock(&sp->lock);
+    sp->gone = 1;
+    dropped = sp->dropped;
+    pthread_mutex_unlock(&sp->lock);
+
+    WEB_DEBUG("stream #%d finished, %d chunks dropped", (int)(sp - streamlist), dropped);
+    stream_release(sp);
+}
+
+static int
+stream_push(int32_t id, char *data, size_t len)
+{
+    // push a heap allocated chunk onto the stream's queue, takes ownership of data
+    stream *sp;
+    int     tail;
+
+    if (id < 0 || id >= NSTREAMS || streamlist[id].busy == 0)
+        stl_error("web_stream: stream %d not allocated", id);
+    sp = &streamlist[id];
+
+    pthread_mutex_lock(&sp->lock);
+    if (sp->gone || sp->closed) {
+        pthread_mutex_unlock(&sp->lock);
+        free(data);
+        return 0;   // client has gone, tell the producer to stop
+    }
+
+    if (sp->count == NSTREAMCHUNKS) {
+        // queue is full, client is too slow, discard the oldest unsent chunk
+        if (sp->offset == 0) {
+            free(sp->queue[sp->head].data);
+            sp->head = (sp->head + 1) % NSTREAMCHUNKS;
+            sp->count--;
+            sp->dropped++;
+        } else {
+            // head chunk is partially sent, can't drop it, drop this one instead
+            sp->dropped++;
+            pthread_mutex_unlock(&sp->lock);
+            free(data);
+            return 1;
+        }
+    }
+    tail = (sp->head + sp->count) % NSTREAMCHUNKS;
+    sp->queue[tail].data = data;
+    sp->queue[tail].len = len;
+    sp->count++;
+
+    if (sp->suspended) {
+        sp->suspended = 0;
+        MHD_resume_connection(sp->connection);
+    }
+    pthread_mutex_unlock(&sp->lock);
+
+    return 1;
+}
+
+/**
+ * Respond to the current request with a stream, return the stream id
+ */
+int32_t
+web_stream(char *type)
+{
+    struct MHD_Response *response;
+    stream *p, *sp = NULL;
+    int slot;
+
+    WEB_DEBUG("web_stream: type %s", type);
+    page_request_responses++; // indicate a reponse to the request
+
+    // find an empty slot
+    pthread_mutex_lock(&streamlist_mutex);
+    for (p=streamlist, slot=0; slot<NSTREAMS; slot++, p++) {
+        if (p->busy == 0) {
+            sp = p;
+            if (sp->lock_init == 0) {
+                pthread_mutex_init(&sp->lock, NULL);
+                sp->lock_init = 1;
+            }
+            sp->busy = 2;   // referenced by MHD and by the producer
+            break;
+        }
+    }
+    pthread_mutex_unlock(&streamlist_mutex);
+    if (sp == NULL)
+        stl_error("web_stream: too many streams, increase NSTREAMS (currently %d)", NSTREAMS);
+
+    sp->connection = req_connection;
+    sp->closed = 0;
+    sp->gone = 0;
+    sp->suspended = 0;
+    sp->head = 0;
+    sp->count = 0;
+    sp->offset = 0;
+    sp->dropped = 0;
+
+    // unknown size, so MHD uses chunked transfer encoding for HTTP/1.1
+    response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 32*1024,
+                        stream_reader, sp, stream_free);
+    MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, type);
+    MHD_add_response_header(response, MHD_HTTP_HEADER_CACHE_CONTROL, "no-cache");
+    queue_response(MHD_HTTP_OK, response, 0);
+
+    return slot;
+}
+
+/**
+ * Respond to the current request with an MJPEG stream, return the stream id
+ */
+int32_t
+web_stream_mjpeg()
+{
+    return web_stream("multipart/x-mixed-replace; boundary=" MJPEG_BOUNDARY);
+}
+
+/**
+ * Respond to the current request with a Server-Sent Events stream, return the stream id
+ */
+int32_t
+web_stream_sse()
+{
+    return web_stream("text/event-stream");
+}
+
+/**
+ * Send raw bytes on the stream, return false if the client has gone
+ */
+int32_t
+web_stream_send(int32_t id, void *data, int len)
+{
+    char *copy = (char *)malloc((size_t)len);
+
+    if (copy == NULL && len > 0)
+        stl_error("web_stream_send: out of memory");
+    memcpy(copy, data, len);
+    return stream_push(id, copy, len);
+}
+
+/**
+ * Send one frame of a multipart stream, return false if the client has gone
+ */
+int32_t
+web_stream_frame(int32_t id, void *data, int len, char *type)
+{
+    static const char *fmt = "--" MJPEG_BOUNDARY "\r\nContent-Type: %s\r\nContent-Length: %d\r\n\r\n";
+    int     hlen;
+    char   *frame;
+
+    // the whole frame is a single chunk so that it is never split if dropped,
+    // the header is formatted in place, sized first since type can be any length
+    hlen = snprintf(NULL, 0, fmt, type, len);
+    frame = (char *)malloc((size_t)hlen + len + 3);
+    if (frame == NULL)
+        stl_error("web_stream_frame: out of memory");
+    snprintf(frame, hlen + 1, fmt, type, len);
+    memcpy(frame+hlen, data, len);
+    memcpy(frame+hlen+len, "\r\n", 2);
+
+    return stream_push(id, frame, hlen + len + 2);
+}
+
+/**
+ * Send a Server-Sent Event, return false if the client has gone
+ */
+int32_t
+web_stream_event(int32_t id, char *event, char *data)
+{
+    const char *p;
+    char   *msg, *q;
+    size_t  n;
+    int     nlines = 1;
+
+    if (strpbrk(event, "\r\n"))
+        stl_error("web_stream_event: event name <%s> contains a newline", event);
+
+    // a newline would end the field, so each line of data is sent as a data field of
+    // its own, the browser joins them again with \n.  Lines end with \r\n, \r or \n
+    for (p=data; *p; p++)
+        if (*p == '\n' || (*p == '\r' && p[1] != '\n'))
+            nlines++;
+    msg = (char *)malloc(strlen(event) + 8 + strlen(data) + 7*nlines + 2);
+    if (msg == NULL)
+        stl_error("web_stream_event: out of memory");
+
+    // an empty event name means the default "message" event
+    q = msg;
+    if (*event)
+        q += sprintf(q, "event: %s\n", event);
+    for (p=data; ; p++) {
+        n = strcspn(p, "\r\n");
+        memcpy(q, "data: ", 6);
+        memcpy(q+6, p, n);
+        q += 6 + n;
+        *q++ = '\n';
+        p += n;
+        if (*p == 0)
+            break;
+        if (p[0] == '\r' && p[1] == '\n')
+            p++;
+    }
+    *q++ = '\n';
+
+    return stream_push(id, msg, q - msg);
+}
+
+/**
+ * Finish the stream, the client receives any queued data then end of stream
+ */
+void
+web_stream_close(int32_t id)
+{
+    stream *sp;
+
+    if (id < 0 || id >= NSTREAMS || streamlist[id].busy == 0)
+        stl_error("web_stream_close: stream %d not allocated", id);
+    sp = &streamlist[id];
+
+    WEB_DEBUG("web_stream_close: #%d", id);
+
+    pthread_mutex_lock(&sp->lock);
+    sp->closed = 1;
+    if (sp->suspended) {
+        // wake the connection so it can see the end of stream
+        sp->suspended = 0;
+        MHD_resume_connection(sp->connection);
+    }
+    pthread_mutex_unlock(&sp->lock);
+
+    stream_release(sp);
+}
+
+//------------------- websockets
+//
+// A websocket is accepted by the MATLAB callback during the upgrade request.  Once MHD
+// hands over the socket, a single service thread polls all websockets, decodes incoming
+// frames and queues complete messages for web_ws_recv.  Messages are sent directly on
+// the socket by web_ws_send from any thread.  The upgrade only completes after the
+// MATLAB callback returns, so messages sent before then are held and sent on upgrade.
+
+#define WS_GUID     "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+enum { WS_CONT=0x0, WS_TEXT=0x1, WS_BINARY=0x2, WS_CLOSE=0x8, WS_PING=0x9, WS_PONG=0xA };
+
+typedef struct _websocket {
+    MHD_socket  sock;
+    struct MHD_UpgradeResponseHandle *urh;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    pthread_mutex_t send_lock;  // serializes frames written by different threads, and socket close
+    int     lock_init;  // locks have been initialized, slots are reused
+    int     busy;       // number of parties (service thread, MATLAB) still using the slot
+    int     open;       // upgrade is complete, socket is valid
+    int     closing;    // MATLAB has closed the websocket
+    int     stalled;    // a send timed out, the service thread will close the socket
+    int     gone;       // connection is closed
+    unsigned char rxbuf[WS_MAXMSG+14];   // raw bytes received, room for one frame header
+    size_t  rxlen;
+    char   *msg;        // message being assembled from fragments
+    size_t  msglen;
+    chunk   queue[NWSMESSAGES];
+    int     head;
+    int     count;
+    int     dropped;
+    chunk   pending[NWSMESSAGES];       // messages sent before the upgrade completed
+    int     pending_opcode[NWSMESSAGES];
+    int     npending;
+} websocket;
+
+static websocket wslist[NWEBSOCKETS];
+static pthread_mutex_t wslist_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t ws_thread;
+static int       ws_pipe[2] = {-1, -1};  // wakes the service thread when the socket set changes
+
+static void
+sha1(const unsigned char *data, size_t len, unsigned char digest[20])
+{
+    // minimal SHA-1, only used for the websocket handshake
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    unsigned char block[64];
+    uint64_t bits = (uint64_t)len * 8;
+    size_t   i, total = ((len + 8) / 64 + 1) * 64;
+
+#define ROL(x,n)  (((x) << (n)) | ((x) >> (32-(n))))
+    for (size_t off=0; off<total; off+=64) {
+        uint32_t w[80], a, b, c, d, e, f, k, t;
+
+        // build the padded block on the fly
+        for (i=0; i<64; i++) {
+            size_t n = off + i;
+            if (n < len)
+                block[i] = data[n];
+            else if (n == len)
+                block[i] = 0x80;
+            else if (n >= total-8)
+                block[i] = (unsigned char)(bits >> (8*(total-1-n)));
+            else
+                block[i] = 0;
+        }
+        for (i=0; i<16; i++)
+            w[i] = (uint32_t)block[4*i]<<24 | (uint32_t)block[4*i+1]<<16 | (uint32_t)block[4*i+2]<<8 | block[4*i+3];
+        for (i=16; i<80; i++)
+            w[i] = ROL(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+        a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+        for (i=0; i<80; i++) {
+            if (i < 20) {
+                f = (b & c) | (~b & d); k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d; k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d; k = 0xCA62C1D6;
+            }
+            t = ROL(a, 5) + f + e + k + w[i];
+            e = d; d = c; c = ROL(b, 30); b = a; a = t;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+#undef ROL
+    for (i=0; i<20; i++)
+        digest[i] = (unsigned char)(h[i/4] >> (24 - 8*(i%4)));
+}
+
+static void
+base64(const unsigned char *in, size_t len, char *out)
+{
+    static const char tab[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t i;
+
+    for (i=0; i+2<len; i+=3) {
+        *out++ = tab[in[i] >> 2];
+        *out++ = tab[((in[i] & 3) << 4) | (in[i+1] >> 4)];
+        *out++ = tab[((in[i+1] & 15) << 2) | (in[i+2] >> 6)];
+        *out++ = tab[in[i+2] & 63];
+    }
+    if (i < len) {
+        *out++ = tab[in[i] >> 2];
+        if (i+1 < len) {
+            *out++ = tab[((in[i] & 3) << 4) | (in[i+1] >> 4)];
+            *out++ = tab[(in[i+1] & 15) << 2];
+        } else {
+            *out++ = tab[(in[i] & 3) << 4];
+            *out++ = '=';
+        }
+        *out++ = '=';
+    }
+    *out = 0;
+}
+
+static int
+ws_write(websocket *wp, const void *buf, size_t len)
+{
+    // write all the bytes, the upgraded socket may be non-blocking.  A client that
+    // doesn't read would block every sender, so give up after WS_SENDTIMEOUT
+    const char *p = (const char *)buf;
+    uint64_t deadline = now_ns(CLOCK_MONOTONIC) + (uint64_t)WS_SENDTIMEOUT * 1000000;
+
+    while (len > 0) {
+        ssize_t n = send(wp->sock, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                struct pollfd pfd = { wp->sock, POLLOUT, 0 };
+                uint64_t now = now_ns(CLOCK_MONOTONIC);
+
+                if (now < deadline) {
+                    poll(&pfd, 1, (int)((deadline - now) / 1000000) + 1);
+                    continue;
+                }
+                stl_log("websocket #%d: send timed out, closing", (int)(wp - wslist));
+            }
+            // no more frames, and have the service thread close the connection
+            pthread_mutex_lock(&wp->lock);
+            wp->stalled = 1;
+            pthread_mutex_unlock(&wp->lock);
+            write(ws_pipe[1], "", 1);
+            return 0;
+        }
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+static int
+ws_write_frame(websocket *wp, int opcode, const void *data, size_t len)
+{
+    // send one unmasked, unfragmented frame, send_lock must be held
+    unsigned char hdr[10];
+    size_t hlen;
+
+    hdr[0] = 0x80 | opcode;   // FIN
+    if (len < 126) {
+        hdr[1] = len;
+        hlen = 2;
+    } else if (len < 65536) {
+        hdr[1] = 126;
+        hdr[2] = len >> 8;
+        hdr[3] = len;
+        hlen = 4;
+    } else {
+        hdr[1] = 127;
+        for (int i=0; i<8; i++)
+            hdr[2+i] = (uint64_t)len >> (56 - 8*i);
+        hlen = 10;
+    }
+
+    // open only changes with send_lock held, the socket may have been handed back to MHD
+    return wp->open && !wp->stalled && ws_write(wp, hdr, hlen) && ws_write(wp, data, len);
+}
+
+static int
+ws_send_frame(websocket *wp, int opcode, const void *data, size_t len)
+{
+    int ok;
+
+    pthread_mutex_lock(&wp->send_lock);
+    ok = ws_write_frame(wp, opcode, data, len);
+    pthread_mutex_unlock(&wp->send_lock);
+
+    return ok;
+}
+
+static void
+ws_release(websocket *wp)
+{
+    // drop one reference to the websocket, free the slot when nobody is using it
+    pthread_mutex_lock(&wp->lock);
+    if (--wp->busy == 0) {
+        while (wp->count > 0) {
+            free(wp->queue[wp->head].data);
+            wp->head = (wp->head + 1) % NWSMESSAGES;
+            wp->count--;
+        }
+        free(wp->msg);
+        wp->msg = NULL;
+        for (int i=0; i<wp->npending; i++)
+            free(wp->pending[i].data);
+        wp->npending = 0;
+    }
+    pthread_mutex_unlock(&wp->lock);
+}
+
+static void
+ws_disconnect(websocket *wp)
+{
+    // called only by the service thread, hands the socket back to MHD
+    int dropped;
+
+    // wait for any frame being sent, none are sent once open is clear
+    pthread_mutex_lock(&wp->send_lock);
+    pthread_mutex_lock(&wp->lock);
+    wp->gone = 1;
+    wp->open = 0;
+    dropped = wp->dropped;
+    pthread_cond_broadcast(&wp->cond);  // wake any blocked receiver
+    pthread_mutex_unlock(&wp->lock);
+
+    MHD_upgrade_action(wp->urh, MHD_UPGRADE_ACTION_CLOSE);
+    pthread_mutex_unlock(&wp->send_lock);
+    WEB_DEBUG("websocket #%d closed, %d messages dropped", (int)(wp - wslist), dropped);
+    ws_release(wp);
+}
+
+static void
+ws_message(websocket *wp, char *data, size_t len)
+{
+    // queue a complete received message, takes ownership of data
+    pthread_mutex_lock(&wp->lock);
+    if (wp->count == NWSMESSAGES) {
+        // receiver is too slow, discard the oldest message
+        free(wp->queue[wp->head].data);
+        wp->head = (wp->head + 1) % NWSMESSAGES;
+        wp->count--;
+        wp->dropped++;
+    }
+    int tail = (wp->head + wp->count) % NWSMESSAGES;
+    wp->queue[tail].data = data;
+    wp->queue[tail].len = len;
+    wp->count++;
+    pthread_cond_signal(&wp->cond);
+    pthread_mutex_unlock(&wp->lock);
+}
+
+static int
+ws_parse(websocket *wp)
+{
+    // decode all complete frames in the receive buffer, return false to disconnect
+    unsigned char *p = wp->rxbuf;
+
+    while (wp->rxlen >= 2) {
+        int     fin = p[0] & 0x80;
+        int     opcode = p[0] & 0x0F;
+        int     masked = p[1] & 0x80;
+        uint64_t len = p[1] & 0x7F;
+        size_t  hlen = 2;
+
+        if (len == 126) {
+            if (wp->rxlen < 4)
+                return 1;
+            len = (uint64_t)p[2] << 8 | p[3];
+            hlen = 4;
+        } else if (len == 127) {
+            if (wp->rxlen < 10)
+                return 1;
+            len = 0;
+            for (int i=0; i<8; i++)
+                len = (len << 8) | p[2+i];
+            hlen = 10;
+        }
+        if (!masked || len > WS_MAXMSG) {
+            stl_log("websocket #%d: bad frame, closing", (int)(wp - wslist));
+            return 0;
+        }
+        if (wp->rxlen < hlen + 4 + len)
+            return 1;   // wait for the rest of the frame
+
+        // unmask the payload in place
+        unsigned char *mask = p + hlen;
+        unsigned char *payload = mask + 4;
+        for (uint64_t i=0; i<len; i++)
+            payload[i] ^= mask[i & 3];
+
+        switch (opcode) {
+            case WS_TEXT:
+            case WS_BINARY:
+            case WS_CONT:
+                if (wp->msglen + len > WS_MAXMSG) {
+                    stl_log("websocket #%d: message too long, closing", (int)(wp - wslist));
+                    return 0;
+                }
+                // append the fragment, with room for a terminating null
+                wp->msg = (char *)realloc(wp->msg, wp->msglen + len + 1);
+                memcpy(wp->msg + wp->msglen, payload, len);
+                wp->msglen += len;
+                if (fin) {
+                    wp->msg[wp->msglen] = 0;
+                    ws_message(wp, wp->msg, wp->msglen);
+                    wp->msg = NULL;
+                    wp->msglen = 0;
+                }
+                break;
+            case WS_PING:
+                ws_send_frame(wp, WS_PONG, payload, len);
+                break;
+            case WS_PONG:
+                break;
+            case WS_CLOSE:
+                ws_send_frame(wp, WS_CLOSE, payload, len < 2 ? len : 2);
+                return 0;
+            default:
+                return 0;
+        }
+
+        // remove the frame from the buffer
+        size_t flen = hlen + 4 + len;
+        memmove(p, p + flen, wp->rxlen - flen);
+        wp->rxlen -= flen;
+    }
+    return 1;
+}
+
+static void *
+ws_service(void *arg)
+{
+    struct pollfd fds[NWEBSOCKETS+1];
+    websocket    *wps[NWEBSOCKETS+1];
+
+    stl_thread_add("WS");
+
+    for (;;) {
+        int nfds = 0, i;
+
+        // build the poll set from the open websockets
+        fds[nfds].fd = ws_pipe[0];
+        fds[nfds].events = POLLIN;
+        wps[nfds++] = NULL;
+        for (i=0; i<NWEBSOCKETS; i++) {
+            websocket *wp = &wslist[i];
+
+            if (wp->open && (wp->closing || wp->stalled)) {
+                ws_disconnect(wp);
+                continue;
+            }
+            if (wp->open) {
+                fds[nfds].fd = wp->sock;
+                fds[nfds].events = POLLIN;
+                wps[nfds++] = wp;
+            }
+        }
+
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            stl_error("websocket poll failed %s", strerror(errno));
+        }
+
+        if (fds[0].revents & POLLIN) {
+            char c[16];
+            read(ws_pipe[0], c, sizeof(c));
+        }
+
+        for (i=1; i<nfds; i++) {
+            websocket *wp = wps[i];
+            ssize_t n;
+
+            if (fds[i].revents == 0)
+                continue;
+            n = recv(wp->sock, wp->rxbuf + wp->rxlen, sizeof(wp->rxbuf) - wp->rxlen, 0);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                continue;
+            if (n <= 0) {
+                ws_disconnect(wp);
+                continue;
+            }
+            wp->rxlen += n;
+            if (!ws_parse(wp))
+                ws_disconnect(wp);
+        }
+    }
+    return NULL;
+}
+
+static void
+ws_upgraded(void *cls, struct MHD_Connection *connection, void *con_cls,
+            const char *extra_in, size_t extra_in_size,
+            MHD_socket sock, struct MHD_UpgradeResponseHandle *urh)
+{
+    // called by MHD once the 101 response is sent, the socket is now ours
+    websocket *wp = (websocket *)cls;
+    chunk   pending[NWSMESSAGES];
+    int     opcode[NWSMESSAGES];
+    int     npending;
+
+    // hold send_lock until the held messages are sent, so later ones queue behind them
+    pthread_mutex_lock(&wp->send_lock);
+    pthread_mutex_lock(&wp->lock);
+    wp->sock = sock;
+    wp->urh = urh;
+    if (extra_in_size > sizeof(wp->rxbuf))
+        extra_in_size = sizeof(wp->rxbuf);
+    memcpy(wp->rxbuf, extra_in, extra_in_size);
+    wp->rxlen = extra_in_size;
+    wp->open = 1;
+    npending = wp->npending;
+    memcpy(pending, wp->pending, npending * sizeof(chunk));
+    memcpy(opcode, wp->pending_opcode, npending * sizeof(int));
+    wp->npending = 0;
+    pthread_mutex_unlock(&wp->lock);
+
+    for (int i=0; i<npending; i++) {
+        ws_write_frame(wp, opcode[i], pending[i].data, pending[i].len);
+        free(pending[i].data);
+    }
+    pthread_mutex_unlock(&wp->send_lock);
+
+    WEB_DEBUG("websocket #%d open", (int)(wp - wslist));
+
+    // have the service thread add this socket to its poll set
+    write(ws_pipe[1], "", 1);
+}
+
+static websocket *
+ws_get(int32_t id, char *func)
+{
+    if (id < 0 || id >= NWEBSOCKETS || wslist[id].busy == 0)
+        stl_error("%s: websocket %d not allocated", func, id);
+    return &wslist[id];
+}
+
+/**
+ * Return true if this request is a websocket upgrade
+ */
+int
+web_isWebSocket()
+{
+    const char *upgrade = MHD_lookup_connection_value(req_connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_UPGRADE);
+
+    return upgrade && strcasecmp(upgrade, "websocket") == 0;
+}
+
+/**
+ * Accept a websocket upgrade for the current request, return the websocket id
+ */
+int32_t
+web_websocket()
+{
+    struct MHD_Response *response;
+    const char *key;
+    char    accept[64];
+    char    keyguid[128];
+    unsigned char digest[20];
+    websocket *p, *wp = NULL;
+    int     slot;
+
+    WEB_DEBUG("web_websocket: %s", req_url);
+    page_request_responses++; // indicate a reponse to the request
+
+    key = MHD_lookup_connection_value(req_connection, MHD_HEADER_KIND, "Sec-WebSocket-Key");
+    if (!web_isWebSocket() || key == NULL || strlen(key) > 64) {
+        web_error(MHD_HTTP_BAD_REQUEST, "websocket upgrade expected");
+        return -1;
+    }
+
+    // start the service thread on first use
+    if (ws_pipe[0] < 0) {
+        if (pipe(ws_pipe))
+            stl_error("web_websocket: pipe failed %s", strerror(errno));
+        fcntl(ws_pipe[0], F_SETFL, O_NONBLOCK);
+        if (pthread_create(&ws_thread, NULL, ws_service, NULL))
+            stl_error("web_websocket: service thread create failed");
+    }
+
+    // find an empty slot
+    pthread_mutex_lock(&wslist_mutex);
+    for (p=wslist, slot=0; slot<NWEBSOCKETS; slot++, p++) {
+        if (p->busy == 0) {
+            wp = p;
+            if (wp->lock_init == 0) {
+                pthread_mutex_init(&wp->lock, NULL);
+                pthread_mutex_init(&wp->send_lock, NULL);
+                pthread_cond_init(&wp->cond, NULL);
+                wp->lock_init = 1;
+            }
+            wp->busy = 2;   // referenced by the service thread and by MATLAB
+            break;
+        }
+    }
+    pthread_mutex_unlock(&wslist_mutex);
+    if (wp == NULL)
+        stl_error("web_websocket: too many websockets, increase NWEBSOCKETS (currently %d)", NWEBSOCKETS);
+
+    wp->open = 0;
+    wp->closing = 0;
+    wp->stalled = 0;
+    wp->gone = 0;
+    wp->rxlen = 0;
+    wp->msg = NULL;
+    wp->msglen = 0;
+    wp->head = 0;
+    wp->count = 0;
+    wp->dropped = 0;
+    wp->npending = 0;
+
+    // compute the handshake response key
+    snprintf(keyguid, sizeof(keyguid), "%s%s", key, WS_GUID);
+    sha1((unsigned char *)keyguid, strlen(keyguid), digest);
+    base64(digest, 20, accept);
+
+    response = MHD_create_response_for_upgrade(ws_upgraded, wp);
+    MHD_add_response_header(response, MHD_HTTP_HEADER_UPGRADE, "websocket");
+    MHD_add_response_header(response, "Sec-WebSocket-Accept", accept);
+    queue_response(MHD_HTTP_SWITCHING_PROTOCOLS, response, 0);
+
+    return slot;
+}
+
+/**
+ * Send a message on the websocket, return false if the connection has closed
+ */
+int32_t
+web_ws_send(int32_t id, void *data, int len, int32_t binary)
+{
+    websocket *wp = ws_get(id, "web_ws_send");
+    int     opcode = binary ? WS_BINARY : WS_TEXT;
+
+    pthread_mutex_lock(&wp->lock);
+    if (wp->gone || wp->closing || wp->stalled) {
+        pthread_mutex_unlock(&wp->lock);
+        return 0;
+    }
+    if (!wp->open) {
+        // upgrade not complete, can't wait for it since it may be this thread's
+        // callback that has to return first, hold the message until it is
+        if (wp->npending == NWSMESSAGES) {
+            wp->dropped++;
+            pthread_mutex_unlock(&wp->lock);
+            return 1;
+        }
+        wp->pending[wp->npending].data = (char *)malloc((size_t)len);
+        memcpy(wp->pending[wp->npending].data, data, len);
+        wp->pending[wp->npending].len = len;
+        wp->pending_opcode[wp->npending++] = opcode;
+        pthread_mutex_unlock(&wp->lock);
+        return 1;
+    }
+    pthread_mutex_unlock(&wp->lock);
+
+    return ws_send_frame(wp, opcode, data, len);
+}
+
+/**
+ * Receive a message from the websocket into buf
+ *
+ * Returns the length of the message, 0 if non-blocking and no message is
+ * waiting, or -1 if the connection has closed.
+ */
+int32_t
+web_ws_recv(int32_t id, char *buf, int len, int32_t block)
+{
+    websocket *wp = ws_get(id, "web_ws_recv");
+    chunk *cp;
+    int    n;
+
+    pthread_mutex_lock(&wp->lock);
+    while (block && wp->count == 0 && !wp->gone)
+        pthread_cond_wait(&wp->cond, &wp->lock);
+    if (wp->count == 0) {
+        pthread_mutex_unlock(&wp->lock);
+        return wp->gone ? -1 : 0;
+    }
+
+    cp = &wp->queue[wp->head];
+    n = cp->len < len ? cp->len : len;  // long messages are truncated
+    memcpy(buf, cp->data, n);
+    free(cp->data);
+    wp->head = (wp->head + 1) % NWSMESSAGES;
+    wp->count--;
+    pthread_mutex_unlock(&wp->lock);
+
+    return n;
+}
+
+/**
+ * Close the websocket and release its id
+ */
+void
+web_ws_close(int32_t id)
+{
+    websocket *wp = ws_get(id, "web_ws_close");
+
+    WEB_DEBUG("web_ws_close: #%d", id);
+
+    pthread_mutex_lock(&wp->lock);
+    wp->closing = 1;
+    pthread_mutex_unlock(&wp->lock);
+
+    // not under the lock, a stalled client can hold up the send, does nothing if not open
+    ws_send_frame(wp, WS_CLOSE, "\x03\xe8", 2);  // 1000 normal closure
+
+    // let the service thread hand the socket back to MHD
+    write(ws_pipe[1], "", 1);
+    ws_release(wp);
+}
+
+//------------------- routes
+//
+// Routes map a method and URL pattern directly to a MATLAB entrypoint.  Patterns are
+// split into segments held in a trie, a segment can be a literal, :name which matches
+// any one segment and captures it as a path parameter, or * which matches the rest of
+// the URL.  Literal segments take precedence over parameters, which take precedence
+// over wildcards.
+
+static route route_root;
+static const char *route_methods[] = {"GET", "POST", "PUT", "DELETE", "*"};
+
+static int
+route_method(const char *method)
+{
+    for (int i=0; i<5; i++)
+        if (strcmp(method, route_methods[i]) == 0)
+            return i;
+    return -1;
+}
+
+static int
+segment_len(const char *s)
+{
+    int n = 0;
+
+    while (s[n] && s[n] != '/' && s[n] != '?')
+        n++;
+    return n;
+}
+
+static route *
+route_child(route *rp, const char *seg, int len)
+{
+    // find or create the child node for this pattern segment
+    route *cp;
+
+    for (cp=rp->child; cp; cp=cp->next)
+        if (strncmp(cp->segment, seg, len) == 0 && cp->segment[len] == 0)
+            return cp;
+
+    cp = (route *)calloc(1, sizeof(route));
+    cp->segment = (char *)calloc(len+1, 1);
+    memcpy(cp->segment, seg, len);
+    cp->isparam = seg[0] == ':';
+    cp->iswild = seg[0] == '*';
+
+    // keep literals first so they are tried before parameters and wildcards
+    if (cp->isparam || cp->iswild) {
+        route **pp = &rp->child;
+        while (*pp)
+            pp = &(*pp)->next;
+        *pp = cp;
+    } else {
+        cp->next = rp->child;
+        rp->child = cp;
+    }
+    return cp;
+}
+
+static int
+route_accepts(route *rp, int m)
+{
+    // node has a handler for this method, or for any method
+    return (m >= 0 && rp->handler[m]) || rp->handler[4];
+}
+
+static route *
+route_find(route *rp, const char *path, int m)
+{
+    // recursive match with backtracking, fills in the path parameters, a node only
+    // matches if it has a handler for the method, otherwise the next sibling is tried
+    route *cp;
+    int    len;
+
+    while (*path == '/')
+        path++;
+    if (*path == 0 || *path == '?')
+        return route_accepts(rp, m) ? rp : NULL;
+
+    len = segment_len(path);
+    for (cp=rp->child; cp; cp=cp->next) {
+        route *match;
+
+        if (cp->iswild) {
+            if (req_nparams == NPARAMS || !route_accepts(cp, m))
+                continue;
+            req_params[req_nparams].name = "*";
+            req_params[req_nparams].value = path;
+            req_params[req_nparams].len = strcspn(path, "?");
+            req_nparams++;
+            return cp;
+        }
+        if (cp->isparam) {
+            if (req_nparams == NPARAMS)
+                continue;
+            req_params[req_nparams].name = cp->segment + 1;
+            req_params[req_nparams].value = path;
+            req_params[req_nparams].len = len;
+            req_nparams++;
+            if ((match = route_find(cp, path + len, m)))
+                return match;
+            req_nparams--;
+        } else if (strncmp(cp->segment, path, len) == 0 && cp->segment[len] == 0) {
+            if ((match = route_find(cp, path + len, m)))
+                return match;
+        }
+    }
+    return NULL;
+}
+
+static void
+(*route_match(const char *url, const char *method))(void)
+{
+    route *rp;
+    int    m = route_method(method);
+
+    req_nparams = 0;
+    req_route = NULL;
+
+    // "/" is held on the root itself, and an empty trie fails after one segment
+    rp = route_find(&route_root, url, m);
+    if (rp == NULL)
+        return NULL;
+    req_route = rp->pattern;
+    if (m >= 0 && rp->handler[m])
+        return rp->handler[m];
+    return rp->handler[4];  // any method
+}
+
+/**
+ * Add a route that invokes the MATLAB entrypoint for this method and URL pattern
+ */
+void
+web_route(char *method, char *pattern, char *entry)
+{
+    route *rp = &route_root;
+    const char *p = pattern;
+    int    m = route_method(method);
+    void   (*f)(void);
+
+    if (m < 0)
+        stl_error("web_route: unknown method [%s]", method);
+
+    f = stl_get_functionptr(entry);
+    if (f == NULL)
+        stl_error("web_route: MATLAB entrypoint named [%s] not found", entry);
+
+    for (;;) {
+        int len;
+
+        while (*p == '/')
+            p++;
+        if (*p == 0)
+            break;
+        len = segment_len(p);
+        rp = route_child(rp, p, len);
+        p += len;
+        if (rp->iswild)
+            break;  // wildcard matches the rest
+    }
+    rp->handler[m] = f;
+    if (rp->pattern == NULL)
+        rp->pattern = stl_stralloc(pattern);
+
+    WEB_DEBUG("web_route: %s %s -> %s", method, pattern, entry);
+}
+
+//------------------- support
+
+/**
+ * Set a value for the template processor
+ */
+void web_setvalue(char *name, char *value)
+{
+    WEB_DEBUG("web_setvalue: %s %s", name, value);
+    
+    // this function copies name/value to the heap
+    req_varlist = TMPL_add_var(req_varlist, name, value, NULL);
+}
+
+void
+web_start(int32_t port, char *callback, void *arg, web_options *opts)
+{
+    struct MHD_OptionItem options[8];
+    int n = 0;
+
+    if (daemon)
+        stl_error("web server already launched");
+        
+    // the catch-all callback is optional if routes are used
+    if (*callback) {
+        request_matlab_callback = stl_get_functionptr(callback);
+        if (request_matlab_callback == NULL)
+            stl_error("MATLAB entrypoint named [%s] not found", callback);
+    }
+
+    // build the option list, zero valued options are left at the MHD default
+    options[n++] = (struct MHD_OptionItem){MHD_OPTION_NOTIFY_COMPLETED, (intptr_t)request_completed, NULL};
+    if (opts) {
+        if (opts->max_connections > 0)
+            options[n++] = (struct MHD_OptionItem){MHD_OPTION_CONNECTION_LIMIT, opts->max_connections, NULL};
+        if (opts->per_ip_connections > 0)
+            options[n++] = (struct MHD_OptionItem){MHD_OPTION_PER_IP_CONNECTION_LIMIT, opts->per_ip_connections, NULL};
+        if (opts->timeout > 0)
+            options[n++] = (struct MHD_OptionItem){MHD_OPTION_CONNECTION_TIMEOUT, opts->timeout, NULL};
+        if (opts->memory_limit > 0)
+            options[n++] = (struct MHD_OptionItem){MHD_OPTION_CONNECTION_MEMORY_LIMIT, opts->memory_limit, NULL};
+        if (opts->backlog > 0)
+            options[n++] = (struct MHD_OptionItem){MHD_OPTION_LISTEN_BACKLOG_SIZE, opts->backlog, NULL};
+        rate_limit = opts->rate;
+        rate_burst = opts->burst > 1 ? opts->burst : 1;
+    }
+    options[n++] = (struct MHD_OptionItem){MHD_OPTION_END, 0, NULL};
+        
+    // suspend/resume is needed by streaming responses, upgrade by websockets
+    daemon = MHD_start_daemon (MHD_USE_INTERNAL_POLLING_THREAD | MHD_ALLOW_SUSPEND_RESUME | MHD_ALLOW_UPGRADE, port,
+                             NULL, NULL,
+                             &page_request, arg,
+                             MHD_OPTION_ARRAY, options,
+                             MHD_OPTION_END);
+    
+    // this starts a POSIX thread but its handle is very well buried
+    // its name will be MHD-single but this is not gettable under MacOS
+    
+    if (daemon == NULL)
+        stl_error("web server failed to launch: %s", strerror(errno));
+    
+     stl_log("web server starting on port %u", port);
+}
+
+static void
+queue_response(int status, struct MHD_Response *response, uint64_t bytes)
+{
+    // queue the response for the current request and note it for the metrics
+    req_response_status = MHD_queue_response(req_connection, status, response);
+    MHD_destroy_response(response);
+    req_status = status;
+    req_bytes = bytes;
+}
+
+static void
+send_data(void *s, int len, char *type)
+{
+    struct MHD_Response *response;
+    
+    response = MHD_create_response_from_buffer(len, s, MHD_RESPMEM_MUST_COPY);
+    MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, type);
+    queue_response(MHD_HTTP_OK, response, len);
+    cache_store(s, len, type);
+}
+
+void
+web_debug(int32_t debug)
+{
+    web_debug_flag = debug;
+}
+
+static int
+print_key (void *cls, enum MHD_ValueKind kind, const char *key,
+               const char *value)
+{
+  stl_log ("%s: %s=%s", (char *)cls, key, value);
+  return MHD_YES;
+}
+
+void
+web_upload_dir(char *dir)
+{
+    // file uploads are streamed to this directory rather than held in memory
+    free(upload_dir);
+    upload_dir = (dir && *dir) ? stl_stralloc(dir) : NULL;
+}
+
+// manage the per-request arena
+static void *
+arena_alloc(arena *a, size_t n)
+{
+    arena_block *b = a->head;
+
+    n = (n + 7) & ~(size_t)7;   // keep allocations aligned
+    if (b == NULL || b->used + n > b->size) {
+        size_t size = n > ARENA_BLOCK ? n : ARENA_BLOCK;
+
+        b = (arena_block *)malloc(sizeof(arena_block) + size);
+        b->size = size;
+        b->used = 0;
+        b->own = 0;
+        b->next = a->head;
+        a->head = b;
+    }
+    a->last = b->data + b->used;
+    b->used += n;
+    return a->last;
+}
+
+static void *
+arena_grow(arena *a, void *p, size_t oldlen, size_t newlen)
+{
+    // grow an allocation, in place if it is the most recent one and there is room,
+    // otherwise it moves to a block of its own whose size doubles as it grows
+    arena_block *b = a->head, **prev;
+    size_t n = (newlen + 7) & ~(size_t)7;
+
+    if (p == a->last) {
+        size_t start = (char *)p - b->data;
+
+        if (start + n <= b->size) {
+            b->used = start + n;
+            return p;
+        }
+    }
+
+    // already in a block of its own, which is kept behind the head block
+    for (prev=&a->head; (b = *prev); prev=&b->next)
+        if (b->own && b->data == p)
+            break;
+    if (b) {
+        if (n > b->size) {
+            b = (arena_block *)realloc(b, sizeof(arena_block) + 2*n);
+            b->size = 2*n;
+            *prev = b;
+        }
+        b->used = n;
+        return b->data;
+    }
+
+    // move it to a new block of its own, behind the head so small allocations
+    // carry on filling the head block
+    b = (arena_block *)malloc(sizeof(arena_block) + 2*n);
+    b->size = 2*n;
+    b->used = n;
+    b->own = 1;
+    b->next = a->head->next;
+    a->head->next = b;
+    memcpy(b->data, p, oldlen);
+    return b->data;
+}
+
+static char *
+arena_strdup(arena *a, const char *s)
+{
+    size_t len = strlen(s);
+    char   *n = (char *)arena_alloc(a, len+1);
+
+    memcpy(n, s, len+1);
+    return n;
+}
+
+static request *
+request_new(struct MHD_Connection *connection)
+{
+    arena   a = { NULL, NULL };
+    request *rp;
+
+    // the request lives in its own arena, so there is one allocation per request
+    rp = (request *)arena_alloc(&a, sizeof(request));
+    memset(rp, 0, sizeof(request));
+    rp->arena = a;
+    rp->size = NPOSTVARS;
+    rp->table = (postvar *)arena_alloc(&rp->arena, NPOSTVARS * sizeof(postvar));
+    memset(rp->table, 0, NPOSTVARS * sizeof(postvar));
+    rp->upload_fd = -1;
+    rp->start = now_ns(CLOCK_MONOTONIC);
+    rp->pp = MHD_create_post_processor(connection, POST_BUFSIZ, post_data_iterator, rp);
+
+    return rp;
+}
+
+static void
+upload_close(request *rp)
+{
+    if (rp->upload_fd >= 0) {
+        close(rp->upload_fd);
+        rp->upload_fd = -1;
+    }
+}
+
+static void
+request_free(request *rp)
+{
+    arena_block *b, *next;
+
+    if (rp->pp)
+        MHD_destroy_post_processor(rp->pp);
+    upload_close(rp);
+
+    // uploaded files only live as long as the request
+    for (upload *up=rp->uploads; up; up=up->next)
+        unlink(up->path);
+
+    // the request itself is in the arena, so free it last
+    for (b=rp->arena.head; b; b=next) {
+        next = b->next;
+        free(b);
+    }
+}
+
+// manage table of POST variables
+static uint32_t
+postvar_hash(const char *key)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+
+    while (*key)
+        h = (h ^ (unsigned char)*key++) * 16777619u;
+    return h;
+}
+
+static postvar *
+postvar_lookup(request *rp, const char *key, uint32_t hash)
+{
+    // find the slot holding key, or the empty slot where it should go
+    int mask = rp->size - 1;
+    int i = hash & mask;
+
+    while (rp->table[i].key) {
+        if (rp->table[i].hash == hash && strcmp(rp->table[i].key, key) == 0)
+            break;
+        i = (i + 1) & mask;
+    }
+    return &rp->table[i];
+}
+
+static void
+postvar_set(request *rp, const char *key, const char *value, size_t len)
+{
+    uint32_t hash = postvar_hash(key);
+    postvar *pv;
+
+    if (2 * (rp->nvars + 1) > rp->size) {
+        // table is half full, double it and rehash
+        postvar *old = rp->table;
+        int     oldsize = rp->size;
+
+        rp->size *= 2;
+        rp->table = (postvar *)arena_alloc(&rp->arena, rp->size * sizeof(postvar));
+        memset(rp->table, 0, rp->size * sizeof(postvar));
+        for (int i=0; i<oldsize; i++)
+            if (old[i].key)
+                *postvar_lookup(rp, old[i].key, old[i].hash) = old[i];
+    }
+
+    pv = postvar_lookup(rp, key, hash);
+    if (pv->key == NULL) {
+        pv->key = arena_strdup(&rp->arena, key);
+        pv->hash = hash;
+        rp->nvars++;
+    }
+    // a repeated key replaces the earlier value
+    pv->value = (char *)arena_alloc(&rp->arena, len+1);
+    memcpy(pv->value, value, len);
+    pv->value[len] = 0;
+    pv->len = len;
+}
+
+static void
+postvar_append(request *rp, const char *key, const char *value, size_t len)
+{
+    postvar *pv = postvar_lookup(rp, key, postvar_hash(key));
+
+    if (pv->key == NULL) {
+        postvar_set(rp, key, value, len);
+        return;
+    }
+    pv->value = (char *)arena_grow(&rp->arena, pv->value, pv->len, pv->len + len + 1);
+    memcpy(pv->value + pv->len, value, len);
+    pv->len += len;
+    pv->value[pv->len] = 0;
+}
+
+static char *
+postvar_find(request *rp, char *key)
+{
+    postvar *pv = postvar_lookup(rp, key, postvar_hash(key));
+
+    return pv->key ? pv->value : NULL;
+}
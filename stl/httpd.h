@@ -5,11 +5,29 @@
 #ifndef __httpd_h_
 #define __httpd_h_
 
+// server options, matches the struct returned by webserver.options
+// zero valued fields leave the default in place
+typedef struct {
+    int32_t max_connections;    // max concurrent connections
+    int32_t per_ip_connections; // max concurrent connections from one client address
+    int32_t timeout;            // idle connection timeout, seconds
+    int32_t memory_limit;       // memory for each connection, bytes
+    int32_t backlog;            // listen backlog
+    double  rate;               // max requests per second from one client address
+    double  burst;              // requests allowed in a burst above rate
+} web_options;
+
 // C functions in httpd.c which are wrapped by webserver.m
-void web_start(int32_t port, char *callback, void *arg);
+void web_start(int32_t port, char *callback, void *arg, web_options *opts);
 void web_debug(int32_t debug);
+void web_metrics(int32_t enable);
+void web_accesslog(char *filename);
+void web_cache(char *prefix, double ttl);
+void web_invalidate(char *prefix);
 
-void web_url(char *buf, int len);
+int32_t web_url(char *buf, int len);
+int32_t web_param(char *buf, int len, char *name);
+void web_route(char *method, char *pattern, char *entry);
 int web_isPOST();
 
 void web_error(int errcode, char *errmsg);
@@ -18,8 +36,31 @@ void web_setvalue(char *name, char *value);
 void web_template(char *filename);
 void web_file(char *filename, char *type);
 void web_data(void *data, int len, char *type);
+void web_json_begin();
+void web_json_number(char *name, void *data, int32_t type, int32_t rows, int32_t cols);
+void web_json_string(char *name, char *value);
+void web_json_end();
+void web_binary(void *data, int32_t type, int32_t outtype, int32_t ndims, int32_t *dims);
 
 int32_t web_getarg(char *buf, int len, char *name);
 int32_t web_postarg(char *buf, int len, char *name);
+void web_upload_dir(char *dir);
 int web_reqheader(char *buf, int len, char *name);
+
+int32_t web_stream(char *type);
+int32_t web_stream_mjpeg();
+int32_t web_stream_sse();
+int32_t web_stream_send(int32_t id, void *data, int len);
+int32_t web_stream_frame(int32_t id, void *data, int len, char *type);
+int32_t web_stream_event(int32_t id, char *event, char *data);
+void web_stream_close(int32_t id);
+
+int32_t web_defer();
+int32_t web_complete(int32_t token, int32_t status, void *data, int len, char *type);
+
+int web_isWebSocket();
+int32_t web_websocket();
+int32_t web_ws_send(int32_t id, void *data, int len, int32_t binary);
+int32_t web_ws_recv(int32_t id, char *buf, int len, int32_t block);
+void web_ws_close(int32_t id);
 #endif
\ No newline at end of file
@@ -19,11 +19,26 @@ userStackData  SD;
 userPersistentData pd;
 #endif
 
+// compile with -DSTL_RT for real-time mode: memory is locked, and the heap reserve and
+// thread stacks are faulted in before the user's code runs
+#ifndef STL_RT_HEAP
+#define STL_RT_HEAP     (16*1024*1024)
+#endif
+#ifndef STL_RT_STACK
+#define STL_RT_STACK    (256*1024)
+#endif
+
 int 
 main(int argc, char **argv)
 {
     // initialize the thread library    
-    stl_initialize(argc, argv);
+#ifdef STL_RT
+    stl_rtopts rt = {1, STL_RT_HEAP, STL_RT_STACK};
+
+    stl_initialize(argc, argv, &rt);
+#else
+    stl_initialize(argc, argv, NULL);
+#endif
 
     // initialize stack data required for some MATLAB functions
 #ifdef typedef_userStackData
@@ -0,0 +1,91 @@
+function [t, data] = record_load(filename)
+%RECORD_LOAD Load a binary recording
+%
+% [T,D] = RECORD_LOAD(FILENAME) reads the recording written by stl.record to the segment
+% files FILENAME.000, FILENAME.001 etc.  T is a column vector of record times, in seconds
+% since the epoch, and D is a struct with the same fields as the recorded struct where each
+% field has one row per record.
+%
+% Notes::
+% - Segments that were removed by rotation are skipped, the data starts at the oldest
+%   segment that still exists.
+% - A recording that is still being written can be read, only complete records are loaded.
+%
+% See also: stl.record_open, stl.record.
+%
+% Copyright (C) 2018, by Peter I. Corke
+
+    HDRSIZE = 4096;  % must match RECORD_HDRSIZE in stl.c
+
+    % find the segments, they may not start at 0 if older ones were rotated away
+    files = dir([filename '.*']);
+    segs = [];
+    for i=1:numel(files)
+        [~,~,ext] = fileparts(files(i).name);
+        n = str2double(ext(2:end));
+        if ~isnan(n)
+            segs(end+1) = n;
+        end
+    end
+    if isempty(segs)
+        error('record_load: no recording %s found', filename);
+    end
+    segs = sort(segs);
+
+    t = [];
+    raw = uint8([]);
+    for seg=segs
+        fp = fopen(sprintf('%s.%03d', filename, seg), 'r', 'ieee-le');
+        magic = fread(fp, 8, '*char')';
+        if ~strcmp(magic(1:7), 'STLREC1')
+            fclose(fp);
+            error('record_load: %s.%03d is not a recording', filename, seg);
+        end
+        recsize = fread(fp, 1, 'uint32');
+        datasize = fread(fp, 1, 'uint32');
+        count = fread(fp, 1, 'uint64');
+        fread(fp, 1, 'uint32');  % segment number
+        schemalen = fread(fp, 1, 'uint32');
+        schema = fread(fp, schemalen, '*char')';
+
+        fseek(fp, HDRSIZE, 'bof');
+        r = fread(fp, [recsize count], '*uint8');
+        fclose(fp);
+        count = size(r, 2);  % the file may have been trimmed while we read it
+
+        t = [t; double(typecast(reshape(r(1:8,:), 1, []), 'uint64'))' * 1e-9];
+        raw = [raw r(9:8+datasize,:)];
+    end
+
+    % unpack the fields, which are laid out like a C struct with natural alignment
+    data = struct();
+    offset = 0;
+    for field=strsplit(schema(1:end-1), ';')
+        parts = strsplit(field{1}, ':');
+        [name, cls, n] = deal(parts{1}, parts{2}, str2double(parts{3}));
+        switch cls
+            case {'double', 'int64', 'uint64'}
+                sz = 8;
+            case {'single', 'int32', 'uint32'}
+                sz = 4;
+            case {'int16', 'uint16'}
+                sz = 2;
+            case {'int8', 'uint8', 'logical', 'char'}
+                sz = 1;
+            otherwise
+                error('record_load: field %s has unsupported class %s', name, cls);
+        end
+        offset = ceil(offset/sz) * sz;
+        bytes = raw(offset+1:offset+sz*n, :);
+        switch cls
+            case 'logical'
+                v = logical(bytes);
+            case 'char'
+                v = char(bytes);
+            otherwise
+                v = typecast(bytes(:), cls);
+        end
+        data.(name) = reshape(v, n, [])';
+        offset = offset + sz*n;
+    end
+end
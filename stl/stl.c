@@ -3,6 +3,9 @@
  * Peter Corke August 2018
  */
 
+#ifdef __linux__
+    #define _GNU_SOURCE     // for RTLD_DEFAULT, pthread_setname_np and adaptive mutexes
+#endif
 #include <unistd.h>
 #include <stdio.h>
 #include <stdarg.h>
@@ -13,18 +16,29 @@
 #include <stdint.h>
 
 #include <pthread.h>
-#ifdef __linux__
-    #define __USE_GNU
-#endif
 #include <dlfcn.h>
 #include <semaphore.h>
 #ifdef __linux__
     #include <fcntl.h>
     #include <signal.h>
+    #include <sys/syscall.h>
+    #include <sys/epoll.h>
+    #include <sys/socket.h>
+    #include <netinet/in.h>
+    #include <arpa/inet.h>
+    #include <poll.h>
+    #include <sys/resource.h>
 #endif
 #include <time.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <alloca.h>
+#ifdef __GLIBC__
+    #include <malloc.h>
+#endif
 
-#ifdef __APPLE__
+#if defined(__APPLE__) || defined(__GLIBC__)
     #include <execinfo.h>
 #endif
 
@@ -32,13 +46,38 @@
 #include "stl.h"
 
 // parameters
-#define NTHREADS        8
+#define NTHREADS        96      // room for a pipeline of NSTAGES*NWORKERS workers and the rest
 #define NMUTEXS         8
 #define NSEMAPHORES     8
 #define NTIMERS         8
+#define NLATEST         8
+#define NWATCHES        64
+#define NUDPSOCKETS     8
+#define UDP_RCVBUF      (4*1024*1024)   // kernel receive buffer, absorbs bursts between batches
+#define NRECORDERS      8
+#define NPIPELINES      4
+#define NTASKWORKERS    16      // max worker threads running tasks
+#define NTASKFUNCS      32      // entry points remembered by stl_task_spawn
+#define TASK_STACK      (64*1024)   // default task stack size
+#define NSTAGES         8       // max stages per pipeline
+#define NWORKERS        8       // max worker threads per stage
+#define RECORD_SEGSIZE  (64*1024*1024)  // default size of a recording segment file
+#define RECORD_HDRSIZE  4096            // segment header, holds the schema
+#define LATEST_NBUF     3       // default number of buffers for a latest value
+#define RT_STACK        (256*1024)  // default thread stack size in real-time mode
+#define CACHELINE       64
+#define NPROFBUFS       64      // max threads sampled by the profiler, including exited ones
+#define PROFILE_SAMPLES 4096    // samples kept per thread
+#define PROFILE_DEPTH   32      // max stack frames per sample
+#define PROFILE_HZ      99      // default sample rate, not a round number to avoid lockstep
 
 // macros
-#define STL_DEBUG(...) if (stl_debug_flag) stl_log(__VA_ARGS__)
+#ifdef STL_NDEBUG
+    // release build, no debug messages and no test of the debug flag
+#define STL_DEBUG(...)
+#else
+#define STL_DEBUG(...) if (__builtin_expect(stl_debug_flag, 0)) stl_log(__VA_ARGS__)
+#endif
 
     // macros to lock/unlock the lists of threads, semaphores ...
 #define LIST_LOCK  { int status;\
@@ -50,6 +89,10 @@
                      if (status) stl_error("list mutex unlock %s", strerror(status));\
                      }
 
+#define COUNT(x)    __atomic_fetch_add(&(x), 1, __ATOMIC_RELAXED)
+// for a counter only written by the holder of a lock, so no read-modify-write is needed
+#define LOCKED_COUNT(x, n)  __atomic_store_n(&(x), __atomic_load_n(&(x), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
 #define ASSERT(c,...)  if ((c)) rtm_error(c, __VA_ARGS__)
 
 // data structures
@@ -60,21 +103,157 @@ typedef struct _thread {
     void *f;  // pointer to thread function entry point
     void *arg;
     int  hasstackdata;
+    int  tid;           // kernel thread id, for reading the page fault counts
+    uint64_t minflt;    // page faults at the last stl_rt_mark
+    uint64_t majflt;
+    struct timespec started;    // when the thread was created
+#ifdef __linux__
+    clockid_t cpuclock; // the thread's CPU time clock
+    timer_t proftimer;  // profiler sample timer
+    struct _profbuf *prof;  // profiler samples, NULL if not being sampled
+#endif
 } thread;
 
+// per-thread statistics, must match stl.thread_stats
+enum { TS_CPU=0, TS_VCSW, TS_IVCSW, TS_MINFLT, TS_MAJFLT, TS_LASTCPU, TS_WALL, TS_N };
+
 typedef struct _semaphore {
     sem_t *sem;          // the POSIX semaphore handle
     char *name;
     int  busy;
+    struct _task *waiters;  // tasks waiting for this semaphore
+    uint64_t posts;     // statistics, updated atomically
+    uint64_t waits;
 } semaphore;
 
+// mutex types, must match stl.mutex
+enum { STL_MUTEX_ERRORCHECK=0, STL_MUTEX_NORMAL=1, STL_MUTEX_ADAPTIVE=2, STL_MUTEX_INHERIT=3, STL_MUTEX_CEILING=4 };
+
 typedef struct _mutex {
     pthread_mutex_t pmutex; // the POSIX mutex handle
     char *name;
     int  busy;
+    int  type;
+    uint64_t locks;     // statistics, written with the mutex held, not kept with STL_NDEBUG
+    uint64_t contended; // number of locks that had to wait
 } mutex;
 
+// latest value, one producer and any number of readers.  Readers only load from it,
+// each part that is written has a cache line of its own so it doesn't bounce between
+// the writer and the readers, or between neighbouring entries
+typedef struct _latest {
+    char *name;
+    int  busy;
+    int  size;          // size of the value in bytes
+    int  nbuf;
+    int  stride;        // distance between buffers, a multiple of the cache line
+    char *buffers;      // each buffer is a version number followed by the value
+    int  published __attribute__((aligned(CACHELINE)));  // newest buffer, updated atomically
+    uint64_t seq;       // number of writes so far
+    uint64_t retries __attribute__((aligned(CACHELINE)));  // reads that overlapped a write, not kept with STL_NDEBUG
+} __attribute__((aligned(CACHELINE))) latest;
+
+// header at the start of every recording segment file, read by stl_record_load.m
+typedef struct _recheader {
+    char     magic[8];      // "STLREC1"
+    uint32_t recsize;       // bytes per record, timestamp plus data plus padding
+    uint32_t datasize;      // bytes of data per record
+    uint64_t count;         // number of records in this segment, updated as they are written
+    uint32_t segment;       // segment number, from 0
+    uint32_t schemalen;
+    char     schema[];      // field descriptions "name:class:numel;..."
+} recheader;
+
+// a mapped recording segment
+typedef struct _recsegment {
+    int      fd;
+    char     *base;
+    size_t   size;
+    uint32_t segment;
+} recsegment;
+
+// recording channel, one producer thread
+typedef struct _recorder {
+    char *name;         // file name, segments are name.000, name.001 ...
+    char *schema;
+    int  busy;
+    int  recsize;
+    int  datasize;
+    int  capacity;      // records per segment
+    int  nkeep;         // number of segments to keep, 0 for all
+    recsegment *cur;    // owned by the producer
+    recsegment *next;   // prepared by the recorder thread, taken by the producer
+    recsegment *retired;// full segment handed back to the recorder thread
+    uint64_t n;         // records in the current segment
+    uint32_t nsegments; // number of segments created
+    uint64_t records;   // statistics
+    uint64_t dropped;   // records lost because the next segment wasn't ready
+} recorder;
+
+// bounded queue of fixed size items between pipeline stages
+typedef struct _queue {
+    char *items;
+    int  size;          // bytes per item
+    int  capacity;
+    int  head;          // next item to take
+    int  count;
+    pthread_mutex_t mutex;
+    pthread_cond_t notempty;
+    pthread_cond_t notfull;
+} queue;
+
+typedef struct _stage {
+    char *name;
+    void *f;            // MATLAB entry point
+    int  insize;        // 0 for the first stage
+    int  outsize;       // 0 for the last stage
+    int  nworkers;
+    pthread_t workers[NWORKERS];
+    queue *in;          // NULL for the first stage
+    queue *out;         // NULL for the last stage
+    struct _pipeline *pipeline;
+    uint64_t items;     // statistics, updated atomically
+    uint64_t busy_ns;   // total time in the entry point
+    uint64_t max_ns;
+    uint64_t blocked_ns;// total time waiting for space in the output queue
+} stage;
+
+typedef struct _pipeline {
+    char *name;
+    int  busy;
+    int  nstages;
+    int  running;
+    stage stages[NSTAGES];
+    uint64_t start_ns;
+} pipeline;
+
 #ifdef __linux__
+// file descriptor watched by the reactor thread
+typedef struct _watch {
+    int  fd;
+    char *name;
+    int  busy;
+    int  owned;         // fd was opened by stl_watch_path and is closed by stl_unwatch
+    uint32_t generation;// incremented when the slot is reused, to discard stale events
+    void (*f)(int32_t, int32_t, void *);  // MATLAB entry point
+    void *arg;
+    uint64_t events;    // statistics, number of callbacks
+} watch;
+
+// UDP socket with preallocated message headers for batched I/O
+typedef struct _udpsocket {
+    int  fd;
+    int  busy;
+    int  port;
+    int  maxpkts;       // size of the arrays below
+    struct mmsghdr *msgs;
+    struct iovec *iov;
+    struct sockaddr_in *addrs;
+    char *control;      // ancillary data for the receive timestamps
+    uint64_t packets;   // statistics
+    uint64_t batches;
+} udpsocket;
+
 typedef struct _timer {
     timer_t timer; // the POSIX timer handle
     char *name;
@@ -84,24 +263,45 @@ typedef struct _timer {
 
 // local forward defines
 static void stl_thread_wrapper( thread *tp);
+static struct _task *task_self();
+static void task_sleep(double t);
+static void task_sem_wait(int slot);
+static void task_sem_wake(int slot);
+static void profile_arm(thread *tp);
+static void profile_disarm(thread *tp);
 extern int errno;
 
 // local data
 static thread threadlist[NTHREADS];
 static mutex mutexlist[NMUTEXS];
 static semaphore semlist[NSEMAPHORES];
+static latest latestlist[NLATEST];
+static recorder recordlist[NRECORDERS];
+static pipeline pipelinelist[NPIPELINES];
+static pthread_mutex_t record_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t record_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t record_thread;
+static int record_started;
 #ifdef __linux__
 static timer timerlist[NTIMERS];
+static watch watchlist[NWATCHES];
+static udpsocket udplist[NUDPSOCKETS];
+static int   reactor_epfd = -1;
+static pthread_t reactor_thread;
 #endif
 static int stl_debug_flag = 1;
 static int stl_cmdline_argc;
 static char **stl_cmdline_argv;
 static pthread_mutex_t list_mutex;
+static uint64_t threads_created;
+static stl_rtopts rt;           // real-time options
+static int rt_mode;             // set by stl_rt_initialize
+static int pagesize = 4096;
 
 //---------------------------------------------------------------------
 
 void
-stl_initialize(int argc, char **argv)
+stl_initialize(int argc, char **argv, stl_rtopts *rtopts)
 {
     // stash the command line arguments for access by stl_argc and stl_argv
     stl_cmdline_argc = argc;
@@ -119,6 +319,253 @@ stl_initialize(int argc, char **argv)
 
     // allocate a dummy thread list entry for the main thread
     stl_thread_add("user");
+
+    // real-time mode, get all page faults out of the way before the user's code runs
+    if (rtopts)
+        stl_rt_initialize(rtopts);
+}
+
+static void __attribute__((noinline))
+stl_prefault_stack(size_t size)
+{
+    // touch every page of the next size bytes of stack, from the top down
+    volatile char *p = (volatile char *)alloca(size);
+
+    for (size_t i=0; i<size; i+=pagesize)
+        p[size-1-i] = 0;
+}
+
+static size_t
+stl_stack_left(size_t size)
+{
+    // bytes of this thread's stack below the current frame, less room for the frames still
+    // to come, but at most size.  The TLS and thread descriptor are carved from the top of
+    // the same allocation, so the stack size overstates what is left
+#ifdef __GLIBC__
+    pthread_attr_t attr;
+    void   *addr;
+    size_t  stacksize, left = 0;
+    char    here;
+
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        if (pthread_attr_getstack(&attr, &addr, &stacksize) == 0 && &here - (char *)addr > 2*pagesize)
+            left = &here - (char *)addr - 2*pagesize;
+        pthread_attr_destroy(&attr);
+        if (left < size)
+            size = left;
+    }
+#endif
+    return size;
+}
+
+void
+stl_rt_initialize(stl_rtopts *rtopts)
+{
+    rt = *rtopts;
+    rt_mode = 1;
+    pagesize = sysconf(_SC_PAGESIZE);
+    if (rt.stack_size <= 0)
+        rt.stack_size = RT_STACK;
+    if (rt.stack_size < 16*pagesize)
+        rt.stack_size = 16*pagesize;
+
+#ifdef __GLIBC__
+    // keep freed memory in the heap, don't return it to the kernel or use mmap, so the
+    // prefaulted reserve stays mapped
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+#endif
+    // lock everything mapped now or later into RAM
+    if (rt.lock && mlockall(MCL_CURRENT | MCL_FUTURE))
+        stl_log("rt: mlockall failed %s, check RLIMIT_MEMLOCK", strerror(errno));
+
+    // grow the heap by the reserve and fault it in, then give it back to malloc
+    if (rt.heap_reserve > 0) {
+        char *p = (char *)malloc(rt.heap_reserve);
+
+        if (p == NULL)
+            stl_error("rt: couldn't allocate %d byte heap reserve", rt.heap_reserve);
+        for (int32_t i=0; i<rt.heap_reserve; i+=pagesize)
+            p[i] = 0;
+        free(p);
+    }
+
+    stl_prefault_stack(stl_stack_left(rt.stack_size / 2));  // main thread has its own stack, don't overrun it
+    STL_DEBUG("rt: memory %slocked, %d byte heap reserve, %d byte stacks", rt.lock ? "" : "not ",
+            rt.heap_reserve, rt.stack_size);
+}
+
+#ifdef __linux__
+// fields of /proc/PID/task/TID/stat, numbered as in proc(5)
+#define STAT_MINFLT     10
+#define STAT_MAJFLT     12
+#define STAT_PROCESSOR  39
+
+static int
+stl_thread_stat(thread *tp, unsigned long long *field, int n)
+{
+    // read the first n fields of a thread's stat file, the state field reads as 0
+    char path[64], buf[1024], *p, *end;
+    FILE *fp;
+    int i = 0;
+
+    memset(field, 0, n * sizeof(*field));
+    if (tp->tid == 0)
+        return 0;   // not started yet
+    snprintf(path, sizeof(path), "/proc/self/task/%d/stat", tp->tid);
+    if ((fp = fopen(path, "r")) == NULL)
+        return 0;
+    // the command name is in parentheses and may contain spaces, fields resume after it
+    if (fgets(buf, sizeof(buf), fp) && (p = strrchr(buf, ')')) && n > 3) {
+        field[1] = tp->tid;
+        for (i=4, p+=3; i<n && *p; i++, p=end) {
+            field[i] = strtoull(p, &end, 10);
+            if (end == p)
+                break;
+        }
+    }
+    fclose(fp);
+    return i;
+}
+
+static void
+stl_thread_faults(thread *tp, uint64_t *minflt, uint64_t *majflt)
+{
+    // read a thread's page fault counts from /proc
+    unsigned long long field[STAT_MAJFLT+1];
+
+    stl_thread_stat(tp, field, STAT_MAJFLT+1);
+    *minflt = field[STAT_MINFLT];
+    *majflt = field[STAT_MAJFLT];
+}
+
+static void
+stl_thread_switches(thread *tp, unsigned long long *vcsw, unsigned long long *ivcsw)
+{
+    // read a thread's context switch counts from /proc
+    char path[64], buf[256];
+    FILE *fp;
+
+    *vcsw = *ivcsw = 0;
+    snprintf(path, sizeof(path), "/proc/self/task/%d/status", tp->tid);
+    if (tp->tid == 0 || (fp = fopen(path, "r")) == NULL)
+        return;
+    while (fgets(buf, sizeof(buf), fp)) {
+        if (sscanf(buf, "voluntary_ctxt_switches: %llu", vcsw) == 1)
+            continue;
+        if (sscanf(buf, "nonvoluntary_ctxt_switches: %llu", ivcsw) == 1)
+            break;
+    }
+    fclose(fp);
+}
+#endif
+
+void
+stl_rt_mark()
+{
+    // note the page fault count of every thread, call after warm-up
+#ifdef __linux__
+    for (int i=0; i<NTHREADS; i++)
+        if (threadlist[i].busy)
+            stl_thread_faults(&threadlist[i], &threadlist[i].minflt, &threadlist[i].majflt);
+#endif
+}
+
+int32_t
+stl_rt_report()
+{
+    // log the page faults of each thread since stl_rt_mark, return the total
+    int32_t total = 0;
+
+#ifdef __linux__
+    for (int i=0; i<NTHREADS; i++) {
+        thread *tp = &threadlist[i];
+        uint64_t minflt, majflt;
+
+        if (tp->busy == 0)
+            continue;
+        stl_thread_faults(tp, &minflt, &majflt);
+        stl_log("rt: thread #%d <%s> %llu minor %llu major page faults", i, tp->name,
+                (unsigned long long)(minflt - tp->minflt), (unsigned long long)(majflt - tp->majflt));
+        total += (minflt - tp->minflt) + (majflt - tp->majflt);
+    }
+#endif
+    return total;
+}
+
+static void
+stl_thread_getstats(thread *tp, double *stats)
+{
+    // fill in TS_N statistics for the thread
+    struct timespec ts;
+
+    memset(stats, 0, TS_N * sizeof(*stats));
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    stats[TS_WALL] = (ts.tv_sec - tp->started.tv_sec) + (ts.tv_nsec - tp->started.tv_nsec) * 1e-9;
+    stats[TS_LASTCPU] = -1;
+
+    if (pthread_equal(tp->pthread, pthread_self())) {
+        // the calling thread, no need to go through /proc
+#ifdef __linux__
+        struct rusage ru;
+
+        if (getrusage(RUSAGE_THREAD, &ru) == 0) {
+            stats[TS_VCSW] = ru.ru_nvcsw;
+            stats[TS_IVCSW] = ru.ru_nivcsw;
+            stats[TS_MINFLT] = ru.ru_minflt;
+            stats[TS_MAJFLT] = ru.ru_majflt;
+        }
+        stats[TS_LASTCPU] = sched_getcpu();
+#endif
+        if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+            stats[TS_CPU] = ts.tv_sec + ts.tv_nsec * 1e-9;
+        return;
+    }
+
+#ifdef __linux__
+    unsigned long long field[STAT_PROCESSOR+1], vcsw, ivcsw;
+
+    if (tp->tid && clock_gettime(tp->cpuclock, &ts) == 0)
+        stats[TS_CPU] = ts.tv_sec + ts.tv_nsec * 1e-9;
+    stl_thread_switches(tp, &vcsw, &ivcsw);
+    stats[TS_VCSW] = vcsw;
+    stats[TS_IVCSW] = ivcsw;
+    if (stl_thread_stat(tp, field, STAT_PROCESSOR+1) > STAT_PROCESSOR) {
+        stats[TS_MINFLT] = field[STAT_MINFLT];
+        stats[TS_MAJFLT] = field[STAT_MAJFLT];
+        stats[TS_LASTCPU] = field[STAT_PROCESSOR];
+    }
+#endif
+}
+
+void
+stl_thread_stats(int32_t slot, double *stats)
+{
+    // CPU time, context switches, page faults, last CPU and age of a thread, -1 for the caller
+    if (slot < 0)
+        slot = stl_thread_self();
+    if (slot >= NTHREADS || threadlist[slot].busy == 0)
+        stl_error("thread_stats: thread %d not allocated", slot+1);
+    stl_thread_getstats(&threadlist[slot], stats);
+}
+
+void
+stl_thread_report()
+{
+    // log the statistics of every thread
+    double stats[TS_N];
+
+    for (int i=0; i<NTHREADS; i++) {
+        thread *tp = &threadlist[i];
+
+        if (tp->busy == 0)
+            continue;
+        stl_thread_getstats(tp, stats);
+        stl_log("thread #%d <%s> cpu %.3fs of %.3fs, %.0f voluntary %.0f involuntary switches, "
+                "%.0f minor %.0f major faults, last on cpu %.0f", i, tp->name,
+                stats[TS_CPU], stats[TS_WALL], stats[TS_VCSW], stats[TS_IVCSW],
+                stats[TS_MINFLT], stats[TS_MAJFLT], stats[TS_LASTCPU]);
+    }
 }
 
 void
@@ -152,9 +599,17 @@ stl_sleep(double t)
     struct timespec ts;
     int status;
 
+    // a task gives up its worker thread while it sleeps
+    if (task_self()) {
+        task_sleep(t);
+        return;
+    }
+
     ts.tv_sec = (int) t;
     ts.tv_nsec = (t - ts.tv_sec) * 1e9;
-    status = nanosleep( &ts, NULL );
+    // a signal, such as the profiler's, cuts the sleep short so sleep for the remainder
+    while ((status = nanosleep( &ts, &ts )) && errno == EINTR)
+        ;
     if (status)
         stl_error("sleep: failed %s", strerror(errno));
 }
@@ -192,14 +647,19 @@ stl_thread_create(char *func, void *arg, int hasstackdata)
     tp->f = f;
     tp->arg = arg;
     tp->hasstackdata = hasstackdata;
+    tp->tid = 0;    // set by the thread once it is running
+    clock_gettime(CLOCK_MONOTONIC, &tp->started);
 
     // set attributes
     pthread_attr_init(&attr);
+    if (rt_mode)
+        pthread_attr_setstacksize(&attr, rt.stack_size);    // the whole stack is faulted in
     
     // check result
     status = pthread_create(&(tp->pthread), &attr, (void *(*)(void *))stl_thread_wrapper, tp);
     if (status)
         stl_error("thread_create: create <%s> failed %s", tp->name, strerror(status));
+    COUNT(threads_created);
 
     return slot;
 }
@@ -226,6 +686,13 @@ stl_thread_add(char *name)
     tp->name = stl_stralloc(name);
     tp->pthread = pthread_self();
     tp->f = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &tp->started);
+#ifdef __linux__
+    pthread_getcpuclockid(tp->pthread, &tp->cpuclock);
+    tp->tid = syscall(SYS_gettid);
+    stl_thread_faults(tp, &tp->minflt, &tp->majflt);
+#endif
+    profile_arm(tp);
     
     return slot;
 }
@@ -234,12 +701,8 @@ stl_thread_add(char *name)
 static void
 stl_thread_wrapper( thread *tp)
 {
-    char *info;
-    if (tp->hasstackdata)
-        info = "[has stack data]";
-    else
-        info = "";
-    STL_DEBUG("starting posix thread <%s> (0x%X) %s", tp->name, (uint32_t)tp->f, info);
+    STL_DEBUG("starting posix thread <%s> (0x%X) %s", tp->name, (uint32_t)tp->f,
+            tp->hasstackdata ? "[has stack data]" : "");
     
     // inform kernel about the thread's name 
     // under linux can see this with ps -o cat /proc/$PID/task/$TID/comm
@@ -251,6 +714,17 @@ stl_thread_wrapper( thread *tp)
     pthread_setname_np(tp->name);
 #endif
 
+#ifdef __linux__
+    pthread_getcpuclockid(pthread_self(), &tp->cpuclock);
+    tp->tid = syscall(SYS_gettid);
+#endif
+    // in real-time mode fault in the rest of the stack now
+    if (rt_mode)
+        stl_prefault_stack(stl_stack_left(rt.stack_size));
+#ifdef __linux__
+    stl_thread_faults(tp, &tp->minflt, &tp->majflt);
+#endif
+    profile_arm(tp);
 
 #ifdef typedef_userStackData
     extern userStackData SD;
@@ -273,6 +747,7 @@ stl_thread_wrapper( thread *tp)
 
     STL_DEBUG("MATLAB function <%s> has returned, thread exiting", tp->name);
 
+    profile_disarm(tp);
     tp->busy = 0;  // free the slot in thread table
 }
 
@@ -360,6 +835,8 @@ stl_sem_create(char *name)
 
     sp->sem = sem;
     sp->name = stl_stralloc(name);
+    sp->posts = 0;
+    sp->waits = 0;
 
     STL_DEBUG("creating semaphore #%d <%s>", slot, name);
 
@@ -375,6 +852,9 @@ stl_sem_post(int32_t slot)
     if (semlist[slot].busy == 0)
         stl_error("sem_post: sem %d not allocated", slot);
     status = sem_post(semlist[slot].sem);
+    COUNT(semlist[slot].posts);
+    if (__atomic_load_n(&semlist[slot].waiters, __ATOMIC_SEQ_CST))
+        task_sem_wake(slot);    // let a waiting task try for it
 
     if (status)
         stl_error("sem_post: <%s> failed %s", semlist[slot].name, strerror(errno));
@@ -390,7 +870,15 @@ stl_sem_wait(int32_t slot)
 
     // blocking wait on semaphore
     STL_DEBUG("waiting for semaphore #%d <%s>", slot, semlist[slot].name);
-    status = sem_wait(semlist[slot].sem);
+    if (task_self()) {
+        // a task gives up its worker thread until the semaphore is posted
+        while (sem_trywait(semlist[slot].sem) != 0)
+            task_sem_wait(slot);
+        status = 0;
+    } else
+        while ((status = sem_wait(semlist[slot].sem)) && errno == EINTR)
+            ;
+    COUNT(semlist[slot].waits);
 
     if (status)
         stl_error("sem_wait: <%s> failed %s", semlist[slot].name, strerror(errno));
@@ -425,7 +913,7 @@ stl_sem_wait_noblock(int32_t slot)
 }
 
 int32_t
-stl_mutex_create(char *name)
+stl_mutex_create(char *name, int32_t type, int32_t ceiling)
 {
     int status;
     int slot;
@@ -446,16 +934,52 @@ stl_mutex_create(char *name)
     if (mp == NULL)
         stl_error("mutex_create: too many mutexes, increase NMUTEXS (currently %d)", NMUTEXS);
 
-    mp->name = name;
+    mp->name = stl_stralloc(name);
+    mp->type = type;
+    mp->locks = 0;
+    mp->contended = 0;
 
     pthread_mutexattr_init(&attr);
-    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
+    switch (type) {
+        case STL_MUTEX_ERRORCHECK:
+            // checks for relocking and unlocking by another thread, at some cost
+            status = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
+            break;
+        case STL_MUTEX_NORMAL:
+            status = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_NORMAL);
+            break;
+        case STL_MUTEX_ADAPTIVE:
+            // spin briefly before sleeping, good for short critical sections on multicore
+#ifdef PTHREAD_ADAPTIVE_MUTEX_INITIALIZER_NP
+            status = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+#else
+            status = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_NORMAL);
+#endif
+            break;
+        case STL_MUTEX_INHERIT:
+            // the owner runs at the priority of the highest priority waiter
+            status = pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+            break;
+        case STL_MUTEX_CEILING:
+            // the owner runs at the ceiling priority while it holds the lock
+            if (ceiling <= 0)
+                ceiling = sched_get_priority_max(SCHED_FIFO);
+            status = pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_PROTECT);
+            if (status == 0)
+                status = pthread_mutexattr_setprioceiling(&attr, ceiling);
+            break;
+        default:
+            stl_error("mutex_create: <%s> unknown mutex type %d", name, type);
+    }
+    if (status)
+        stl_error("mutex_create: <%s> set attribute failed %s", name, strerror(status));
     status = pthread_mutex_init(&mp->pmutex, &attr);
+    pthread_mutexattr_destroy(&attr);
 
     if (status)
         stl_error("mutex_create: <%s> failed %s", mutexlist[slot].name, strerror(status));
 
-    STL_DEBUG("create mutex #%d <%s>", slot, name);
+    STL_DEBUG("create mutex #%d <%s> type %d", slot, name, type);
 
     return slot;
 }
@@ -470,7 +994,22 @@ stl_mutex_lock(int32_t slot)
 
     // blocking wait on mutex
     STL_DEBUG("attempting lock on mutex #%d <%s>", slot, mutexlist[slot].name);
+#ifdef STL_NDEBUG
     status = pthread_mutex_lock(&mutexlist[slot].pmutex);
+#else
+    int contended = 0;
+
+    status = pthread_mutex_trylock(&mutexlist[slot].pmutex);
+    if (status == EBUSY) {
+        contended = 1;
+        status = pthread_mutex_lock(&mutexlist[slot].pmutex);
+    }
+    if (status == 0) {
+        // the counters are only written with the mutex held
+        LOCKED_COUNT(mutexlist[slot].contended, contended);
+        LOCKED_COUNT(mutexlist[slot].locks, 1);
+    }
+#endif
 
     if (status)
         stl_error("mutex_lock: <%s> failed %s", mutexlist[slot].name, strerror(status));
@@ -492,6 +1031,9 @@ stl_mutex_lock_noblock(int32_t slot)
 
     switch (status) {
         case 0:
+#ifndef STL_NDEBUG
+            LOCKED_COUNT(mutexlist[slot].locks, 1);
+#endif
             STL_DEBUG("test mutex - UNLOCKED #%d <%s>", slot, semlist[slot].name);
             return 1; // unlocked, it's ours, return true
         case EBUSY:
@@ -579,89 +1121,2067 @@ stl_timer_create(char *name, double interval, int32_t semid)
 }
 #endif 
 
-char *
-stl_stralloc(char *s)
+//------------------- latest value
+//
+// A value written by one thread and read by many, where readers only want the newest
+// value.  The value is held in a ring of nbuf buffers.  The writer fills the buffer after
+// the published one and then publishes it with an atomic store, so it never waits for
+// readers.  Each buffer has a version number which is odd while it is being written, a
+// reader copies the published buffer and retries if the version changed during the copy,
+// which only happens if the writer laps it by nbuf-1 writes.
+
+#define LATEST_VERSION(lp, b)   ((uint64_t *)((lp)->buffers + (b) * (lp)->stride))
+#define LATEST_DATA(lp, b)      ((lp)->buffers + (b) * (lp)->stride + sizeof(uint64_t))
+
+int32_t
+stl_latest_create(char *name, void *initial, int32_t size, int32_t nbuf)
 {
-    char    *n = (char *)malloc(strlen(s)+1);
-    strcpy(n, s);
-    return n;
+    int slot;
+    latest *p, *lp = NULL;
+
+    if (nbuf <= 0)
+        nbuf = LATEST_NBUF;
+    if (nbuf < 2)
+        stl_error("latest_create: <%s> needs at least 2 buffers", name);
+
+    // find an empty slot
+    LIST_LOCK
+        for (p=latestlist, slot=0; slot<NLATEST; slot++, p++) {
+            if (p->busy  == 0) {
+                lp = p;
+                lp->busy++; // mark it busy
+                break;
+            }
+        }
+    LIST_UNLOCK
+    if (lp == NULL)
+        stl_error("latest_create: too many latest values, increase NLATEST (currently %d)", NLATEST);
+
+    lp->name = stl_stralloc(name);
+    lp->size = size;
+    lp->nbuf = nbuf;
+    lp->stride = (sizeof(uint64_t) + size + CACHELINE-1) & ~(CACHELINE-1);
+    if (posix_memalign((void **)&lp->buffers, CACHELINE, nbuf * lp->stride))
+        stl_error("latest_create: <%s> out of memory", name);
+    memset(lp->buffers, 0, nbuf * lp->stride);
+
+    // the initial value is the first published value, with sequence number 0
+    memcpy(LATEST_DATA(lp, 0), initial, size);
+    lp->published = 0;
+    lp->seq = 0;
+    lp->retries = 0;
+
+    STL_DEBUG("create latest value #%d <%s>, %d bytes, %d buffers", slot, name, size, nbuf);
+
+    return slot;
 }
 
-void stl_error(const char *fmt, ...)
+void
+stl_latest_write(int32_t slot, void *value, int32_t size)
 {
-    va_list ap;
+    latest *lp = &latestlist[slot];
+    uint64_t seq, *version;
+    int b;
+
+    if (lp->busy == 0)
+        stl_error("latest_write: latest value %d not allocated", slot);
+    if (size != lp->size)
+        stl_error("latest_write: <%s> value is %d bytes, expecting %d", lp->name, size, lp->size);
+
+    // only this thread changes published and seq
+    b = (lp->published + 1) % lp->nbuf;
+    seq = lp->seq + 1;
+    version = LATEST_VERSION(lp, b);
+
+    __atomic_store_n(version, 2*seq-1, __ATOMIC_RELAXED);   // odd, write in progress
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(LATEST_DATA(lp, b), value, size);
+    __atomic_store_n(version, 2*seq, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&lp->seq, seq, __ATOMIC_RELEASE);
+    __atomic_store_n(&lp->published, b, __ATOMIC_RELEASE);
+}
 
-    va_start(ap, fmt);
+uint64_t
+stl_latest_read(int32_t slot, void *value, int32_t size)
+{
+    latest *lp = &latestlist[slot];
+    uint64_t v1, v2, *version;
+    int b;
+
+    if (lp->busy == 0)
+        stl_error("latest_read: latest value %d not allocated", slot);
+    if (size != lp->size)
+        stl_error("latest_read: <%s> value is %d bytes, expecting %d", lp->name, size, lp->size);
+
+    for (;;) {
+        b = __atomic_load_n(&lp->published, __ATOMIC_ACQUIRE);
+        version = LATEST_VERSION(lp, b);
+        v1 = __atomic_load_n(version, __ATOMIC_ACQUIRE);
+        if ((v1 & 1) == 0) {
+            memcpy(value, LATEST_DATA(lp, b), size);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            v2 = __atomic_load_n(version, __ATOMIC_RELAXED);
+            if (v1 == v2)
+                break;
+        }
+#ifndef STL_NDEBUG
+        COUNT(lp->retries);  // the writer overwrote this buffer while we were copying
+#endif
+    }
 
-    fprintf(stderr, "stl-error:: ");
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
+    return v1 / 2;  // the sequence number of this value
+}
 
-    va_end(ap);
+uint64_t
+stl_latest_seq(int32_t slot)
+{
+    if (latestlist[slot].busy == 0)
+        stl_error("latest_seq: latest value %d not allocated", slot);
 
-#ifdef __APPLE__
-     void* callstack[128];
-     int i, frames = backtrace(callstack, 128);
-     char** strs = backtrace_symbols(callstack, frames);
-     for (i = 0; i < frames; ++i) {
-         printf("%s\n", strs[i]);
-     }
-     free(strs);
-#endif
+    return __atomic_load_n(&latestlist[slot].seq, __ATOMIC_ACQUIRE);
+}
 
-    exit(1);
+#ifdef __linux__
+//------------------- reactor
+//
+// One thread waits on all watched file descriptors with epoll and calls the MATLAB entry
+// point registered for a descriptor when it becomes ready.  Entry points run one at a
+// time on the reactor thread so they should not block.
+
+// event bits, must match stl.watch
+#define STL_READ    1
+#define STL_WRITE   2
+#define STL_HANGUP  4       // reported only, hangup or error on the descriptor
+#define STL_EDGE    8       // requested only, edge triggered
+
+static void *
+stl_reactor(void *arg)
+{
+    struct epoll_event events[NWATCHES];
+    int n, i;
+
+    stl_thread_add("REACTOR");
+
+    for (;;) {
+        n = epoll_wait(reactor_epfd, events, NWATCHES, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            stl_error("reactor: epoll_wait failed %s", strerror(errno));
+        }
+        for (i=0; i<n; i++) {
+            int      slot = events[i].data.u64 & 0xffffffff;
+            uint32_t generation = events[i].data.u64 >> 32;
+            uint32_t e = events[i].events;
+            watch   *wp = &watchlist[slot];
+            int32_t  ready = 0;
+
+            // the descriptor may have been unwatched since epoll_wait returned
+            if (wp->busy == 0 || wp->generation != generation)
+                continue;
+            if (e & EPOLLIN)
+                ready |= STL_READ;
+            if (e & EPOLLOUT)
+                ready |= STL_WRITE;
+            if (e & (EPOLLHUP | EPOLLERR | EPOLLRDHUP))
+                ready |= STL_HANGUP;
+
+            COUNT(wp->events);
+            wp->f(slot, ready, wp->arg);
+        }
+    }
+    return NULL;
 }
 
-void 
-stl_log(const char *fmt, ...)
+int32_t
+stl_watch_fd(int32_t fd, int32_t events, char *func, void *arg)
 {
-#define LOGLEN  128
-    char    buf[LOGLEN+1]; // make room for the final newline
-    struct timespec tp;
-    struct tm t;
-    int len = 0;
+    struct epoll_event ev;
+    void (*f)(int32_t, int32_t, void *);
+    int slot;
+    watch *p, *wp = NULL;
 
-    // put date/time into buffer
-    clock_gettime(CLOCK_REALTIME, &tp);
-    localtime_r(&tp.tv_sec, &t);
-    
-    len = strftime(buf, LOGLEN-len, "%F %T", &t);  // date + time
-    len += snprintf(buf+len, LOGLEN-len, ".%06ld", tp.tv_nsec / 1000); // fractional part
+    // map function name to a pointer
+    f = (void (*)(int32_t, int32_t, void *)) stl_get_functionptr(func);
+    if (f == NULL)
+        stl_error("watch: MATLAB entrypoint named [%s] not found", func);
 
-    // append the thread name
-    len += snprintf(buf+len, LOGLEN-len, " [%s] ", stl_thread_name(-1));
+    // find an empty slot, start the reactor the first time
+    LIST_LOCK
+        if (reactor_epfd < 0) {
+            reactor_epfd = epoll_create1(EPOLL_CLOEXEC);
+            if (reactor_epfd < 0)
+                stl_error("watch: epoll_create failed %s", strerror(errno));
+            if (pthread_create(&reactor_thread, NULL, stl_reactor, NULL))
+                stl_error("watch: reactor thread create failed");
+        }
+        for (p=watchlist, slot=0; slot<NWATCHES; slot++, p++) {
+            if (p->busy  == 0) {
+                wp = p;
+                wp->busy++; // mark it busy
+                break;
+            }
+        }
+    LIST_UNLOCK
+    if (wp == NULL)
+        stl_error("watch: too many watched descriptors, increase NWATCHES (currently %d)", NWATCHES);
+
+    wp->fd = fd;
+    if (wp->name == NULL)
+        wp->name = stl_stralloc(func);
+    wp->f = f;
+    wp->arg = arg;
+    wp->events = 0;
+    wp->generation++;
+
+    // edge triggered descriptors should be non-blocking so the callback can drain them
+    if (events & STL_EDGE)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    ev.events = EPOLLRDHUP;
+    if (events & STL_READ)
+        ev.events |= EPOLLIN;
+    if (events & STL_WRITE)
+        ev.events |= EPOLLOUT;
+    if (events & STL_EDGE)
+        ev.events |= EPOLLET;
+    ev.data.u64 = ((uint64_t)wp->generation << 32) | slot;
+    if (epoll_ctl(reactor_epfd, EPOLL_CTL_ADD, fd, &ev))
+        stl_error("watch: <%s> fd %d failed %s", func, fd, strerror(errno));
+
+    STL_DEBUG("watch #%d fd %d events 0x%x <%s>", slot, fd, events, func);
 
-    // apppend the print string
-    va_list ap;
-    va_start(ap, fmt);
-    vsnprintf(buf+len, LOGLEN-len, fmt, ap);
-    va_end(ap);
-    
-    buf[LOGLEN-1] = 0;  // for safety with long strings
+    return slot;
+}
 
-    // append a new line
-    strcat(buf, "\n");
-    
-    // send it to stderr atomically
-    fputs(buf, stderr);
-    fflush(stderr);
+int32_t
+stl_watch_path(char *path, int32_t events, char *func, void *arg)
+{
+    int fd, slot, mode;
+
+    if ((events & (STL_READ|STL_WRITE)) == (STL_READ|STL_WRITE))
+        mode = O_RDWR;
+    else if (events & STL_WRITE)
+        mode = O_WRONLY;
+    else
+        mode = O_RDONLY;
+
+    fd = open(path, mode | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0)
+        stl_error("watch: couldn't open %s %s", path, strerror(errno));
+
+    slot = stl_watch_fd(fd, events, func, arg);
+    watchlist[slot].owned = 1;
+
+    return slot;
 }
 
-void *
-stl_get_functionptr(char *name)
+void
+stl_unwatch(int32_t slot)
 {
-#ifdef __linux__
-    // this is ugly, but I can't figure how to make dlopen/dlsym work under Linux
-    // dlsym() is supported but always returns NULL.
-    FILE *fp;
-    char cmd[4096];
-    void *f;
+    watch *wp = &watchlist[slot];
 
-    snprintf(cmd, 4096, "nm %s | grep %s", stl_cmdline_argv[0], name);
-    fp = popen(cmd, "r");
-    fscanf(fp, "%x", &f);
-    fclose(fp);
-    printf("f 0x%x\n", f);
+    if (wp->busy == 0)
+        stl_error("unwatch: watch %d not allocated", slot);
+
+    STL_DEBUG("unwatch #%d fd %d <%s>", slot, wp->fd, wp->name);
+    epoll_ctl(reactor_epfd, EPOLL_CTL_DEL, wp->fd, NULL);
+    if (wp->owned)
+        close(wp->fd);
+    wp->owned = 0;
+    free(wp->name);
+    wp->name = NULL;
+
+    LIST_LOCK
+        wp->generation++;
+        wp->busy = 0;
+    LIST_UNLOCK
+}
+
+int32_t
+stl_watch_read(int32_t slot, void *buf, int32_t len)
+{
+    // non-blocking read, returns number of bytes read, 0 if none available, -1 at end of file
+    ssize_t n;
+
+    if (watchlist[slot].busy == 0)
+        stl_error("watch_read: watch %d not allocated", slot);
+
+    n = read(watchlist[slot].fd, buf, len);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+        stl_error("watch_read: <%s> failed %s", watchlist[slot].name, strerror(errno));
+    }
+    return n == 0 ? -1 : n;
+}
+
+int32_t
+stl_watch_write(int32_t slot, void *buf, int32_t len)
+{
+    // non-blocking write, returns number of bytes written, 0 if the descriptor is full
+    ssize_t n;
+
+    if (watchlist[slot].busy == 0)
+        stl_error("watch_write: watch %d not allocated", slot);
+
+    n = write(watchlist[slot].fd, buf, len);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+        stl_error("watch_write: <%s> failed %s", watchlist[slot].name, strerror(errno));
+    }
+    return n;
+}
+#endif
+
+#ifdef __linux__
+//------------------- batched UDP
+//
+// Packets are received with recvmmsg directly into a caller's array, one packet per
+// column, so a batch of packets costs one system call.  The kernel timestamps each
+// packet on arrival (SO_TIMESTAMPNS).
+
+#define UDP_CONTROLLEN  CMSG_SPACE(sizeof(struct timespec))
+
+int32_t
+stl_udp_open(int32_t port, int32_t maxpkts)
+{
+    struct sockaddr_in addr;
+    int slot, fd, on = 1, rcvbuf = UDP_RCVBUF;
+    udpsocket *p, *up = NULL;
+
+    if (maxpkts < 1)
+        stl_error("udp_open: port %d, maxpkts is %d, must be at least 1", port, maxpkts);
+
+    // find an empty slot
+    LIST_LOCK
+        for (p=udplist, slot=0; slot<NUDPSOCKETS; slot++, p++) {
+            if (p->busy  == 0) {
+                up = p;
+                up->busy++; // mark it busy
+                break;
+            }
+        }
+    LIST_UNLOCK
+    if (up == NULL)
+        stl_error("udp_open: too many sockets, increase NUDPSOCKETS (currently %d)", NUDPSOCKETS);
+
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        stl_error("udp_open: socket failed %s", strerror(errno));
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)))
+        stl_error("udp_open: SO_TIMESTAMPNS failed %s", strerror(errno));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));  // best effort, capped by rmem_max
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)))
+        stl_error("udp_open: bind to port %d failed %s", port, strerror(errno));
+
+    up->fd = fd;
+    up->port = port;
+    up->maxpkts = maxpkts;
+    up->msgs = (struct mmsghdr *)calloc(maxpkts, sizeof(struct mmsghdr));
+    up->iov = (struct iovec *)calloc(maxpkts, sizeof(struct iovec));
+    up->addrs = (struct sockaddr_in *)calloc(maxpkts, sizeof(struct sockaddr_in));
+    up->control = (char *)calloc(maxpkts, UDP_CONTROLLEN);
+    if (!up->msgs || !up->iov || !up->addrs || !up->control)
+        stl_error("udp_open: port %d, out of memory for %d packet batches", port, maxpkts);
+    up->packets = 0;
+    up->batches = 0;
+
+    STL_DEBUG("udp socket #%d port %d, batches of %d", slot, port, maxpkts);
+
+    return slot;
+}
+
+int32_t
+stl_udp_recv_batch(int32_t slot, uint8_t *data, int32_t pktsize, int32_t maxpkts,
+        int32_t *lens, double *times, uint32_t *srcaddr, int32_t *srcport, double timeout)
+{
+    // receive up to maxpkts packets into consecutive pktsize blocks of data, waiting up to
+    // timeout seconds (forever if negative) for the first.  Returns the number received.
+    udpsocket *up = &udplist[slot];
+    struct pollfd pfd;
+    int i, n;
+
+    if (up->busy == 0)
+        stl_error("udp_recv_batch: socket %d not allocated", slot);
+    if (maxpkts > up->maxpkts)
+        maxpkts = up->maxpkts;
+
+    pfd.fd = up->fd;
+    pfd.events = POLLIN;
+    n = poll(&pfd, 1, timeout < 0 ? -1 : (int)(timeout * 1000));
+    if (n < 0 && errno != EINTR)
+        stl_error("udp_recv_batch: poll failed %s", strerror(errno));
+    if (n <= 0)
+        return 0;
+
+    for (i=0; i<maxpkts; i++) {
+        struct msghdr *mh = &up->msgs[i].msg_hdr;
+
+        up->iov[i].iov_base = data + (size_t)i * pktsize;
+        up->iov[i].iov_len = pktsize;
+        mh->msg_iov = &up->iov[i];
+        mh->msg_iovlen = 1;
+        mh->msg_name = &up->addrs[i];
+        mh->msg_namelen = sizeof(struct sockaddr_in);
+        mh->msg_control = up->control + i * UDP_CONTROLLEN;
+        mh->msg_controllen = UDP_CONTROLLEN;
+        mh->msg_flags = 0;
+    }
+
+    n = recvmmsg(up->fd, up->msgs, maxpkts, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+        stl_error("udp_recv_batch: port %d recvmmsg failed %s", up->port, strerror(errno));
+    }
+
+    for (i=0; i<n; i++) {
+        struct msghdr *mh = &up->msgs[i].msg_hdr;
+        struct cmsghdr *cmsg;
+
+        lens[i] = up->msgs[i].msg_len;
+        times[i] = 0;
+        for (cmsg = CMSG_FIRSTHDR(mh); cmsg; cmsg = CMSG_NXTHDR(mh, cmsg))
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+                struct timespec ts;
+
+                memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                times[i] = ts.tv_sec + ts.tv_nsec * 1e-9;
+            }
+        if (srcaddr)
+            srcaddr[i] = ntohl(up->addrs[i].sin_addr.s_addr);
+        if (srcport)
+            srcport[i] = ntohs(up->addrs[i].sin_port);
+    }
+    up->packets += n;
+    up->batches++;
+
+    return n;
+}
+
+int32_t
+stl_udp_send_batch(int32_t slot, uint8_t *data, int32_t pktsize, int32_t npkts,
+        int32_t *lens, char *host, int32_t port)
+{
+    // send npkts packets from consecutive pktsize blocks of data to host:port, returns the
+    // number sent, which may be fewer if the socket buffer is full
+    udpsocket *up = &udplist[slot];
+    struct sockaddr_in addr;
+    int i, n, sent = 0;
+
+    if (up->busy == 0)
+        stl_error("udp_send_batch: socket %d not allocated", slot);
+    if (npkts > up->maxpkts)
+        stl_error("udp_send_batch: %d packets is more than the batch size %d", npkts, up->maxpkts);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+        stl_error("udp_send_batch: bad address %s", host);
+
+    for (i=0; i<npkts; i++) {
+        struct msghdr *mh = &up->msgs[i].msg_hdr;
+
+        up->iov[i].iov_base = data + (size_t)i * pktsize;
+        up->iov[i].iov_len = lens[i] < pktsize ? lens[i] : pktsize;
+        memset(mh, 0, sizeof(*mh));
+        mh->msg_iov = &up->iov[i];
+        mh->msg_iovlen = 1;
+        mh->msg_name = &addr;
+        mh->msg_namelen = sizeof(addr);
+    }
+
+    // sendmmsg can return early, carry on until all are sent or the socket is full
+    while (sent < npkts) {
+        n = sendmmsg(up->fd, up->msgs + sent, npkts - sent, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            stl_error("udp_send_batch: sendmmsg to %s:%d failed %s", host, port, strerror(errno));
+        }
+        sent += n;
+    }
+    return sent;
+}
+
+void
+stl_udp_close(int32_t slot)
+{
+    udpsocket *up = &udplist[slot];
+
+    if (up->busy == 0)
+        stl_error("udp_close: socket %d not allocated", slot);
+
+    STL_DEBUG("udp socket #%d port %d closed", slot, up->port);
+    close(up->fd);
+    free(up->msgs);
+    free(up->iov);
+    free(up->addrs);
+    free(up->control);
+
+    LIST_LOCK
+        up->busy = 0;
+    LIST_UNLOCK
+}
+#endif
+
+//------------------- binary recorder
+//
+// Fixed size records are written into a memory mapped file, a timestamp then a copy of
+// the data.  The file is split into preallocated segments, the recorder thread creates
+// and maps the next segment ahead of time and unmaps full ones, so the producer only
+// does a memcpy and never waits for the disk.  If the next segment isn't ready when the
+// current one fills, records are dropped and counted.
+
+static recsegment *
+record_segment(recorder *rp)
+{
+    // create, preallocate and map the next segment file
+    char filename[1024];
+    recsegment *sp;
+    recheader *hp;
+    size_t size = RECORD_HDRSIZE + (size_t)rp->capacity * rp->recsize;
+    int flags = MAP_SHARED;
+
+    snprintf(filename, sizeof(filename), "%s.%03u", rp->name, rp->nsegments);
+    sp = (recsegment *)calloc(1, sizeof(recsegment));
+    sp->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (sp->fd < 0)
+        stl_error("record: couldn't create %s %s", filename, strerror(errno));
+    if (ftruncate(sp->fd, size))
+        stl_error("record: couldn't size %s %s", filename, strerror(errno));
+#ifdef __linux__
+    posix_fallocate(sp->fd, 0, size);   // reserve the disk blocks now, not on first write
+    flags |= MAP_POPULATE;              // and fault in the pages
+#endif
+    sp->base = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, sp->fd, 0);
+    if (sp->base == MAP_FAILED)
+        stl_error("record: couldn't map %s %s", filename, strerror(errno));
+    sp->size = size;
+    sp->segment = rp->nsegments++;
+
+    hp = (recheader *)sp->base;
+    memcpy(hp->magic, "STLREC1", 8);
+    hp->recsize = rp->recsize;
+    hp->datasize = rp->datasize;
+    hp->count = 0;
+    hp->segment = sp->segment;
+    hp->schemalen = strlen(rp->schema);
+    memcpy(hp->schema, rp->schema, hp->schemalen);
+    STL_DEBUG("record: segment %s", filename);
+
+    return sp;
+}
+
+static void
+record_finish(recorder *rp, recsegment *sp)
+{
+    // trim the segment to the records written, then unmap it
+    recheader *hp = (recheader *)sp->base;
+    size_t used = RECORD_HDRSIZE + hp->count * hp->recsize;
+    char filename[1024];
+
+    msync(sp->base, sp->size, MS_ASYNC);
+    munmap(sp->base, sp->size);
+    if (ftruncate(sp->fd, used))
+        stl_log("record: couldn't trim segment %u %s", sp->segment, strerror(errno));
+    close(sp->fd);
+
+    // rotate, this segment and the nkeep-1 before it are kept
+    if (rp->nkeep > 0 && sp->segment >= (uint32_t)rp->nkeep) {
+        snprintf(filename, sizeof(filename), "%s.%03u", rp->name, sp->segment - rp->nkeep);
+        unlink(filename);
+    }
+    free(sp);
+}
+
+static void *
+record_service(void *arg)
+{
+    stl_thread_add("RECORDER");
+
+    pthread_mutex_lock(&record_mutex);
+    for (;;) {
+        struct timespec ts;
+
+        for (int i=0; i<NRECORDERS; i++) {
+            recorder *rp = &recordlist[i];
+            recsegment *sp;
+
+            if (rp->busy == 0 || rp->cur == NULL)
+                continue;   // not in use, or being opened
+            // finish the full segment before preparing the next, so the producer never
+            // retires a segment while another is waiting
+            if ((sp = __atomic_exchange_n(&rp->retired, NULL, __ATOMIC_ACQ_REL)))
+                record_finish(rp, sp);
+            if (__atomic_load_n(&rp->next, __ATOMIC_ACQUIRE) == NULL)
+                __atomic_store_n(&rp->next, record_segment(rp), __ATOMIC_RELEASE);
+            else if (rp->cur)
+                msync(rp->cur->base, rp->cur->size, MS_ASYNC);  // push data toward the disk
+        }
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += 1;
+        pthread_cond_timedwait(&record_cond, &record_mutex, &ts);
+    }
+    return NULL;
+}
+
+int32_t
+stl_record_open(char *filename, char *schema, int32_t datasize, double segsize, int32_t nkeep)
+{
+    int slot;
+    recorder *p, *rp = NULL;
+
+    // find an empty slot
+    LIST_LOCK
+        for (p=recordlist, slot=0; slot<NRECORDERS; slot++, p++) {
+            if (p->busy  == 0) {
+                rp = p;
+                rp->busy++; // mark it busy
+                break;
+            }
+        }
+    LIST_UNLOCK
+    if (rp == NULL)
+        stl_error("record_open: too many recordings, increase NRECORDERS (currently %d)", NRECORDERS);
+    if (strlen(schema) > RECORD_HDRSIZE - sizeof(recheader))
+        stl_error("record_open: <%s> schema too long", filename);
+
+    if (segsize <= 0)
+        segsize = RECORD_SEGSIZE;
+    rp->name = stl_stralloc(filename);
+    rp->schema = stl_stralloc(schema);
+    rp->datasize = datasize;
+    rp->recsize = (sizeof(uint64_t) + datasize + 7) & ~7;
+    rp->capacity = segsize / rp->recsize;
+    if (rp->capacity < 1)
+        rp->capacity = 1;
+    rp->nkeep = nkeep;
+    rp->nsegments = 0;
+    rp->n = 0;
+    rp->records = 0;
+    rp->dropped = 0;
+    rp->retired = NULL;
+
+    pthread_mutex_lock(&record_mutex);
+    rp->cur = record_segment(rp);
+    rp->next = record_segment(rp);
+    if (record_started == 0) {
+        record_started = 1;
+        if (pthread_create(&record_thread, NULL, record_service, NULL))
+            stl_error("record_open: recorder thread create failed");
+    }
+    pthread_mutex_unlock(&record_mutex);
+
+    STL_DEBUG("record #%d <%s> %d byte records, %d per segment", slot, filename, rp->recsize, rp->capacity);
+
+    return slot;
+}
+
+void
+stl_record(int32_t slot, void *data, int32_t size)
+{
+    recorder *rp = &recordlist[slot];
+    recsegment *sp = rp->cur;
+    struct timespec ts;
+    char *rec;
+
+    if (rp->busy == 0)
+        stl_error("record: recording %d not open", slot);
+    if (size != rp->datasize)
+        stl_error("record: <%s> data is %d bytes, expecting %d", rp->name, size, rp->datasize);
+
+    if (rp->n == (uint64_t)rp->capacity) {
+        // segment is full, switch to the one prepared by the recorder thread
+        recsegment *next = __atomic_exchange_n(&rp->next, NULL, __ATOMIC_ACQ_REL);
+
+        if (next == NULL) {
+            COUNT(rp->dropped);
+            return;
+        }
+        __atomic_store_n(&rp->retired, sp, __ATOMIC_RELEASE);
+        rp->cur = sp = next;
+        rp->n = 0;
+        pthread_cond_signal(&record_cond);
+    }
+
+    rec = sp->base + RECORD_HDRSIZE + rp->n * rp->recsize;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    *(uint64_t *)rec = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    memcpy(rec + sizeof(uint64_t), data, size);
+
+    // publish the record, a reader of the file sees only complete records
+    rp->n++;
+    __atomic_store_n(&((recheader *)sp->base)->count, rp->n, __ATOMIC_RELEASE);
+    rp->records++;
+}
+
+void
+stl_record_close(int32_t slot)
+{
+    recorder *rp = &recordlist[slot];
+    recsegment *sp;
+    char filename[1024];
+
+    if (rp->busy == 0)
+        stl_error("record_close: recording %d not open", slot);
+
+    STL_DEBUG("record #%d <%s> closed, %llu records, %llu dropped", slot, rp->name,
+            (unsigned long long)rp->records, (unsigned long long)rp->dropped);
+
+    pthread_mutex_lock(&record_mutex);
+    if ((sp = __atomic_exchange_n(&rp->retired, NULL, __ATOMIC_ACQ_REL)))
+        record_finish(rp, sp);
+    record_finish(rp, rp->cur);
+    rp->cur = NULL;
+    if ((sp = __atomic_exchange_n(&rp->next, NULL, __ATOMIC_ACQ_REL))) {
+        // the prepared segment was never used
+        snprintf(filename, sizeof(filename), "%s.%03u", rp->name, sp->segment);
+        munmap(sp->base, sp->size);
+        close(sp->fd);
+        free(sp);
+        unlink(filename);
+    }
+    free(rp->name);
+    free(rp->schema);
+    pthread_mutex_unlock(&record_mutex);
+
+    LIST_LOCK
+        rp->busy = 0;
+    LIST_UNLOCK
+}
+
+//------------------- pipeline
+//
+// A chain of MATLAB entry points, each run by one or more worker threads and connected
+// by bounded queues.  A stage waits when its output queue is full, so a slow stage
+// holds back the ones before it rather than letting work pile up.  Items are structs
+// copied into and out of the queues, the order of items is only kept through stages
+// with a single worker.
+
+static uint64_t
+pipeline_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static queue *
+queue_create(int size, int capacity)
+{
+    queue *qp = (queue *)calloc(1, sizeof(queue));
+
+    qp->items = (char *)malloc((size_t)size * capacity);
+    qp->size = size;
+    qp->capacity = capacity;
+    pthread_mutex_init(&qp->mutex, NULL);
+    pthread_cond_init(&qp->notempty, NULL);
+    pthread_cond_init(&qp->notfull, NULL);
+    return qp;
+}
+
+static int
+queue_put(queue *qp, void *item, int *running)
+{
+    // copy item into the queue, waiting for space, returns 0 if the pipeline stopped
+    pthread_mutex_lock(&qp->mutex);
+    while (qp->count == qp->capacity && __atomic_load_n(running, __ATOMIC_ACQUIRE))
+        pthread_cond_wait(&qp->notfull, &qp->mutex);
+    if (!__atomic_load_n(running, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_unlock(&qp->mutex);
+        return 0;
+    }
+    memcpy(qp->items + (size_t)((qp->head + qp->count) % qp->capacity) * qp->size, item, qp->size);
+    __atomic_store_n(&qp->count, qp->count + 1, __ATOMIC_RELAXED);   // read without the lock for stats
+    pthread_cond_signal(&qp->notempty);
+    pthread_mutex_unlock(&qp->mutex);
+    return 1;
+}
+
+static int
+queue_get(queue *qp, void *item, int *running)
+{
+    // copy the oldest item out of the queue, waiting for one, returns 0 if the pipeline stopped
+    pthread_mutex_lock(&qp->mutex);
+    while (qp->count == 0 && __atomic_load_n(running, __ATOMIC_ACQUIRE))
+        pthread_cond_wait(&qp->notempty, &qp->mutex);
+    if (!__atomic_load_n(running, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_unlock(&qp->mutex);
+        return 0;
+    }
+    memcpy(item, qp->items + (size_t)qp->head * qp->size, qp->size);
+    qp->head = (qp->head + 1) % qp->capacity;
+    __atomic_store_n(&qp->count, qp->count - 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&qp->notfull);
+    pthread_mutex_unlock(&qp->mutex);
+    return 1;
+}
+
+static void
+queue_wake(queue *qp)
+{
+    pthread_mutex_lock(&qp->mutex);
+    pthread_cond_broadcast(&qp->notempty);
+    pthread_cond_broadcast(&qp->notfull);
+    pthread_mutex_unlock(&qp->mutex);
+}
+
+static void
+queue_flush(queue *qp)
+{
+    // discard all items
+    pthread_mutex_lock(&qp->mutex);
+    qp->head = 0;
+    __atomic_store_n(&qp->count, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&qp->mutex);
+}
+
+static void *
+pipeline_worker(void *arg)
+{
+    stage *sp = (stage *)arg;
+    int   *running = &sp->pipeline->running;
+    char  *in = sp->insize ? malloc(sp->insize) : NULL;
+    char  *out = sp->outsize ? malloc(sp->outsize) : NULL;
+    int   slot = stl_thread_add(sp->name);
+
+    if ((sp->insize && in == NULL) || (sp->outsize && out == NULL))
+        stl_error("pipeline: <%s> out of memory", sp->name);
+
+    while (__atomic_load_n(running, __ATOMIC_ACQUIRE)) {
+        uint64_t t0, t1, dt;
+
+        if (in && !queue_get(sp->in, in, running))
+            break;
+
+        t0 = pipeline_now();
+        if (in && out)
+            ((void (*)(void *, void *))sp->f)(in, out);
+        else if (out)
+            ((void (*)(void *))sp->f)(out);     // first stage produces items
+        else
+            ((void (*)(void *))sp->f)(in);      // last stage consumes them
+        t1 = pipeline_now();
+
+        dt = t1 - t0;
+        COUNT(sp->items);
+        __atomic_fetch_add(&sp->busy_ns, dt, __ATOMIC_RELAXED);
+        if (dt > __atomic_load_n(&sp->max_ns, __ATOMIC_RELAXED))
+            __atomic_store_n(&sp->max_ns, dt, __ATOMIC_RELAXED);   // racy, but only a statistic
+
+        if (out) {
+            if (!queue_put(sp->out, out, running))
+                break;
+            __atomic_fetch_add(&sp->blocked_ns, pipeline_now() - t1, __ATOMIC_RELAXED);
+        }
+    }
+
+    free(in);
+    free(out);
+    profile_disarm(&threadlist[slot]);
+    LIST_LOCK
+        free(threadlist[slot].name);
+        threadlist[slot].name = NULL;
+        threadlist[slot].busy = 0;  // free the slot in thread table
+    LIST_UNLOCK
+    return NULL;
+}
+
+int32_t
+stl_pipeline_create(char *name)
+{
+    int slot;
+    pipeline *p, *pp = NULL;
+
+    // find an empty slot
+    LIST_LOCK
+        for (p=pipelinelist, slot=0; slot<NPIPELINES; slot++, p++) {
+            if (p->busy  == 0) {
+                pp = p;
+                pp->busy++; // mark it busy
+                break;
+            }
+        }
+    LIST_UNLOCK
+    if (pp == NULL)
+        stl_error("pipeline_create: too many pipelines, increase NPIPELINES (currently %d)", NPIPELINES);
+
+    pp->name = stl_stralloc(name);
+    pp->nstages = 0;
+    pp->running = 0;
+    pp->start_ns = 0;
+
+    STL_DEBUG("create pipeline #%d <%s>", slot, name);
+
+    return slot;
+}
+
+int32_t
+stl_pipeline_stage(int32_t slot, char *func, int32_t insize, int32_t outsize, int32_t nworkers, int32_t depth)
+{
+    // append a stage, depth is the capacity of the queue to the next stage
+    pipeline *pp = &pipelinelist[slot];
+    stage *sp, *prev;
+
+    if (pp->busy == 0)
+        stl_error("pipeline_stage: pipeline %d not allocated", slot);
+    if (pp->running)
+        stl_error("pipeline_stage: <%s> is running", pp->name);
+    if (pp->nstages == NSTAGES)
+        stl_error("pipeline_stage: <%s> too many stages, increase NSTAGES (currently %d)", pp->name, NSTAGES);
+    if (nworkers < 1 || nworkers > NWORKERS)
+        stl_error("pipeline_stage: <%s> %d workers, must be 1 to NWORKERS (currently %d)", func, nworkers, NWORKERS);
+
+    sp = &pp->stages[pp->nstages];
+    prev = pp->nstages > 0 ? &pp->stages[pp->nstages-1] : NULL;
+    if ((prev ? prev->outsize : 0) != insize)
+        stl_error("pipeline_stage: <%s> input is %d bytes, previous stage outputs %d", func, insize,
+                prev ? prev->outsize : 0);
+
+    memset(sp, 0, sizeof(stage));
+    sp->f = stl_get_functionptr(func);
+    if (sp->f == NULL)
+        stl_error("pipeline_stage: MATLAB entrypoint named [%s] not found", func);
+    sp->name = stl_stralloc(func);
+    sp->insize = insize;
+    sp->outsize = outsize;
+    sp->nworkers = nworkers;
+    sp->pipeline = pp;
+    if (prev)
+        sp->in = prev->out;
+    if (outsize > 0)
+        sp->out = queue_create(outsize, depth > 0 ? depth : 1);
+
+    STL_DEBUG("pipeline <%s> stage %d <%s>, %d workers", pp->name, pp->nstages, func, nworkers);
+
+    return pp->nstages++;
+}
+
+void
+stl_pipeline_start(int32_t slot)
+{
+    pipeline *pp = &pipelinelist[slot];
+    int nworkers = 0, nfree = 0;
+
+    if (pp->busy == 0)
+        stl_error("pipeline_start: pipeline %d not allocated", slot);
+    if (pp->nstages == 0 || pp->stages[pp->nstages-1].outsize != 0)
+        stl_error("pipeline_start: <%s> last stage must have no output", pp->name);
+
+    // check for enough thread slots now, a worker that can't get one would exit the program
+    for (int i=0; i<pp->nstages; i++)
+        nworkers += pp->stages[i].nworkers;
+    LIST_LOCK
+        for (int i=0; i<NTHREADS; i++)
+            if (threadlist[i].busy == 0)
+                nfree++;
+    LIST_UNLOCK
+    if (nworkers > nfree)
+        stl_error("pipeline_start: <%s> needs %d threads, %d free, increase NTHREADS (currently %d)",
+                pp->name, nworkers, nfree, NTHREADS);
+
+    pp->running = 1;
+    pp->start_ns = pipeline_now();
+    for (int i=0; i<pp->nstages; i++) {
+        stage *sp = &pp->stages[i];
+
+        for (int w=0; w<sp->nworkers; w++) {
+            if (pthread_create(&sp->workers[w], NULL, pipeline_worker, sp))
+                stl_error("pipeline_start: <%s> worker create failed", sp->name);
+            COUNT(threads_created);
+        }
+    }
+    STL_DEBUG("pipeline <%s> started", pp->name);
+}
+
+void
+stl_pipeline_stop(int32_t slot)
+{
+    // stop all workers once their current item is finished, queued items are discarded
+    pipeline *pp = &pipelinelist[slot];
+
+    if (pp->busy == 0)
+        stl_error("pipeline_stop: pipeline %d not allocated", slot);
+
+    __atomic_store_n(&pp->running, 0, __ATOMIC_RELEASE);
+    for (int i=0; i<pp->nstages; i++)
+        if (pp->stages[i].out)
+            queue_wake(pp->stages[i].out);
+    for (int i=0; i<pp->nstages; i++)
+        for (int w=0; w<pp->stages[i].nworkers; w++)
+            pthread_join(pp->stages[i].workers[w], NULL);
+    // so that a restarted pipeline doesn't process stale items
+    for (int i=0; i<pp->nstages; i++)
+        if (pp->stages[i].out)
+            queue_flush(pp->stages[i].out);
+
+    STL_DEBUG("pipeline <%s> stopped", pp->name);
+}
+
+void
+stl_pipeline_stats(int32_t slot, double *stats)
+{
+    // for each stage: items, items per second, depth of its output queue, mean and max
+    // service time, and the fraction of time blocked on a full output queue.  stats is
+    // nstages x 6 in column-major order
+    pipeline *pp = &pipelinelist[slot];
+    double elapsed = (pipeline_now() - pp->start_ns) * 1e-9;
+    int n = pp->nstages;
+
+    if (pp->busy == 0)
+        stl_error("pipeline_stats: pipeline %d not allocated", slot);
+    if (pp->start_ns == 0) {
+        memset(stats, 0, 6 * n * sizeof(double));    // never started
+        return;
+    }
+
+    for (int i=0; i<n; i++) {
+        stage *sp = &pp->stages[i];
+        uint64_t items = __atomic_load_n(&sp->items, __ATOMIC_RELAXED);
+
+        stats[i] = items;
+        stats[i+n] = elapsed > 0 ? items / elapsed : 0;
+        stats[i+2*n] = sp->out ? __atomic_load_n(&sp->out->count, __ATOMIC_RELAXED) : 0;
+        stats[i+3*n] = items ? __atomic_load_n(&sp->busy_ns, __ATOMIC_RELAXED) * 1e-9 / items : 0;
+        stats[i+4*n] = __atomic_load_n(&sp->max_ns, __ATOMIC_RELAXED) * 1e-9;
+        stats[i+5*n] = elapsed > 0 ? __atomic_load_n(&sp->blocked_ns, __ATOMIC_RELAXED) * 1e-9 / elapsed / sp->nworkers : 0;
+    }
+}
+
+int32_t
+stl_pipeline_nstages(int32_t slot)
+{
+    return pipelinelist[slot].nstages;
+}
+
+//------------------- tasks
+//
+// Cooperative user-space tasks, each with its own small stack, run by a few worker
+// threads.  A task runs until it calls stl_sleep, stl_sem_wait or stl_task_yield, which
+// switch back to the worker's scheduler loop so it can run another task.  Each task stays
+// on the worker it was spawned on, so thread local state such as errno is never seen by
+// a task on another thread.  On x86_64 and aarch64 Linux the context switch is a few
+// instructions that save the callee-saved registers, elsewhere it uses ucontext.
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+    #define TASK_ASM
+#else
+    #include <ucontext.h>
+#endif
+
+enum { TASK_YIELD, TASK_SLEEP, TASK_WAIT, TASK_EXIT };   // why a task switched out
+
+typedef struct _task {
+    void *sp;           // saved stack pointer while switched out
+#ifndef TASK_ASM
+    ucontext_t uc;
+#endif
+    char *stack;
+    size_t stacksize;
+    void (*f)(void *);
+    void *arg;
+    struct _worker *worker;
+    struct _task *next; // run queue, free list or semaphore wait list
+    uint64_t wake;      // time to wake from sleep, ns
+} task;
+
+typedef struct _worker {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    void *sp;           // scheduler context while a task runs
+#ifndef TASK_ASM
+    ucontext_t uc;
+#endif
+    task *head;         // run queue
+    task *tail;
+    task **sleepers;    // min heap on wake time
+    int  nsleepers;
+    int  maxsleepers;
+    task *pool;         // finished tasks, with their stacks
+    int  after;         // why the current task switched out
+    int  waitslot;      // semaphore the current task waits for
+    uint64_t switches;  // statistics
+    uint64_t spawned;
+    int  live;
+} worker;
+
+static worker  taskworkers[NTASKWORKERS];
+static int     ntaskworkers;
+static size_t  task_stacksize = TASK_STACK;
+static int     task_next;   // round robin worker for new tasks
+static pthread_mutex_t task_wait_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+    char *name;
+    void *f;
+} taskfuncs[NTASKFUNCS];
+
+static __thread task   *task_current;
+static __thread worker *task_worker_self;
+
+#ifdef TASK_ASM
+// void stl_ctx_switch(void **save, void *restore)
+// push the callee-saved registers, save the stack pointer, switch to the other stack and
+// pop its registers, returning to wherever that context last switched out
+extern void stl_ctx_switch(void **save, void *restore);
+#if defined(__x86_64__)
+__asm__(
+    ".text\n"
+    ".globl stl_ctx_switch\n"
+    ".type stl_ctx_switch,@function\n"
+    "stl_ctx_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size stl_ctx_switch,.-stl_ctx_switch\n"
+);
+#define TASK_FRAME      (6*8)   // registers pushed by stl_ctx_switch
+#else
+__asm__(
+    ".text\n"
+    ".globl stl_ctx_switch\n"
+    ".type stl_ctx_switch,%function\n"
+    "stl_ctx_switch:\n"
+    "    sub sp, sp, #160\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mov x2, sp\n"
+    "    str x2, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    add sp, sp, #160\n"
+    "    ret\n"
+    ".size stl_ctx_switch,.-stl_ctx_switch\n"
+);
+#define TASK_FRAME      160     // registers saved by stl_ctx_switch
+#endif
+#endif
+
+// the thread locals are read through functions that can't be inlined, so a task that
+// is resumed never uses a thread local address computed before it switched out
+static task * __attribute__((noinline))
+task_self()
+{
+    return task_current;
+}
+
+static worker * __attribute__((noinline))
+task_worker()
+{
+    return task_worker_self;
+}
+
+static uint64_t
+task_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+task_switch_out(int after)
+{
+    // return to the scheduler loop of this task's worker
+    task   *tp = task_self();
+    worker *wp = tp->worker;
+
+    wp->after = after;
+#ifdef TASK_ASM
+    stl_ctx_switch(&tp->sp, wp->sp);
+#else
+    swapcontext(&tp->uc, &wp->uc);
+#endif
+}
+
+static void
+task_entry()
+{
+    // first code run on a new task's stack
+    task *tp = task_self();
+
+    tp->f(tp->arg);
+    task_switch_out(TASK_EXIT);
+}
+
+static void
+task_ready(task *tp)
+{
+    // append to the run queue of the task's worker, called with the worker unlocked
+    worker *wp = tp->worker;
+
+    pthread_mutex_lock(&wp->mutex);
+    tp->next = NULL;
+    if (wp->tail)
+        wp->tail->next = tp;
+    else
+        wp->head = tp;
+    wp->tail = tp;
+    pthread_cond_signal(&wp->cond);
+    pthread_mutex_unlock(&wp->mutex);
+}
+
+static void
+task_heap_push(worker *wp, task *tp)
+{
+    int i;
+
+    if (wp->nsleepers == wp->maxsleepers) {
+        wp->maxsleepers = wp->maxsleepers ? 2*wp->maxsleepers : 64;
+        wp->sleepers = (task **)realloc(wp->sleepers, wp->maxsleepers * sizeof(task *));
+    }
+    for (i = wp->nsleepers++; i > 0 && wp->sleepers[(i-1)/2]->wake > tp->wake; i = (i-1)/2)
+        wp->sleepers[i] = wp->sleepers[(i-1)/2];
+    wp->sleepers[i] = tp;
+}
+
+static task *
+task_heap_pop(worker *wp)
+{
+    task *top = wp->sleepers[0], *last = wp->sleepers[--wp->nsleepers];
+    int   i = 0, c;
+
+    while ((c = 2*i+1) < wp->nsleepers) {
+        if (c+1 < wp->nsleepers && wp->sleepers[c+1]->wake < wp->sleepers[c]->wake)
+            c++;
+        if (last->wake <= wp->sleepers[c]->wake)
+            break;
+        wp->sleepers[i] = wp->sleepers[c];
+        i = c;
+    }
+    wp->sleepers[i] = last;
+    return top;
+}
+
+static void
+task_sleep(double t)
+{
+    task *tp = task_self();
+
+    tp->wake = task_now() + (uint64_t)(t * 1e9);
+    task_switch_out(TASK_SLEEP);
+}
+
+static void
+task_sem_wait(int slot)
+{
+    // switch out until the semaphore is posted, the caller then tries to take it
+    task_worker()->waitslot = slot;
+    task_switch_out(TASK_WAIT);
+}
+
+static int
+task_unwait(int slot, task *tp)
+{
+    // remove a task from a semaphore's wait list and make it ready, false if it wasn't there
+    task **pp;
+
+    pthread_mutex_lock(&task_wait_mutex);
+    for (pp = &semlist[slot].waiters; *pp; pp = &(*pp)->next)
+        if (*pp == tp || tp == NULL) {
+            tp = *pp;
+            __atomic_store_n(pp, tp->next, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&task_wait_mutex);
+            task_ready(tp);
+            return 1;
+        }
+    pthread_mutex_unlock(&task_wait_mutex);
+    return 0;
+}
+
+static void
+task_sem_wake(int slot)
+{
+    task_unwait(slot, NULL);    // wake any one waiting task, it then tries to take the semaphore
+}
+
+static void *
+task_scheduler(void *arg)
+{
+    worker *wp = (worker *)arg;
+    char    name[16];
+
+    snprintf(name, sizeof(name), "TASK%d", (int)(wp - taskworkers));
+    stl_thread_add(name);
+    task_worker_self = wp;
+
+    pthread_mutex_lock(&wp->mutex);
+    for (;;) {
+        uint64_t now = task_now();
+        task *tp;
+
+        // wake the sleepers whose time has come
+        while (wp->nsleepers > 0 && wp->sleepers[0]->wake <= now) {
+            tp = task_heap_pop(wp);
+            tp->next = NULL;
+            if (wp->tail)
+                wp->tail->next = tp;
+            else
+                wp->head = tp;
+            wp->tail = tp;
+        }
+
+        if (wp->head == NULL) {
+            if (wp->nsleepers > 0) {
+                struct timespec ts;
+                uint64_t wake = wp->sleepers[0]->wake;
+
+                // the condvar uses CLOCK_REALTIME, convert the monotonic wake time
+                clock_gettime(CLOCK_REALTIME, &ts);
+                wake = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec + (wake - now);
+                ts.tv_sec = wake / 1000000000;
+                ts.tv_nsec = wake % 1000000000;
+                pthread_cond_timedwait(&wp->cond, &wp->mutex, &ts);
+            } else
+                pthread_cond_wait(&wp->cond, &wp->mutex);
+            continue;
+        }
+
+        tp = wp->head;
+        wp->head = tp->next;
+        if (wp->head == NULL)
+            wp->tail = NULL;
+        pthread_mutex_unlock(&wp->mutex);
+
+        // run the task until it switches out
+        task_current = tp;
+        wp->switches++;
+#ifdef TASK_ASM
+        stl_ctx_switch(&wp->sp, tp->sp);
+#else
+        swapcontext(&wp->uc, &tp->uc);
+#endif
+        task_current = NULL;
+
+        // now that we're off its stack, the task can be queued elsewhere
+        switch (wp->after) {
+            case TASK_WAIT:
+                // go on the wait list, then check if it was posted in the meantime
+                pthread_mutex_lock(&task_wait_mutex);
+                tp->next = semlist[wp->waitslot].waiters;
+                __atomic_store_n(&semlist[wp->waitslot].waiters, tp, __ATOMIC_SEQ_CST);
+                pthread_mutex_unlock(&task_wait_mutex);
+                {
+                    int value = 1;
+
+                    sem_getvalue(semlist[wp->waitslot].sem, &value);
+                    if (value > 0)
+                        task_unwait(wp->waitslot, tp);
+                }
+                break;
+        }
+
+        pthread_mutex_lock(&wp->mutex);
+        switch (wp->after) {
+            case TASK_YIELD:
+                tp->next = NULL;
+                if (wp->tail)
+                    wp->tail->next = tp;
+                else
+                    wp->head = tp;
+                wp->tail = tp;
+                break;
+            case TASK_SLEEP:
+                task_heap_push(wp, tp);
+                break;
+            case TASK_EXIT:
+                tp->next = wp->pool;
+                wp->pool = tp;
+                wp->live--;
+                break;
+        }
+    }
+    return NULL;
+}
+
+void
+stl_task_init(int32_t nworkers, int32_t stacksize)
+{
+    if (ntaskworkers > 0)
+        stl_error("task_init: already initialized");
+    if (nworkers < 1 || nworkers > NTASKWORKERS)
+        stl_error("task_init: %d workers, must be 1 to NTASKWORKERS (currently %d)", nworkers, NTASKWORKERS);
+    if (stacksize > 0)
+        task_stacksize = (stacksize + pagesize-1) & ~(pagesize-1);
+
+    for (int i=0; i<nworkers; i++) {
+        worker *wp = &taskworkers[i];
+
+        pthread_mutex_init(&wp->mutex, NULL);
+        pthread_cond_init(&wp->cond, NULL);
+        if (pthread_create(&wp->thread, NULL, task_scheduler, wp))
+            stl_error("task_init: worker create failed");
+        COUNT(threads_created);
+    }
+    ntaskworkers = nworkers;
+
+    STL_DEBUG("tasks: %d workers, %lu byte stacks", nworkers, (unsigned long)task_stacksize);
+}
+
+void
+stl_task_spawn(char *func, void *arg)
+{
+    worker *wp;
+    task   *tp;
+    void   *f = NULL;
+    int     i;
+
+    if (ntaskworkers == 0)
+        stl_error("task_spawn: call task_init first");
+
+    // look up the entry point, remembering it for next time
+    for (i=0; i<NTASKFUNCS && taskfuncs[i].name; i++)
+        if (strcmp(taskfuncs[i].name, func) == 0) {
+            f = taskfuncs[i].f;
+            break;
+        }
+    if (f == NULL) {
+        f = stl_get_functionptr(func);
+        if (f == NULL)
+            stl_error("task_spawn: MATLAB entrypoint named [%s] not found", func);
+        LIST_LOCK
+            for (i=0; i<NTASKFUNCS; i++)
+                if (taskfuncs[i].name == NULL) {
+                    taskfuncs[i].f = f;
+                    __atomic_store_n(&taskfuncs[i].name, stl_stralloc(func), __ATOMIC_RELEASE);
+                    break;
+                }
+        LIST_UNLOCK
+    }
+
+    // take a task from the worker's pool or make a new one
+    wp = &taskworkers[__atomic_fetch_add(&task_next, 1, __ATOMIC_RELAXED) % ntaskworkers];
+    pthread_mutex_lock(&wp->mutex);
+    tp = wp->pool;
+    if (tp)
+        wp->pool = tp->next;
+    wp->live++;
+    wp->spawned++;
+    pthread_mutex_unlock(&wp->mutex);
+
+    if (tp == NULL) {
+        tp = (task *)calloc(1, sizeof(task));
+        tp->stacksize = task_stacksize;
+        tp->stack = mmap(NULL, tp->stacksize + pagesize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (tp->stack == MAP_FAILED)
+            stl_error("task_spawn: couldn't allocate stack %s", strerror(errno));
+        mprotect(tp->stack, pagesize, PROT_NONE);   // guard page below the stack
+        tp->stack += pagesize;
+        tp->worker = wp;
+    }
+    tp->f = (void (*)(void *))f;
+    tp->arg = arg;
+
+    // set up the stack so the first switch to it starts task_entry
+#ifdef TASK_ASM
+    {
+        uintptr_t top = ((uintptr_t)tp->stack + tp->stacksize) & ~(uintptr_t)15;
+        void **sp;
+
+#if defined(__x86_64__)
+        sp = (void **)top;
+        *--sp = NULL;               // return address for task_entry, never used
+        *--sp = (void *)task_entry; // popped by the ret in stl_ctx_switch
+        sp = (void **)((char *)sp - TASK_FRAME);
+        memset(sp, 0, TASK_FRAME);
+#else
+        sp = (void **)(top - TASK_FRAME);
+        memset(sp, 0, TASK_FRAME);
+        sp[11] = (void *)task_entry;    // x30, the link register
+#endif
+        tp->sp = sp;
+    }
+#else
+    getcontext(&tp->uc);
+    tp->uc.uc_stack.ss_sp = tp->stack;
+    tp->uc.uc_stack.ss_size = tp->stacksize;
+    tp->uc.uc_link = NULL;
+    makecontext(&tp->uc, task_entry, 0);
+#endif
+
+    task_ready(tp);
+}
+
+void
+stl_task_yield()
+{
+    task *tp = task_self();
+
+    if (tp == NULL)
+        sched_yield();
+    else if (__atomic_load_n(&tp->worker->head, __ATOMIC_RELAXED))
+        task_switch_out(TASK_YIELD);    // only if another task is ready to run
+}
+
+int32_t
+stl_task_count()
+{
+    int32_t n = 0;
+
+    for (int i=0; i<ntaskworkers; i++)
+        n += __atomic_load_n(&taskworkers[i].live, __ATOMIC_RELAXED);
+    return n;
+}
+
+//------------------- profiler
+//
+// Each thread has a timer on its own CPU time clock which sends it SIGPROF, so a thread
+// is only sampled while it is running.  The signal handler appends the stack to a buffer
+// belonging to the thread, it is the only writer so no lock is needed, and publishes the
+// sample by advancing the count.  Samples are symbolized when the profile is written, as
+// folded stacks for flamegraph.pl.  Symbols come from dladdr, which finds MATLAB entry
+// points and other global functions when the binary is linked with -rdynamic.
+
+#if defined(__linux__) && defined(__GLIBC__)
+#ifndef sigev_notify_thread_id
+    #define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+typedef struct _profbuf {
+    char     *name;         // name of the sampled thread
+    uint32_t  count;        // samples written, updated atomically
+    uint32_t  dropped;      // samples lost because the buffer was full
+    uint8_t   depth[PROFILE_SAMPLES];
+    void     *pc[PROFILE_SAMPLES][PROFILE_DEPTH];   // innermost frame first
+} profbuf;
+
+static profbuf *proflist[NPROFBUFS];
+static int      nprofbufs;
+static double   profile_hz;     // sample rate, zero when not profiling
+
+static void
+profile_handler(int sig, siginfo_t *info, void *context)
+{
+    // runs on the sampled thread, must be async-signal-safe
+    profbuf *pb = (profbuf *)info->si_value.sival_ptr;
+    void    *frames[PROFILE_DEPTH+2];
+    int      saved = errno, n;
+    uint32_t i;
+
+    if (info->si_code != SI_TIMER || pb == NULL)
+        return;
+    i = __atomic_load_n(&pb->count, __ATOMIC_RELAXED);
+    if (i >= PROFILE_SAMPLES) {
+        pb->dropped++;
+        return;
+    }
+    // skip the frames of this handler and the signal trampoline
+    n = backtrace(frames, PROFILE_DEPTH+2) - 2;
+    if (n > 0) {
+        memcpy(pb->pc[i], frames+2, n * sizeof(void *));
+        pb->depth[i] = n;
+        __atomic_store_n(&pb->count, i+1, __ATOMIC_RELEASE);
+    }
+    errno = saved;
+}
+
+static void
+profile_arm(thread *tp)
+{
+    // start sampling a thread, which must be running
+    struct sigevent sev;
+    struct itimerspec its;
+    profbuf *pb;
+    double  period;
+
+    if (profile_hz == 0 || tp->tid == 0)
+        return;
+    // the thread itself and stl_profile_start may both try, only one wins
+    LIST_LOCK
+        if (profile_hz == 0 || tp->prof)
+            ;
+        else if (nprofbufs == NPROFBUFS)
+            stl_log("profile: thread <%s> not sampled, increase NPROFBUFS (currently %d)", tp->name, NPROFBUFS);
+        else {
+            if (proflist[nprofbufs] == NULL)
+                proflist[nprofbufs] = (profbuf *)calloc(1, sizeof(profbuf));
+            pb = proflist[nprofbufs];
+            free(pb->name);
+            pb->name = stl_stralloc(tp->name);  // outlives the thread's slot
+            pb->count = 0;
+            pb->dropped = 0;
+
+            memset(&sev, 0, sizeof(sev));
+            sev.sigev_notify = SIGEV_THREAD_ID;
+            sev.sigev_signo = SIGPROF;
+            sev.sigev_value.sival_ptr = pb;
+            sev.sigev_notify_thread_id = tp->tid;
+            if (timer_create(tp->cpuclock, &sev, &tp->proftimer) < 0)
+                stl_log("profile: timer create for <%s> failed %s", tp->name, strerror(errno));
+            else {
+                nprofbufs++;
+                tp->prof = pb;
+                period = 1.0 / profile_hz;
+                its.it_value.tv_sec = its.it_interval.tv_sec = (time_t) period;
+                its.it_value.tv_nsec = its.it_interval.tv_nsec = (period - (time_t) period) * 1e9;
+                timer_settime(tp->proftimer, 0, &its, NULL);
+            }
+        }
+    LIST_UNLOCK
+}
+
+static void
+profile_disarm(thread *tp)
+{
+    // stop sampling a thread, its samples are kept
+    LIST_LOCK
+        if (tp->prof) {
+            timer_delete(tp->proftimer);
+            tp->prof = NULL;
+        }
+    LIST_UNLOCK
+}
+
+void
+stl_profile_start(double hz)
+{
+    struct sigaction sa;
+    void   *frames[1];
+
+    if (profile_hz > 0)
+        stl_profile_stop();
+    if (hz <= 0)
+        hz = PROFILE_HZ;
+
+    // the first call to backtrace loads the unwinder, which is not safe in a signal handler
+    backtrace(frames, 1);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = profile_handler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, NULL) < 0)
+        stl_error("profile_start: sigaction failed %s", strerror(errno));
+
+    // buffers are reused from the previous profile
+    nprofbufs = 0;
+    profile_hz = hz;
+    for (int i=0; i<NTHREADS; i++)
+        if (threadlist[i].busy)
+            profile_arm(&threadlist[i]);
+    STL_DEBUG("profile: sampling %d threads at %g Hz", nprofbufs, hz);
+}
+
+void
+stl_profile_stop()
+{
+    profile_hz = 0;
+    for (int i=0; i<NTHREADS; i++)
+        profile_disarm(&threadlist[i]);
+}
+
+// symbol of an address, cached since most samples share a few functions
+typedef struct {
+    void *pc;
+    char *name;
+    int   exported;     // name is a symbol, not an address
+} profsym;
+
+static profsym *
+profile_symbol(profsym *cache, int ncache, void *pc)
+{
+    profsym *sp = &cache[((uintptr_t)pc >> 2) & (ncache-1)];
+    Dl_info info;
+    char     buf[256];
+
+    if (sp->name && sp->pc == pc)
+        return sp;
+    sp->exported = 0;
+    if (dladdr(pc, &info) == 0)
+        snprintf(buf, sizeof(buf), "%p", pc);
+    else if (info.dli_sname) {
+        snprintf(buf, sizeof(buf), "%s", info.dli_sname);
+        sp->exported = 1;
+    } else {
+        // not exported, give the object and offset for addr2line
+        const char *base = strrchr(info.dli_fname, '/');
+
+        snprintf(buf, sizeof(buf), "%s+0x%lx", base ? base+1 : info.dli_fname,
+                (unsigned long)((char *)pc - (char *)info.dli_fbase));
+    }
+    free(sp->name);
+    sp->pc = pc;
+    sp->name = stl_stralloc(buf);
+    return sp;
+}
+
+// a distinct stack and the number of times it was sampled
+typedef struct {
+    char    *stack;
+    uint32_t count;
+} profstack;
+
+void
+stl_profile_write(FILE *fp)
+{
+    // write samples as folded stacks: thread;outer;...;inner count
+    int        ncache = 4096, nstacks = 1, total = 0;
+    profsym   *cache = (profsym *)calloc(ncache, sizeof(profsym));
+    profstack *stacks;
+    char      *line;
+    size_t     len;
+
+    for (int b=0; b<nprofbufs; b++)
+        total += __atomic_load_n(&proflist[b]->count, __ATOMIC_ACQUIRE);
+    while (nstacks < 2*total)
+        nstacks *= 2;
+    stacks = (profstack *)calloc(nstacks, sizeof(profstack));
+
+    for (int b=0; b<nprofbufs; b++) {
+        profbuf *pb = proflist[b];
+        uint32_t n = __atomic_load_n(&pb->count, __ATOMIC_ACQUIRE);
+
+        for (uint32_t i=0; i<n; i++) {
+            FILE    *sfp = open_memstream(&line, &len);
+            uint32_t h = 5381;
+            int      k, outer;
+
+            fputs(pb->name, sfp);
+            for (k=pb->depth[i]-1, outer=1; k>=0; k--) {
+                // return addresses point after the call, back up into it
+                profsym *sp = profile_symbol(cache, ncache, (char *)pb->pc[i][k] - (k > 0));
+
+                // drop the thread start up frames, clone and stl_thread_wrapper, which are not exported
+                if (outer && !sp->exported && k > 0)
+                    continue;
+                outer = 0;
+                fprintf(sfp, ";%s", sp->name);
+            }
+            fclose(sfp);
+
+            // count identical stacks
+            for (char *c=line; *c; c++)
+                h = h * 33 + *c;
+            for (k=h & (nstacks-1); stacks[k].stack && strcmp(stacks[k].stack, line); k=(k+1) & (nstacks-1))
+                ;
+            if (stacks[k].stack)
+                free(line);
+            else
+                stacks[k].stack = line;
+            stacks[k].count++;
+        }
+        if (pb->dropped)
+            stl_log("profile: <%s> dropped %u samples, increase PROFILE_SAMPLES (currently %d)",
+                    pb->name, pb->dropped, PROFILE_SAMPLES);
+    }
+
+    for (int k=0; k<nstacks; k++)
+        if (stacks[k].stack) {
+            fprintf(fp, "%s %u\n", stacks[k].stack, stacks[k].count);
+            free(stacks[k].stack);
+        }
+    for (int k=0; k<ncache; k++)
+        free(cache[k].name);
+    free(cache);
+    free(stacks);
+}
+
+#else
+static void profile_arm(thread *tp) {}
+static void profile_disarm(thread *tp) {}
+
+void
+stl_profile_start(double hz)
+{
+    stl_error("profile_start: only supported on Linux with glibc");
+}
+
+void
+stl_profile_stop()
+{
+}
+
+void
+stl_profile_write(FILE *fp)
+{
+}
+#endif
+
+void
+stl_profile_dump(char *filename)
+{
+    FILE *fp = fopen(filename, "w");
+
+    if (fp == NULL)
+        stl_error("profile_dump: couldn't open %s %s", filename, strerror(errno));
+    stl_profile_write(fp);
+    fclose(fp);
+}
+
+static char *
+metrics_label(char *buf, const char *s)
+{
+    // label value with Prometheus escapes, buf must hold 2*strlen(s)+1 chars
+    char *p = buf;
+
+    for (; *s; s++) {
+        if (*s == '\n') {
+            *p++ = '\\';
+            *p++ = 'n';
+            continue;
+        }
+        if (*s == '"' || *s == '\\')
+            *p++ = '\\';
+        *p++ = *s;
+    }
+    *p = 0;
+    return buf;
+}
+#define LABEL(s)    metrics_label((char *)alloca(2*strlen(s)+1), (s))
+
+void
+stl_metrics(FILE *fp)
+{
+    // write thread library counters in Prometheus text format
+    int i, active = 0;
+
+    for (i=0; i<NTHREADS; i++)
+        if (threadlist[i].busy)
+            active++;
+    fprintf(fp, "# TYPE stl_threads_active gauge\nstl_threads_active %d\n", active);
+    fprintf(fp, "# TYPE stl_threads_created_total counter\nstl_threads_created_total %llu\n",
+            (unsigned long long)threads_created);
+#ifdef __linux__
+    {
+        static const char *names[] = {"cpu_seconds_total", "voluntary_switches_total",
+                "involuntary_switches_total", "minor_faults_total", "major_faults_total"};
+        double stats[NTHREADS][TS_N];
+
+        for (i=0; i<NTHREADS; i++)
+            if (threadlist[i].busy)
+                stl_thread_getstats(&threadlist[i], stats[i]);
+        for (int k=TS_CPU; k<=TS_MAJFLT; k++) {
+            fprintf(fp, "# TYPE stl_thread_%s counter\n", names[k]);
+            for (i=0; i<NTHREADS; i++)
+                if (threadlist[i].busy)
+                    fprintf(fp, "stl_thread_%s{thread=\"%s\",id=\"%d\"} %.9g\n", names[k],
+                            LABEL(threadlist[i].name), i, stats[i][k]);
+        }
+    }
+#endif
+
+    fprintf(fp, "# TYPE stl_mutex_locks_total counter\n");
+    for (i=0; i<NMUTEXS; i++)
+        if (mutexlist[i].busy)
+            fprintf(fp, "stl_mutex_locks_total{name=\"%s\"} %llu\n", LABEL(mutexlist[i].name),
+                    (unsigned long long)mutexlist[i].locks);
+    fprintf(fp, "# TYPE stl_mutex_contended_total counter\n");
+    for (i=0; i<NMUTEXS; i++)
+        if (mutexlist[i].busy)
+            fprintf(fp, "stl_mutex_contended_total{name=\"%s\"} %llu\n", LABEL(mutexlist[i].name),
+                    (unsigned long long)mutexlist[i].contended);
+
+    fprintf(fp, "# TYPE stl_semaphore_posts_total counter\n");
+    for (i=0; i<NSEMAPHORES; i++)
+        if (semlist[i].busy)
+            fprintf(fp, "stl_semaphore_posts_total{name=\"%s\"} %llu\n", LABEL(semlist[i].name),
+                    (unsigned long long)semlist[i].posts);
+    fprintf(fp, "# TYPE stl_semaphore_waits_total counter\n");
+    for (i=0; i<NSEMAPHORES; i++)
+        if (semlist[i].busy)
+            fprintf(fp, "stl_semaphore_waits_total{name=\"%s\"} %llu\n", LABEL(semlist[i].name),
+                    (unsigned long long)semlist[i].waits);
+
+    fprintf(fp, "# TYPE stl_latest_writes_total counter\n");
+    for (i=0; i<NLATEST; i++)
+        if (latestlist[i].busy)
+            fprintf(fp, "stl_latest_writes_total{name=\"%s\"} %llu\n", LABEL(latestlist[i].name),
+                    (unsigned long long)latestlist[i].seq);
+    fprintf(fp, "# TYPE stl_latest_retries_total counter\n");
+    for (i=0; i<NLATEST; i++)
+        if (latestlist[i].busy)
+            fprintf(fp, "stl_latest_retries_total{name=\"%s\"} %llu\n", LABEL(latestlist[i].name),
+                    (unsigned long long)latestlist[i].retries);
+
+    fprintf(fp, "# TYPE stl_pipeline_items_total counter\n");
+    for (i=0; i<NPIPELINES; i++)
+        for (int j=0; pipelinelist[i].busy && j<pipelinelist[i].nstages; j++)
+            fprintf(fp, "stl_pipeline_items_total{pipeline=\"%s\",stage=\"%s\"} %llu\n", LABEL(pipelinelist[i].name),
+                    LABEL(pipelinelist[i].stages[j].name), (unsigned long long)pipelinelist[i].stages[j].items);
+    fprintf(fp, "# TYPE stl_pipeline_service_seconds_total counter\n");
+    for (i=0; i<NPIPELINES; i++)
+        for (int j=0; pipelinelist[i].busy && j<pipelinelist[i].nstages; j++)
+            fprintf(fp, "stl_pipeline_service_seconds_total{pipeline=\"%s\",stage=\"%s\"} %g\n", LABEL(pipelinelist[i].name),
+                    LABEL(pipelinelist[i].stages[j].name), pipelinelist[i].stages[j].busy_ns * 1e-9);
+    fprintf(fp, "# TYPE stl_pipeline_queue_depth gauge\n");
+    for (i=0; i<NPIPELINES; i++)
+        for (int j=0; pipelinelist[i].busy && j<pipelinelist[i].nstages; j++)
+            if (pipelinelist[i].stages[j].out)
+                fprintf(fp, "stl_pipeline_queue_depth{pipeline=\"%s\",stage=\"%s\"} %d\n", LABEL(pipelinelist[i].name),
+                        LABEL(pipelinelist[i].stages[j].name), __atomic_load_n(&pipelinelist[i].stages[j].out->count, __ATOMIC_RELAXED));
+
+    fprintf(fp, "# TYPE stl_tasks_live gauge\nstl_tasks_live %d\n", stl_task_count());
+    fprintf(fp, "# TYPE stl_tasks_spawned_total counter\n");
+    for (i=0; i<ntaskworkers; i++)
+        fprintf(fp, "stl_tasks_spawned_total{worker=\"%d\"} %llu\n", i, (unsigned long long)taskworkers[i].spawned);
+    fprintf(fp, "# TYPE stl_task_switches_total counter\n");
+    for (i=0; i<ntaskworkers; i++)
+        fprintf(fp, "stl_task_switches_total{worker=\"%d\"} %llu\n", i, (unsigned long long)taskworkers[i].switches);
+
+    fprintf(fp, "# TYPE stl_record_records_total counter\n");
+    for (i=0; i<NRECORDERS; i++)
+        if (recordlist[i].busy)
+            fprintf(fp, "stl_record_records_total{name=\"%s\"} %llu\n", LABEL(recordlist[i].name),
+                    (unsigned long long)recordlist[i].records);
+    fprintf(fp, "# TYPE stl_record_dropped_total counter\n");
+    for (i=0; i<NRECORDERS; i++)
+        if (recordlist[i].busy)
+            fprintf(fp, "stl_record_dropped_total{name=\"%s\"} %llu\n", LABEL(recordlist[i].name),
+                    (unsigned long long)recordlist[i].dropped);
+
+#ifdef __linux__
+    fprintf(fp, "# TYPE stl_watch_events_total counter\n");
+    for (i=0; i<NWATCHES; i++)
+        if (watchlist[i].busy)
+            fprintf(fp, "stl_watch_events_total{name=\"%s\",fd=\"%d\"} %llu\n", LABEL(watchlist[i].name),
+                    watchlist[i].fd, (unsigned long long)watchlist[i].events);
+
+    fprintf(fp, "# TYPE stl_udp_packets_total counter\n");
+    for (i=0; i<NUDPSOCKETS; i++)
+        if (udplist[i].busy)
+            fprintf(fp, "stl_udp_packets_total{port=\"%d\"} %llu\n", udplist[i].port,
+                    (unsigned long long)udplist[i].packets);
+    fprintf(fp, "# TYPE stl_udp_batches_total counter\n");
+    for (i=0; i<NUDPSOCKETS; i++)
+        if (udplist[i].busy)
+            fprintf(fp, "stl_udp_batches_total{port=\"%d\"} %llu\n", udplist[i].port,
+                    (unsigned long long)udplist[i].batches);
+#endif
+}
+
+char *
+stl_stralloc(char *s)
+{
+    char    *n = (char *)malloc(strlen(s)+1);
+    strcpy(n, s);
+    return n;
+}
+
+void stl_error(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+
+    fprintf(stderr, "stl-error:: ");
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+
+    va_end(ap);
+
+#ifdef __APPLE__
+     void* callstack[128];
+     int i, frames = backtrace(callstack, 128);
+     char** strs = backtrace_symbols(callstack, frames);
+     for (i = 0; i < frames; ++i) {
+         printf("%s\n", strs[i]);
+     }
+     free(strs);
+#endif
+
+    exit(1);
+}
+
+void 
+stl_log(const char *fmt, ...)
+{
+#define LOGLEN  128
+    char    buf[LOGLEN+1]; // make room for the final newline
+    struct timespec tp;
+    struct tm t;
+    int len = 0;
+
+    // put date/time into buffer
+    clock_gettime(CLOCK_REALTIME, &tp);
+    localtime_r(&tp.tv_sec, &t);
+    
+    len = strftime(buf, LOGLEN-len, "%F %T", &t);  // date + time
+    len += snprintf(buf+len, LOGLEN-len, ".%06ld", tp.tv_nsec / 1000); // fractional part
+
+    // append the thread name
+    len += snprintf(buf+len, LOGLEN-len, " [%s] ", stl_thread_name(-1));
+
+    // apppend the print string
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf+len, LOGLEN-len, fmt, ap);
+    va_end(ap);
+    
+    buf[LOGLEN-1] = 0;  // for safety with long strings
+
+    // append a new line
+    strcat(buf, "\n");
+    
+    // send it to stderr atomically
+    fputs(buf, stderr);
+    fflush(stderr);
+}
+
+void *
+stl_get_functionptr(char *name)
+{
+#ifdef __linux__
+    // dlsym() only finds the symbol if the executable was linked with -rdynamic
+    void *f = dlsym(RTLD_DEFAULT, name);
+    if (f)
+        return f;
+
+    // this is ugly, but otherwise fall back to looking in the symbol table
+    // the address is only correct if the executable is not position independent
+    FILE *fp;
+    char cmd[4096];
+
+    snprintf(cmd, 4096, "nm %s | grep ' %s$'", stl_cmdline_argv[0], name);
+    fp = popen(cmd, "r");
+    if (fscanf(fp, "%p", &f) != 1)
+        f = NULL;
+    pclose(fp);
+    STL_DEBUG("function <%s> at %p", name, f);
 
     return  f;
 #else
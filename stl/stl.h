@@ -6,14 +6,28 @@
 #ifndef __stl_h__
 #define __stl_h__
 
+#include <stdio.h>
+#include <stdint.h>
+
+// real-time options for stl_initialize
+typedef struct {
+    int32_t lock;           // lock all current and future memory into RAM
+    int32_t heap_reserve;   // bytes of heap to fault in and keep, 0 for none
+    int32_t stack_size;     // stack size of created threads, all faulted in, 0 for default
+} stl_rtopts;
+
 // function signatures
-void stl_initialize(int argc, char **argv);
+void stl_initialize(int argc, char **argv, stl_rtopts *rt);
+void stl_rt_initialize(stl_rtopts *rt);
+void stl_rt_mark();
+int32_t stl_rt_report();
 void stl_log(const char *fmt, ...);   //__attribute__ ((format (printf, 1, 2)));
 void stl_error(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
 void stl_debug(int32_t debug);
 void *stl_get_functionptr(char *name);
 char *stl_stralloc(char *s);
 void stl_require(void *v);
+void stl_metrics(FILE *fp);
 
 // sleep
 void stl_sleep(double t);
@@ -25,6 +39,8 @@ void stl_thread_cancel(int32_t slot);
 int32_t stl_thread_self();
 char *  stl_thread_name(int32_t id);
 int stl_thread_add(char *name);
+void stl_thread_stats(int32_t slot, double *stats);
+void stl_thread_report();
 
 // command line arguments
 int32_t stl_argc();
@@ -38,9 +54,97 @@ int stl_sem_wait_noblock(int32_t slot);
 
 
 // mutexes
-int32_t stl_mutex_create(char *name);
+int32_t stl_mutex_create(char *name, int32_t type, int32_t ceiling);
 int32_t stl_mutex_lock(int32_t slot);
 int32_t stl_mutex_lock_noblock(int32_t slot);
 void stl_mutex_unlock(int32_t slot);
 
+// atomics, inline so that generated code pays no function call
+// memory orders, must match stl.atomic_* in stl.m
+#define STL_RELAXED     __ATOMIC_RELAXED
+#define STL_ACQUIRE     __ATOMIC_ACQUIRE
+#define STL_RELEASE     __ATOMIC_RELEASE
+#define STL_ACQ_REL     __ATOMIC_ACQ_REL
+#define STL_SEQ_CST     __ATOMIC_SEQ_CST
+
+// a failed compare and swap only loads, so can't have release semantics
+#define STL_CAS_FAIL(order) ((order) == STL_RELEASE ? STL_RELAXED : (order) == STL_ACQ_REL ? STL_ACQUIRE : (order))
+
+#define STL_ATOMIC_INT(name, type) \
+static inline type stl_atomic_load_##name(const type *p, int order) \
+    { return __atomic_load_n(p, order); } \
+static inline void stl_atomic_store_##name(type *p, type v, int order) \
+    { __atomic_store_n(p, v, order); } \
+static inline type stl_atomic_add_##name(type *p, type v, int order) \
+    { return __atomic_fetch_add(p, v, order); } \
+static inline int32_t stl_atomic_cas_##name(type *p, type *expected, type desired, int order) \
+    { return __atomic_compare_exchange_n(p, expected, desired, 0, order, STL_CAS_FAIL(order)); }
+
+STL_ATOMIC_INT(int32, int32_t)
+STL_ATOMIC_INT(int64, int64_t)
+
+// there is no fetch and add for floating point, it is a compare and swap loop
+static inline double stl_atomic_load_double(const double *p, int order)
+    { double v; __atomic_load(p, &v, order); return v; }
+static inline void stl_atomic_store_double(double *p, double v, int order)
+    { __atomic_store(p, &v, order); }
+static inline int32_t stl_atomic_cas_double(double *p, double *expected, double desired, int order)
+    { return __atomic_compare_exchange(p, expected, &desired, 0, order, STL_CAS_FAIL(order)); }
+static inline double stl_atomic_add_double(double *p, double v, int order)
+{
+    double old, sum;
+
+    __atomic_load(p, &old, __ATOMIC_RELAXED);
+    do
+        sum = old + v;
+    while (!__atomic_compare_exchange(p, &old, &sum, 1, order, STL_CAS_FAIL(order)));
+    return old;
+}
+
+// sampling profiler
+void stl_profile_start(double hz);
+void stl_profile_stop();
+void stl_profile_write(FILE *fp);
+void stl_profile_dump(char *filename);
+
+// latest value
+int32_t stl_latest_create(char *name, void *initial, int32_t size, int32_t nbuf);
+void stl_latest_write(int32_t slot, void *value, int32_t size);
+uint64_t stl_latest_read(int32_t slot, void *value, int32_t size);
+uint64_t stl_latest_seq(int32_t slot);
+
+// binary recorder
+int32_t stl_record_open(char *filename, char *schema, int32_t datasize, double segsize, int32_t nkeep);
+void stl_record(int32_t slot, void *data, int32_t size);
+void stl_record_close(int32_t slot);
+
+// tasks
+void stl_task_init(int32_t nworkers, int32_t stacksize);
+void stl_task_spawn(char *func, void *arg);
+void stl_task_yield();
+int32_t stl_task_count();
+
+// pipeline
+int32_t stl_pipeline_create(char *name);
+int32_t stl_pipeline_stage(int32_t slot, char *func, int32_t insize, int32_t outsize, int32_t nworkers, int32_t depth);
+void stl_pipeline_start(int32_t slot);
+void stl_pipeline_stop(int32_t slot);
+void stl_pipeline_stats(int32_t slot, double *stats);
+int32_t stl_pipeline_nstages(int32_t slot);
+
+// reactor
+int32_t stl_watch_fd(int32_t fd, int32_t events, char *func, void *arg);
+int32_t stl_watch_path(char *path, int32_t events, char *func, void *arg);
+void stl_unwatch(int32_t slot);
+int32_t stl_watch_read(int32_t slot, void *buf, int32_t len);
+int32_t stl_watch_write(int32_t slot, void *buf, int32_t len);
+
+// batched UDP
+int32_t stl_udp_open(int32_t port, int32_t maxpkts);
+int32_t stl_udp_recv_batch(int32_t slot, uint8_t *data, int32_t pktsize, int32_t maxpkts,
+        int32_t *lens, double *times, uint32_t *srcaddr, int32_t *srcport, double timeout);
+int32_t stl_udp_send_batch(int32_t slot, uint8_t *data, int32_t pktsize, int32_t npkts,
+        int32_t *lens, char *host, int32_t port);
+void stl_udp_close(int32_t slot);
+
 #endif
\ No newline at end of file
@@ -10,6 +10,17 @@ classdef stl < handle %#codegen
 %  join              wait for a thread to terminate
 %  sleep             pause a thread
 %  self              get thread id
+%  thread_stats      CPU time, context switches and page faults of a thread
+%  thread_report     log the statistics of every thread
+%  profile_start     start the sampling profiler
+%  profile_stop      stop the sampling profiler
+%  profile_dump      write profile samples for a flame graph
+%
+% Tasks::
+%  task_init         start the task worker threads
+%  task              start a lightweight task
+%  yield             let another task run
+%  task_count        number of running tasks
 %
 % Mutexes:
 %  mutex             create a mutex
@@ -17,6 +28,12 @@ classdef stl < handle %#codegen
 %  mutex_try         test a mutex
 %  mutex_unlock      unlock a mutex
 %
+% Atomics::
+%  atomic_load       read a shared field
+%  atomic_store      write a shared field
+%  atomic_add        add to a shared field
+%  atomic_cas        compare and swap a shared field
+%
 % Semaphores::
 %  semaphore         create a semaphore
 %  semaphore_post    post a semaphore
@@ -24,12 +41,44 @@ classdef stl < handle %#codegen
 %  semaphore_try     test a semaphore
 %  timer             periodically post a semaphore
 %
+% Latest value::
+%  latest            create a latest value shared between threads
+%  latest_write      publish a new value
+%  latest_read       get the newest value
+%  latest_seq        get the sequence number of the newest value
+%
+% Pipelines::
+%  pipeline          create a pipeline
+%  pipeline_stage    add a stage to a pipeline
+%  pipeline_start    start the pipeline's worker threads
+%  pipeline_stop     stop the pipeline
+%  pipeline_stats    throughput, queue depth and service time of each stage
+%
+% Recording::
+%  record_open       open a binary recording file
+%  record            write a record
+%  record_close      close a recording
+%
+% Reactor::
+%  watch             call an entry point when a file descriptor is ready
+%  unwatch           stop watching a file descriptor
+%  watch_read        read from a watched file descriptor
+%  watch_write       write to a watched file descriptor
+%
+% UDP::
+%  udp_open          open a UDP socket for batched I/O
+%  udp_recv_batch    receive a batch of packets
+%  udp_send_batch    send a batch of packets
+%  udp_close         close a UDP socket
+%
 % Miscellaneous::
 %  log               send a message to log stream
 %  argc              get number of command line arguments
 %  argv              get a command line argument
 %  copy              copy a variable to thwart optimization
 %  debug             enable debugging messages
+%  rt_mark           note page fault counts after warm-up
+%  rt_report         report page faults since rt_mark
 %
 % Copyright (C) 2018, by Peter I. Corke
 
@@ -96,6 +145,38 @@ classdef stl < handle %#codegen
             coder.ceval('stl_require', coder.ref(v2));
         end
 
+    % real-time mode
+        function rt_mark()
+        %stl.rt_mark Note page fault counts after warm-up
+        %
+        % stl.rt_mark() records the page fault count of every thread.  Call it once the
+        % control loops have run a few cycles, then stl.rt_report shows whether the steady
+        % state causes any page faults.
+        %
+        % Notes::
+        % - Real-time mode is enabled by compiling main.c with -DSTL_RT, which locks memory
+        %   with mlockall, faults in a heap reserve (STL_RT_HEAP bytes) and makes every thread
+        %   created by stl.launch fault in its stack (STL_RT_STACK bytes) before it runs.
+        % - Page fault counts are only available on Linux.
+        %
+        % See also: stl.rt_report.
+            coder.cinclude('stl.h');
+            coder.ceval('stl_rt_mark');
+        end
+
+        function n = rt_report()
+        %stl.rt_report Report page faults since warm-up
+        %
+        % n = stl.rt_report() logs the number of minor and major page faults of each thread
+        % since stl.rt_mark was called, and returns the total.
+        %
+        % See also: stl.rt_mark.
+            coder.cinclude('stl.h');
+
+            n = int32(0);
+            n = coder.ceval('stl_rt_report');
+        end
+
     % thread
         function tid = launch(name, arg, stackdata)
         %stl.launch Create a new thread
@@ -161,6 +242,7 @@ classdef stl < handle %#codegen
         % Notes::
         % - D does not have to be integer.
         % - Precision ultimately depends on the system clock.
+        % - Within a task only the task is paused, other tasks continue to run.
         %
         % See also: stl.timer.
             coder.cinclude('stl.h');
@@ -179,21 +261,246 @@ classdef stl < handle %#codegen
             id = coder.ceval('stl_thread_self'); % evaluate the C function
         end
 
+        function s = thread_stats(id)
+        %stl.thread_stats Get thread statistics
+        %
+        % s = stl.thread_stats(tid) is a struct describing the resources used by the specified
+        % thread, with fields:
+        %   cpu        CPU time used (s)
+        %   wall       time since the thread was created (s)
+        %   vcsw       voluntary context switches, the thread blocked or slept
+        %   ivcsw      involuntary context switches, the thread was preempted
+        %   minflt     minor page faults
+        %   majflt     major page faults, which needed disk I/O
+        %   lastcpu    the CPU the thread last ran on, -1 if unknown
+        %
+        % s = stl.thread_stats() as above for the calling thread.
+        %
+        % Notes::
+        % - Sample periodically and difference the values to find which thread is using a core,
+        %   cpu/wall close to 1, or being preempted, ivcsw increasing.
+        % - The calling thread's statistics come from the kernel directly, those of other
+        %   threads are read from /proc which takes a few microseconds.
+        % - Only cpu and wall are available on platforms other than Linux.
+        %
+        % See also: stl.thread_report, stl.launch, stl.self.
+            coder.cinclude('stl.h');
+
+            if nargin < 1
+                id = int32(-1);
+            end
+            % must match the TS_ enum in stl.c
+            v = zeros(1, 7);
+            coder.ceval('stl_thread_stats', int32(id), coder.wref(v));
+            s.cpu = v(1);
+            s.wall = v(7);
+            s.vcsw = v(2);
+            s.ivcsw = v(3);
+            s.minflt = v(4);
+            s.majflt = v(5);
+            s.lastcpu = v(6);
+        end
+
+        function thread_report()
+        %stl.thread_report Log statistics of every thread
+        %
+        % stl.thread_report() sends to the log a line for every thread, showing its CPU and wall
+        % time, context switches, page faults and the CPU it last ran on.
+        %
+        % See also: stl.thread_stats, stl.log.
+            coder.cinclude('stl.h');
+            coder.ceval('stl_thread_report');
+        end
+
+        function profile_start(hz)
+        %stl.profile_start Start the sampling profiler
+        %
+        % stl.profile_start() samples the call stack of every thread 99 times for each second of
+        % CPU time it uses.  This includes threads created later, and the web server thread.
+        %
+        % stl.profile_start(hz) as above but samples at hz per CPU second.
+        %
+        % Notes::
+        % - A thread is only sampled while it is running, so idle threads cost nothing.
+        % - Samples from a previous profile are discarded.
+        % - Sampling is limited to the kernel tick rate, typically 250 or 1000Hz.
+        % - Each thread keeps at most 4096 samples, about 40s of CPU time at 99Hz, later
+        %   samples are dropped.  To keep more increase PROFILE_SAMPLES in stl.c and recompile.
+        % - Linux with glibc only.
+        %
+        % See also: stl.profile_dump, stl.profile_stop.
+            coder.cinclude('stl.h');
+
+            if nargin < 1
+                hz = 0;
+            end
+            coder.ceval('stl_profile_start', double(hz));
+        end
+
+        function profile_stop()
+        %stl.profile_stop Stop the sampling profiler
+        %
+        % stl.profile_stop() stops sampling, the samples are kept for stl.profile_dump.
+        %
+        % See also: stl.profile_start, stl.profile_dump.
+            coder.cinclude('stl.h');
+            coder.ceval('stl_profile_stop');
+        end
+
+        function profile_dump(filename)
+        %stl.profile_dump Write profile samples for a flame graph
+        %
+        % stl.profile_dump(filename) writes the samples taken since stl.profile_start to the
+        % specified file as folded stacks, one line per distinct call stack:
+        %
+        %    thread;outer_function;...;inner_function count
+        %
+        % which can be displayed with flamegraph.pl from https://github.com/brendangregg/FlameGraph
+        %
+        % Notes::
+        % - Can be called while the profiler is running.
+        % - Functions are named by looking up the binary's dynamic symbols, so link it with
+        %   -rdynamic, as stl.launch already requires.  MATLAB entry points and other global
+        %   functions are named, inlined functions are counted in their caller and static
+        %   functions are shown as binary+offset which addr2line can resolve.
+        % - The samples are also served by the web server at /profile, see webserver.metrics.
+        %
+        % See also: stl.profile_start, stl.profile_stop, webserver.metrics.
+            coder.cinclude('stl.h');
+            coder.ceval('stl_profile_dump', cstring(filename));
+        end
+
+    % tasks
+        function task_init(nworkers, stacksize)
+        %stl.task_init Start the task worker threads
+        %
+        % stl.task_init(nworkers) starts nworkers threads which run lightweight tasks created by
+        % stl.task.
+        %
+        % stl.task_init(nworkers, stacksize) as above but each task has a stack of stacksize
+        % bytes, default 64kB.
+        %
+        % Notes::
+        % - Must be called once before stl.task.
+        % - Task stacks are small, MATLAB functions with large local arrays may need a bigger
+        %   stacksize.  Each stack has a guard page so an overflow faults rather than corrupting
+        %   memory.
+        %
+        % See also: stl.task.
+            coder.cinclude('stl.h');
+
+            if nargin < 2
+                stacksize = 0;
+            end
+            coder.ceval('stl_task_init', int32(nworkers), int32(stacksize));
+        end
+
+        function task(name, arg)
+        %stl.task Start a lightweight task
+        %
+        % stl.task(name) starts a task which executes the MATLAB entry point name.
+        %
+        % stl.task(name, arg) as above but passes by reference the struct arg as an argument
+        % to the task.
+        %
+        % Tasks are much cheaper than threads, thousands can exist at once.  They share the
+        % worker threads started by stl.task_init and are cooperative: a task runs until it
+        % calls stl.sleep, stl.semaphore_wait or stl.yield, which let another task run on
+        % the same worker thread.
+        %
+        % Notes::
+        % - A task that computes for a long time without one of these calls holds up the other
+        %   tasks on its worker.
+        % - Other blocking calls, such as stl.mutex_lock, block the whole worker thread.
+        % - Each task stays on the worker thread it started on.
+        % - The entry point must not have stack data.
+        %
+        % See also: stl.task_init, stl.yield, stl.launch.
+            coder.cinclude('stl.h');
+
+            if nargin < 2
+                arg = 0;
+            end
+            coder.ceval('stl_task_spawn', cstring(name), coder.ref(arg));
+        end
+
+        function yield()
+        %stl.yield Let another task run
+        %
+        % stl.yield() lets another ready task on this worker thread run, and returns
+        % immediately if there is none.  Outside a task it yields the processor.
+        %
+        % See also: stl.task.
+            coder.cinclude('stl.h');
+            coder.ceval('stl_task_yield');
+        end
+
+        function n = task_count()
+        %stl.task_count Number of running tasks
+        %
+        % n = stl.task_count() is the number of tasks that have started and not yet returned.
+        %
+        % See also: stl.task.
+            coder.cinclude('stl.h');
+
+            n = int32(0);
+            n = coder.ceval('stl_task_count');
+        end
+
     % mutex
-        function id = mutex(name)
+        function id = mutex(name, type, ceiling)
         %stl.mutex Create a mutex
         %
         % mid = stl.mutex(name) returns the id of a new mutex with the specified name.
         %
+        % mid = stl.mutex(name, type) as above but type selects the kind of mutex:
+        %   'errorcheck'   detects relocking and unlocking by another thread (default)
+        %   'normal'       no checks, fastest
+        %   'adaptive'     spins briefly before sleeping, for short critical sections
+        %   'inherit'      priority inheritance, the owner runs at the priority of the
+        %                  highest priority thread waiting for the mutex
+        %   'ceiling'      priority ceiling, the owner runs at the ceiling priority
+        %
+        % mid = stl.mutex(name, 'ceiling', priority) as above but sets the ceiling priority,
+        % default is the maximum SCHED_FIFO priority.
+        %
         % Notes::
         % - The mutex is initially unlocked.
+        % - Use 'inherit' or 'ceiling' for a mutex shared between a real-time thread and lower
+        %   priority threads, to prevent priority inversion.
+        % - With glibc a 'ceiling' mutex can only be locked by a thread with a real-time
+        %   scheduling policy.
+        % - 'adaptive' is the same as 'normal' on platforms that don't support it.
         % - The mutex id is a small integer which indexes into an internal mutex table.  If an error
         %   is obtained about too few mutexes then increase NMUTEXS in stl.c and recompile.
+        % - Compile stl.c with -DSTL_NDEBUG to remove all debug messages and the lock and
+        %   contention counters, reported by stl_metrics, from the lock and unlock path.
         %
         % See also: stl.mutex_lock, stl.mutex_try, stl.mutex_unlock.
 
+            if nargin < 2
+                type = 'errorcheck';
+            end
+            if nargin < 3
+                ceiling = 0;
+            end
+            % must match the enum in stl.c
+            switch type
+                case 'errorcheck'
+                    t = int32(0);
+                case 'normal'
+                    t = int32(1);
+                case 'adaptive'
+                    t = int32(2);
+                case 'inherit'
+                    t = int32(3);
+                case 'ceiling'
+                    t = int32(4);
+                otherwise
+                    error('stl.mutex: unknown mutex type');
+            end
             id = int32(0);
-            id = coder.ceval('stl_mutex_create', cstring(name)); % evaluate the C function
+            id = coder.ceval('stl_mutex_create', cstring(name), t, int32(ceiling)); % evaluate the C function
         end
 
         function mutex_lock(id)
@@ -224,6 +531,163 @@ classdef stl < handle %#codegen
             coder.ceval('stl_mutex_unlock', id); % evaluate the C function
         end
 
+    % atomics
+        function v = atomic_load(s, field, order)
+        %stl.atomic_load Read a shared field
+        %
+        % v = stl.atomic_load(s, field) is the value of the field of struct s, read atomically.
+        %
+        % v = stl.atomic_load(s, field, order) as above but with the memory order 'relaxed',
+        % 'acquire' or 'seq_cst' (default).
+        %
+        % Notes::
+        % - The field must be a scalar int32, int64 or double.
+        % - Typically s is the struct passed to a thread by stl.launch, which is shared with the
+        %   thread that launched it.
+        % - The thread entry point must return the struct under the same name as its argument,
+        %   function arg = entry(arg), or it is passed as a const pointer and the atomic acts on
+        %   a copy.
+        % - 'acquire' ensures that reads after this one see everything written before the
+        %   matching 'release' store.
+        %
+        % See also: stl.atomic_store, stl.atomic_add, stl.atomic_cas.
+            coder.cinclude('stl.h');
+            coder.inline('always');
+
+            if nargin < 3
+                order = 'seq_cst';
+            end
+            v = s.(field);
+            v = coder.ceval(['stl_atomic_load_' stl.atomic_type(v)], coder.rref(s.(field)), stl.atomic_order(order));
+        end
+
+        function s = atomic_store(s, field, v, order)
+        %stl.atomic_store Write a shared field
+        %
+        % s = stl.atomic_store(s, field, v) sets the field of struct s to v, atomically.
+        %
+        % s = stl.atomic_store(s, field, v, order) as above but with the memory order 'relaxed',
+        % 'release' or 'seq_cst' (default).
+        %
+        % Notes::
+        % - The struct must be both argument and result, so that the field is updated in place,
+        %   for example s = stl.atomic_store(s, 'stop', int32(1)).
+        % - The field must be a scalar int32, int64 or double.
+        % - The thread entry point must return the struct under the same name as its argument,
+        %   function arg = entry(arg), or it is passed as a const pointer and the atomic acts on
+        %   a copy.
+        % - A 'release' store makes everything written before it visible to a thread that
+        %   reads the field with 'acquire'.
+        %
+        % See also: stl.atomic_load, stl.atomic_add, stl.atomic_cas.
+            coder.cinclude('stl.h');
+            coder.inline('always');
+
+            if nargin < 4
+                order = 'seq_cst';
+            end
+            coder.ceval(['stl_atomic_store_' stl.atomic_type(s.(field))], coder.ref(s.(field)), ...
+                cast(v, 'like', s.(field)), stl.atomic_order(order));
+        end
+
+        function [s, old] = atomic_add(s, field, v, order)
+        %stl.atomic_add Add to a shared field
+        %
+        % s = stl.atomic_add(s, field, v) adds v to the field of struct s, atomically.
+        %
+        % [s,old] = stl.atomic_add(s, field, v) as above but also returns the value of the field
+        % before the addition.
+        %
+        % [s,old] = stl.atomic_add(s, field, v, order) as above but with the memory order
+        % 'relaxed', 'acquire', 'release', 'acq_rel' or 'seq_cst' (default).
+        %
+        % Notes::
+        % - The struct must be both argument and result, so that the field is updated in place,
+        %   for example s = stl.atomic_add(s, 'count', 1).
+        % - The field must be a scalar int32, int64 or double.
+        % - The thread entry point must return the struct under the same name as its argument,
+        %   function arg = entry(arg), or it is passed as a const pointer and the atomic acts on
+        %   a copy.
+        % - 'relaxed' is sufficient for a counter that is only read for reporting.
+        % - For a double the addition is a compare and swap loop, which retries if another thread
+        %   changes the field at the same time.
+        %
+        % See also: stl.atomic_load, stl.atomic_store, stl.atomic_cas.
+            coder.cinclude('stl.h');
+            coder.inline('always');
+
+            if nargin < 4
+                order = 'seq_cst';
+            end
+            old = s.(field);
+            old = coder.ceval(['stl_atomic_add_' stl.atomic_type(old)], coder.ref(s.(field)), ...
+                cast(v, 'like', old), stl.atomic_order(order));
+        end
+
+        function [s, ok, old] = atomic_cas(s, field, expected, desired, order)
+        %stl.atomic_cas Compare and swap a shared field
+        %
+        % [s,ok] = stl.atomic_cas(s, field, expected, desired) sets the field of struct s to
+        % desired if it is equal to expected, atomically.  ok is true if the field was set.
+        %
+        % [s,ok,old] = stl.atomic_cas(s, field, expected, desired) as above but also returns
+        % the value of the field before the operation, which is equal to expected if ok is true.
+        %
+        % [s,ok,old] = stl.atomic_cas(s, field, expected, desired, order) as above but with the
+        % memory order 'relaxed', 'acquire', 'release', 'acq_rel' or 'seq_cst' (default).
+        %
+        % Notes::
+        % - The struct must be both argument and result, so that the field is updated in place.
+        % - The field must be a scalar int32, int64 or double.
+        % - The thread entry point must return the struct under the same name as its argument,
+        %   function arg = entry(arg), or it is passed as a const pointer and the atomic acts on
+        %   a copy.
+        % - A double field is compared bit for bit, so NaN can match NaN but -0 does not
+        %   match 0.
+        %
+        % See also: stl.atomic_load, stl.atomic_store, stl.atomic_add.
+            coder.cinclude('stl.h');
+            coder.inline('always');
+
+            if nargin < 5
+                order = 'seq_cst';
+            end
+            old = cast(expected, 'like', s.(field));
+            r = int32(0);
+            r = coder.ceval(['stl_atomic_cas_' stl.atomic_type(old)], coder.ref(s.(field)), ...
+                coder.ref(old), cast(desired, 'like', old), stl.atomic_order(order));
+            ok = r ~= 0;
+        end
+
+        function t = atomic_type(v)
+        % C function suffix for the type of v
+            switch class(v)
+                case {'int32', 'int64', 'double'}
+                    t = class(v);
+                otherwise
+                    error('stl.atomic: field must be int32, int64 or double');
+            end
+            assert(isscalar(v) && isreal(v), 'stl.atomic: field must be a real scalar');
+        end
+
+        function o = atomic_order(order)
+        % memory order as a C constant, must match the STL_ defines in stl.h
+            switch order
+                case 'relaxed'
+                    o = coder.opaque('int', 'STL_RELAXED');
+                case 'acquire'
+                    o = coder.opaque('int', 'STL_ACQUIRE');
+                case 'release'
+                    o = coder.opaque('int', 'STL_RELEASE');
+                case 'acq_rel'
+                    o = coder.opaque('int', 'STL_ACQ_REL');
+                case 'seq_cst'
+                    o = coder.opaque('int', 'STL_SEQ_CST');
+                otherwise
+                    error('stl.atomic: unknown memory order');
+            end
+        end
+
     % semaphore
         function id = semaphore(name)
         %stl.semaphore Create a semaphore
@@ -282,6 +746,450 @@ classdef stl < handle %#codegen
             coder.ceval('stl_sem_wait_noblock', id); % evaluate the C function
         end
 
+    % latest value
+        function id = latest(name, example, nbuf)
+        %stl.latest Create a latest value
+        %
+        % lid = stl.latest(name, example) returns the id of a new latest value with the specified
+        % name.  One thread writes values and any number of threads read the most recent one.  The
+        % value has the same type as example, typically a struct, and example is the initial value.
+        %
+        % lid = stl.latest(name, example, nbuf) as above but uses nbuf buffers, default 3.
+        %
+        % Notes::
+        % - The writer never blocks, and readers always get a complete value, never a mix of two
+        %   writes.  A reader retries its copy if the writer overwrites the buffer it is reading,
+        %   more buffers make this less likely.
+        % - Only one thread should write a particular latest value.
+        % - The id is a small integer which indexes into an internal table.  If an error
+        %   is obtained about too few latest values then increase NLATEST in stl.c and recompile.
+        %
+        % See also: stl.latest_write, stl.latest_read, stl.latest_seq.
+            coder.cinclude('stl.h');
+
+            if nargin < 3
+                nbuf = 0;
+            end
+            size = stl.nbytes(example);
+            id = int32(0);
+            id = coder.ceval('stl_latest_create', cstring(name), coder.rref(example), size, int32(nbuf));
+        end
+
+        function latest_write(id, v)
+        %stl.latest_write Publish a new value
+        %
+        % stl.latest_write(lid, v) makes v the newest value of the specified latest value.  It
+        % never blocks.
+        %
+        % See also: stl.latest, stl.latest_read.
+            coder.cinclude('stl.h');
+
+            coder.ceval('stl_latest_write', id, coder.rref(v), stl.nbytes(v));
+        end
+
+        function [v, seq] = latest_read(id, example)
+        %stl.latest_read Get the newest value
+        %
+        % v = stl.latest_read(lid, example) is the most recently written value of the specified
+        % latest value.  example is only used to give v its type.
+        %
+        % [v,seq] = stl.latest_read(lid, example) as above but also returns the sequence number
+        % of the value, which is 0 for the initial value and increases by one for every write.
+        %
+        % See also: stl.latest, stl.latest_write, stl.latest_seq.
+            coder.cinclude('stl.h');
+
+            v = example;
+            seq = uint64(0);
+            seq = coder.ceval('stl_latest_read', id, coder.wref(v), stl.nbytes(v));
+        end
+
+        function seq = latest_seq(id)
+        %stl.latest_seq Get the sequence number of the newest value
+        %
+        % seq = stl.latest_seq(lid) is the sequence number of the most recently written value.
+        % It is cheaper than stl.latest_read for checking whether the value has changed.
+        %
+        % See also: stl.latest, stl.latest_read.
+            coder.cinclude('stl.h');
+
+            seq = uint64(0);
+            seq = coder.ceval('stl_latest_seq', id);
+        end
+
+        function n = nbytes(v)
+        % size of v in bytes, v is a scalar struct or a numeric, char or logical array
+            if isstruct(v)
+                % ceval passes a struct by value, so this is sizeof the C struct
+                assert(isscalar(v), 'stl: struct must be scalar');
+                n = int32(0);
+                n = coder.ceval('(int32_t)sizeof', v);
+                return
+            end
+            switch class(v)
+                case {'double', 'int64', 'uint64'}
+                    b = 8;
+                case {'single', 'int32', 'uint32'}
+                    b = 4;
+                case {'int16', 'uint16'}
+                    b = 2;
+                case {'int8', 'uint8', 'char', 'logical'}
+                    b = 1;
+                otherwise
+                    error('stl: value must be a struct, numeric, char or logical');
+            end
+            if ~isreal(v)
+                b = 2*b;
+            end
+            n = int32(numel(v) * b);
+        end
+
+    % pipeline
+        function pid = pipeline(name)
+        %stl.pipeline Create a pipeline
+        %
+        % pid = stl.pipeline(name) is the id of a new, empty, pipeline.  Stages are added with
+        % stl.pipeline_stage and run once stl.pipeline_start is called.
+        %
+        % A pipeline is a chain of MATLAB entry points, for example capture, undistort, detect
+        % and publish.  Each stage is run by one or more worker threads and passes structs to the
+        % next stage through a bounded queue.  When a queue is full the stage feeding it waits,
+        % so the pipeline runs at the rate of its slowest stage.
+        %
+        % Notes::
+        % - The pipeline id is a small integer which indexes into an internal table.  If an error
+        %   is obtained about too few pipelines then increase NPIPELINES in stl.c and recompile.
+        %
+        % See also: stl.pipeline_stage, stl.pipeline_start, stl.pipeline_stats.
+            coder.cinclude('stl.h');
+
+            pid = int32(0);
+            pid = coder.ceval('stl_pipeline_create', cstring(name));
+        end
+
+        function pipeline_stage(pid, entry, in, out, nworkers, depth)
+        %stl.pipeline_stage Add a stage to a pipeline
+        %
+        % stl.pipeline_stage(pid, entry, in, out) appends a stage which runs the MATLAB entry point
+        % entry.  in and out are examples of the struct the stage takes and returns: in is [] for
+        % the first stage, whose entry point is out = entry(), and out is [] for the last stage,
+        % whose entry point is entry(in).  Other stages are out = entry(in).
+        %
+        % stl.pipeline_stage(pid, entry, in, out, nworkers, depth) as above but the stage is run by
+        % nworkers threads (default 1) and its output queue holds up to depth items (default 4).
+        %
+        % Notes::
+        % - in must have the same type as the previous stage's out.
+        % - Items can be reordered by a stage with more than one worker.
+        % - Entry points must not have stack data.
+        %
+        % See also: stl.pipeline, stl.pipeline_start.
+            coder.cinclude('stl.h');
+
+            if nargin < 5
+                nworkers = 1;
+            end
+            if nargin < 6
+                depth = 4;
+            end
+            insize = int32(0);
+            if ~isempty(in)
+                insize = stl.nbytes(in);
+            end
+            outsize = int32(0);
+            if ~isempty(out)
+                outsize = stl.nbytes(out);
+            end
+            coder.ceval('stl_pipeline_stage', pid, cstring(entry), insize, outsize, int32(nworkers), int32(depth));
+        end
+
+        function pipeline_start(pid)
+        %stl.pipeline_start Start a pipeline
+        %
+        % stl.pipeline_start(pid) starts the worker threads of all stages.
+        %
+        % See also: stl.pipeline, stl.pipeline_stop.
+            coder.cinclude('stl.h');
+            coder.ceval('stl_pipeline_start', pid);
+        end
+
+        function pipeline_stop(pid)
+        %stl.pipeline_stop Stop a pipeline
+        %
+        % stl.pipeline_stop(pid) waits for each worker to finish its current item, then stops
+        % them.  Items still in the queues are discarded.
+        %
+        % See also: stl.pipeline, stl.pipeline_start.
+            coder.cinclude('stl.h');
+            coder.ceval('stl_pipeline_stop', pid);
+        end
+
+        function s = pipeline_stats(pid)
+        %stl.pipeline_stats Pipeline statistics
+        %
+        % s = stl.pipeline_stats(pid) is a matrix with one row per stage and the columns:
+        %   1  number of items processed
+        %   2  items per second since the pipeline started
+        %   3  number of items waiting in the stage's output queue
+        %   4  mean time in the entry point (s)
+        %   5  maximum time in the entry point (s)
+        %   6  fraction of time workers spent waiting for space in the output queue
+        %
+        % The bottleneck is the stage with the lowest column 6 whose input queue is full.
+        %
+        % See also: stl.pipeline.
+            coder.cinclude('stl.h');
+
+            n = int32(0);
+            n = coder.ceval('stl_pipeline_nstages', pid);
+            s = zeros(n, 6);
+            coder.ceval('stl_pipeline_stats', pid, coder.wref(s));
+        end
+
+    % recording
+        function ch = record_open(filename, example, segsize, nkeep)
+        %stl.record_open Open a binary recording file
+        %
+        % ch = stl.record_open(filename, example) is the id of a recording channel that writes
+        % records with the same type as example, a struct of numeric, logical or char fields, to
+        % the files filename.000, filename.001 and so on.
+        %
+        % ch = stl.record_open(filename, example, segsize, nkeep) as above but each segment file
+        % holds segsize bytes (default 64MB) and only the most recent nkeep segments are kept,
+        % default 0 keeps them all.
+        %
+        % Notes::
+        % - Each record is timestamped and written to a memory mapped file, the next segment is
+        %   prepared in advance by a background thread, so writing a record costs a memcpy and
+        %   never blocks.  If the next segment isn't ready in time records are dropped, and
+        %   counted.
+        % - Only one thread should write to a particular channel, use a channel per thread.
+        % - The files are read back into MATLAB with record_load.
+        % - The id is a small integer which indexes into an internal table.  If an error
+        %   is obtained about too few recordings then increase NRECORDERS in stl.c and recompile.
+        %
+        % See also: stl.record, stl.record_close, record_load.
+            coder.cinclude('stl.h');
+
+            if nargin < 3
+                segsize = 0;
+            end
+            if nargin < 4
+                nkeep = 0;
+            end
+
+            % describe the fields so that record_load can unpack the records
+            schema = '';
+            coder.varsize('schema');
+            fields = fieldnames(example);
+            coder.unroll();
+            for i=1:numel(fields)
+                f = example.(fields{i});
+                schema = [schema fields{i} ':' class(f) ':' sprintf('%d', int32(numel(f))) ';'];
+            end
+
+            size = stl.nbytes(example);
+            ch = int32(0);
+            ch = coder.ceval('stl_record_open', cstring(filename), cstring(schema), size, double(segsize), int32(nkeep));
+        end
+
+        function record(ch, v)
+        %stl.record Write a record
+        %
+        % stl.record(ch, v) writes the struct v to the recording channel, along with the current
+        % time.  It never blocks.
+        %
+        % See also: stl.record_open.
+            coder.cinclude('stl.h');
+
+            coder.ceval('stl_record', ch, coder.rref(v), stl.nbytes(v));
+        end
+
+        function record_close(ch)
+        %stl.record_close Close a recording
+        %
+        % stl.record_close(ch) finishes the recording, the last segment file is trimmed to the
+        % records written.
+        %
+        % See also: stl.record_open.
+            coder.cinclude('stl.h');
+            coder.ceval('stl_record_close', ch);
+        end
+
+    % reactor
+        function id = watch(fd, events, entry, arg)
+        %stl.watch Call an entry point when a file descriptor is ready
+        %
+        % wid = stl.watch(fd, events, entry) watches the file descriptor fd and calls the MATLAB
+        % entry point entry when it is ready.  events is a string containing 'r' to watch for data
+        % to read, 'w' to watch for space to write, and 'e' for edge triggered mode.
+        %
+        % wid = stl.watch(path, events, entry) as above but opens the file or device path, such
+        % as a serial port, non-blocking.  It is closed by stl.unwatch.
+        %
+        % wid = stl.watch(fd, events, entry, arg) as above but passes the struct arg by reference
+        % to the entry point.
+        %
+        % The entry point is called as entry(wid, ready, arg) where ready has bit 0 set if the
+        % descriptor is readable, bit 1 if writable and bit 2 on hangup or error.
+        %
+        % Notes::
+        % - All watched descriptors are serviced by a single reactor thread using epoll, so entry
+        %   points run one at a time and should not block.
+        % - In edge triggered mode the entry point is called only when the state changes, so it
+        %   must read until stl.watch_read returns 0.  The descriptor is made non-blocking.
+        % - The entry point must not have stack data.
+        % - Linux only.
+        % - The id is a small integer which indexes into an internal table.  If an error
+        %   is obtained about too few watches then increase NWATCHES in stl.c and recompile.
+        %
+        % See also: stl.unwatch, stl.watch_read, stl.watch_write.
+            coder.cinclude('stl.h');
+
+            if nargin < 4
+                arg = 0;
+            end
+            % must match the event bits in stl.c
+            ev = int32(0);
+            for c=events
+                switch c
+                    case 'r'
+                        ev = bitor(ev, int32(1));
+                    case 'w'
+                        ev = bitor(ev, int32(2));
+                    case 'e'
+                        ev = bitor(ev, int32(8));
+                    otherwise
+                        error('stl.watch: unknown event, must be r, w or e');
+                end
+            end
+            id = int32(0);
+            if ischar(fd)
+                id = coder.ceval('stl_watch_path', cstring(fd), ev, cstring(entry), coder.ref(arg));
+            else
+                id = coder.ceval('stl_watch_fd', int32(fd), ev, cstring(entry), coder.ref(arg));
+            end
+        end
+
+        function unwatch(id)
+        %stl.unwatch Stop watching a file descriptor
+        %
+        % stl.unwatch(wid) stops calling the entry point for the watch, and closes the descriptor
+        % if it was opened by stl.watch.  It can be called from the entry point.
+        %
+        % See also: stl.watch.
+            coder.cinclude('stl.h');
+            coder.ceval('stl_unwatch', id);
+        end
+
+        function [data, n] = watch_read(id, maxlen)
+        %stl.watch_read Read from a watched file descriptor
+        %
+        % [data,n] = stl.watch_read(wid, maxlen) reads up to maxlen bytes from the watched
+        % descriptor without blocking.  data is a uint8 row vector and n is the number of bytes
+        % read, 0 if none are available or -1 at end of file.
+        %
+        % See also: stl.watch, stl.watch_write.
+            coder.cinclude('stl.h');
+
+            buf = zeros(1, maxlen, 'uint8');
+            n = int32(0);
+            n = coder.ceval('stl_watch_read', id, coder.wref(buf), int32(maxlen));
+            data = buf(1:max(n,0));
+        end
+
+        function n = watch_write(id, data)
+        %stl.watch_write Write to a watched file descriptor
+        %
+        % n = stl.watch_write(wid, data) writes the uint8 or char vector data to the watched
+        % descriptor without blocking and returns the number of bytes written, which may be
+        % less than the length of data.
+        %
+        % See also: stl.watch, stl.watch_read.
+            coder.cinclude('stl.h');
+
+            n = int32(0);
+            n = coder.ceval('stl_watch_write', id, coder.rref(data), int32(length(data)));
+        end
+
+    % UDP
+        function sock = udp_open(port, maxpkts)
+        %stl.udp_open Open a UDP socket for batched I/O
+        %
+        % sock = stl.udp_open(port, maxpkts) is the id of a UDP socket bound to the specified
+        % port, which can receive or send up to maxpkts packets per system call.
+        %
+        % Notes::
+        % - Each received packet is timestamped by the kernel on arrival.
+        % - The kernel receive buffer is enlarged to absorb bursts, up to the net.core.rmem_max
+        %   limit.
+        % - Linux only.
+        % - The socket id is a small integer which indexes into an internal table.  If an error
+        %   is obtained about too few sockets then increase NUDPSOCKETS in stl.c and recompile.
+        %
+        % See also: stl.udp_recv_batch, stl.udp_send_batch, stl.udp_close.
+            coder.cinclude('stl.h');
+
+            sock = int32(0);
+            sock = coder.ceval('stl_udp_open', int32(port), int32(maxpkts));
+        end
+
+        function [data, lens, times, n, srcaddr, srcport] = udp_recv_batch(sock, maxpkts, pktsize, timeout)
+        %stl.udp_recv_batch Receive a batch of packets
+        %
+        % [data,lens,times,n] = stl.udp_recv_batch(sock, maxpkts, pktsize, timeout) receives up to
+        % maxpkts packets with a single system call, waiting up to timeout seconds for the first
+        % one.  data is a pktsize x maxpkts uint8 matrix with one packet per column, lens(i) is the
+        % length of packet i, times(i) is its arrival time in seconds since the epoch, and n is the
+        % number of packets received, 0 on timeout.
+        %
+        % [data,lens,times,n,srcaddr,srcport] = stl.udp_recv_batch(...) as above but also returns
+        % the IPv4 address, as a uint32, and port of each packet's sender.
+        %
+        % Notes::
+        % - A negative timeout waits forever, 0 does not wait.
+        % - Packets longer than pktsize are truncated.
+        % - maxpkts must not exceed the value given to stl.udp_open.
+        %
+        % See also: stl.udp_open, stl.udp_send_batch.
+            coder.cinclude('stl.h');
+
+            data = zeros(pktsize, maxpkts, 'uint8');
+            lens = zeros(1, maxpkts, 'int32');
+            times = zeros(1, maxpkts);
+            srcaddr = zeros(1, maxpkts, 'uint32');
+            srcport = zeros(1, maxpkts, 'int32');
+            n = int32(0);
+            n = coder.ceval('stl_udp_recv_batch', sock, coder.wref(data), int32(pktsize), int32(maxpkts), ...
+                coder.wref(lens), coder.wref(times), coder.wref(srcaddr), coder.wref(srcport), double(timeout));
+        end
+
+        function n = udp_send_batch(sock, data, lens, host, port)
+        %stl.udp_send_batch Send a batch of packets
+        %
+        % n = stl.udp_send_batch(sock, data, lens, host, port) sends the columns of the uint8 matrix
+        % data as packets to the IPv4 address host, a string, and port with a single system call.
+        % lens(i) is the length of the packet in column i.  Returns the number of packets sent,
+        % which is fewer than the number of columns if the socket buffer is full.
+        %
+        % See also: stl.udp_open, stl.udp_recv_batch.
+            coder.cinclude('stl.h');
+
+            n = int32(0);
+            n = coder.ceval('stl_udp_send_batch', sock, coder.rref(data), int32(size(data,1)), int32(size(data,2)), ...
+                coder.rref(int32(lens)), cstring(host), int32(port));
+        end
+
+        function udp_close(sock)
+        %stl.udp_close Close a UDP socket
+        %
+        % stl.udp_close(sock) closes the socket and frees its slot.
+        %
+        % See also: stl.udp_open.
+            coder.cinclude('stl.h');
+            coder.ceval('stl_udp_close', sock);
+        end
+
     % timer
     function tmid = timer(name, interval, semid)
     %stl.timer Create periodic timer
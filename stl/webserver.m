@@ -6,44 +6,118 @@ classdef webserver < handle %#codegen
 %
 % Methods::
 %  webserver    create a webserver instance
+%  options      default webserver options
 %  debug        enable debugging messages
 %  details      display HTTP header
+%  metrics      enable the /metrics page
+%  accesslog    write binary access log
+%  cache        cache responses for a URL prefix
+%  invalidate   drop cached responses
 %-
 %  html         send string to browser
 %  template     send file with substitutions to browser
 %  file         send file to browser
 %  data         send data to browser
+%  json         send struct as JSON to browser
+%  binary       send numeric array as binary to browser
 %  error        send error code to browser
+%  defer        defer the response to this request
+%  complete     send a deferred response
+%-
+%  stream       start a streaming response
+%  mjpeg        start an MJPEG video stream
+%  sse          start a Server-Sent Events stream
+%  stream_send  send data on a stream
+%  stream_frame send a frame on an MJPEG stream
+%  stream_event send an event on an SSE stream
+%  stream_close finish a stream
+%-
+%  websocket    accept a websocket connection
+%  ws_send      send a websocket message
+%  ws_recv      receive a websocket message
+%  ws_close     close a websocket
 %-
 %  url          URL for current request
+%  route        add a route to a MATLAB entrypoint
+%  param        path parameter matched by the route
 %  isGET        test for GET request
 %  isPOST       test for POST request
+%  isWebSocket  test for websocket upgrade request
 %  reqheader    get element of HTTP header
 %  getarg       get element of HTTP GET header
 %  postarg      get element of HTTP POST header
+%  upload_dir   stream file uploads to a directory
 %
 % Copyright (C) 2018, by Peter I. Corke
 
     methods(Static)
         
-        function obj = webserver(port, callback, arg)
+        function obj = webserver(port, callback, arg, opts)
         %webserver Create a webserver
         %
         % webserver(port, callback) creates a new webserver executing it a separate
         % thread and listening on the specified port (int).  The MATLAB entrypoint
-        % named callback is invoked on every GET and PUT request to the server.
+        % named callback is invoked on every GET and PUT request to the server that
+        % does not match a route added by webserver.route.  If all pages are routed
+        % callback can be ''.
+        %
+        % webserver(port, callback, arg) as above but arg is passed by reference to
+        % the server.
+        %
+        % webserver(port, callback, arg, opts) as above but opts is a struct, created by
+        % webserver.options, that sets connection limits, timeouts and rate limiting.
+        %
+        % See also: webserver.options.
 
             % webserver Create a web server instance
             port = int32(port);
             coder.cinclude('httpd.h');
             coder.cinclude('stl.h');
-            if nargin == 3
-                coder.ceval('web_start', port, cstring(callback), coder.ref(arg));
+            if nargin == 4
+                coder.cstructname(opts, 'web_options', 'extern', 'HeaderFile', 'httpd.h');
+                coder.ceval('web_start', port, cstring(callback), coder.ref(arg), coder.ref(opts));
+            elseif nargin == 3
+                coder.ceval('web_start', port, cstring(callback), coder.ref(arg), coder.opaque('web_options *', 'NULL'));
             else
-                coder.ceval('web_start', port, cstring(callback), coder.opaque('void *', 'NULL'));
+                coder.ceval('web_start', port, cstring(callback), coder.opaque('void *', 'NULL'), coder.opaque('web_options *', 'NULL'));
             end
 
         end
+
+        function opts = options()
+        %webserver.options Default webserver options
+        %
+        % opts = webserver.options() is a struct of options for the webserver, with
+        % fields:
+        %
+        %  max_connections      max concurrent connections
+        %  per_ip_connections   max concurrent connections from one client address
+        %  timeout              idle connection timeout (s)
+        %  memory_limit         memory for each connection (bytes)
+        %  backlog              listen backlog
+        %  rate                 max requests per second from one client address
+        %  burst                requests allowed in a burst above rate
+        %
+        % All fields are zero initially, which leaves the default in place, eg. no rate
+        % limit.  Requests over the rate limit get a 429 response before any MATLAB code
+        % is run.
+        %
+        % Example::
+        %   opts = webserver.options();
+        %   opts.timeout = int32(30);
+        %   opts.rate = 20;
+        %   webserver(8080, 'myserver', 0, opts);
+        %
+        % See also: webserver.webserver.
+            opts.max_connections = int32(0);
+            opts.per_ip_connections = int32(0);
+            opts.timeout = int32(0);
+            opts.memory_limit = int32(0);
+            opts.backlog = int32(0);
+            opts.rate = 0;
+            opts.burst = 0;
+            coder.cstructname(opts, 'web_options', 'extern', 'HeaderFile', 'httpd.h');
+        end
         
         function debug(d)
         %webserver.debug Control debugging
@@ -56,6 +130,77 @@ classdef webserver < handle %#codegen
             coder.ceval('web_debug', d);
         end
         
+        function metrics(enable)
+        %webserver.metrics Enable the /metrics page
+        %
+        % webserver.metrics(E) controls the built-in /metrics page.  If E is true the
+        % page is served, in Prometheus text format, with request latency histograms,
+        % response counts and bytes for each route or URL, plus thread, mutex and
+        % semaphore counters from the thread library.
+        %
+        % The /profile page is also served, with the samples taken since stl.profile_start
+        % as folded stacks, eg. curl http://host:port/profile | flamegraph.pl > profile.svg
+        %
+        % Notes::
+        % - Requests are always timed, this only controls whether the page is served.
+        % - A route added for /metrics or /profile takes precedence.
+        %
+        % See also: webserver.accesslog.
+            coder.cinclude('httpd.h');
+            coder.ceval('web_metrics', int32(enable));
+        end
+
+        function accesslog(filename)
+        %webserver.accesslog Write a binary access log
+        %
+        % webserver.accesslog(filename) appends a fixed size binary record for every
+        % request to the specified file.  Records are written by a background thread so
+        % the web server never waits on the disk.
+        %
+        % Each 64 byte record, in host byte order, is: arrival time (uint64 ns since the
+        % epoch), duration (uint32 us), HTTP status (uint16), first two characters of the
+        % method, response bytes (uint64), URL (40 chars, truncated).
+        %
+        % Notes::
+        % - If the log thread falls behind records are dropped, the count is given by
+        %   web_accesslog_dropped_total on the /metrics page.
+        %
+        % See also: webserver.metrics.
+            coder.cinclude('httpd.h');
+            coder.ceval('web_accesslog', cstring(filename));
+        end
+
+        function cache(prefix, ttl)
+        %webserver.cache Cache responses for a URL prefix
+        %
+        % webserver.cache(prefix, ttl) causes responses to GET requests for URLs that
+        % start with prefix to be cached for ttl seconds.  While the response is cached
+        % it is sent directly by the web server without invoking any MATLAB code.
+        %
+        % Notes::
+        % - The cache key is the URL and the GET arguments.
+        % - If several prefixes match the longest is used, a ttl of 0 turns caching off.
+        % - Only responses from html, template, data, json and binary are cached.
+        % - The cache holds a limited number of responses, increase NCACHE in httpd.c
+        %   and recompile if needed.
+        %
+        % See also: webserver.invalidate.
+            coder.cinclude('httpd.h');
+            coder.ceval('web_cache', cstring(prefix), double(ttl));
+        end
+
+        function invalidate(prefix)
+        %webserver.invalidate Drop cached responses
+        %
+        % webserver.invalidate(prefix) drops all cached responses for URLs that start with
+        % prefix, so the next request runs the MATLAB code again.  It can be called from
+        % any thread, typically when the state shown by those pages changes.
+        %
+        % See also: webserver.cache.
+            coder.cinclude('httpd.h');
+            coder.ceval('web_invalidate', cstring(prefix));
+        end
+
         function u = url()
         %webserver.url Get the URL for the request
         %
@@ -69,15 +214,56 @@ classdef webserver < handle %#codegen
             BUFSIZ = 256;
             buf = char(zeros(1,BUFSIZ)); % create a buffer to write into, all nulls
             
-            coder.ceval('web_url', coder.wref(buf), BUFSIZ); % evaluate the C function
-                                    
-            for i=1:BUFSIZ-1 % find the end of the string, where the first unwritten null is
-                if buf(i) == 0
-                    u = buf(1:i-1); % found a null, return variable length array up to here
-                    return;
-                end
+            n = int32(0);
+            n = coder.ceval('web_url', coder.wref(buf), BUFSIZ); % evaluate the C function, returns length
+            u = buf(1:min(n, BUFSIZ-1));
+        end
+
+        function s = param(name)
+        %webserver.param Get a path parameter for the request
+        %
+        % v = webserver.param(name) is a character array holding the URL segment matched
+        % by :name in the route pattern for this request.  For a route ending in * the
+        % rest of the URL is given by webserver.param('*').
+        %
+        % Notes::
+        % - Returns empty string if the parameter is not found.
+        %
+        % See also: webserver.route.
+            coder.cinclude('httpd.h');
+            coder.varsize('s');
+            s = '';
+
+            BUFSIZ = 256;
+            buf = char(zeros(1,BUFSIZ)); % create a buffer to write into, all nulls
+
+            n = int32(0);
+            n = coder.ceval('web_param', coder.wref(buf), BUFSIZ, cstring(name));
+            if n > 0
+                s = buf(1:n);
             end
         end
+
+        function route(method, pattern, entry)
+        %webserver.route Add a route to a MATLAB entrypoint
+        %
+        % webserver.route(method, pattern, entry) causes requests with the specified
+        % method ('GET', 'POST', 'PUT', 'DELETE' or '*' for any) and URL matching pattern
+        % to invoke the MATLAB entrypoint named entry directly.
+        %
+        % The pattern is a URL path where a segment :name matches any single segment, and
+        % a final segment * matches the rest of the URL, eg. '/robot/:id/pose' or '/static/*'.
+        % Literal segments take precedence over :name, which takes precedence over *.
+        %
+        % Notes::
+        % - Routes should be added before the webserver is created.
+        % - Requests that match no route are passed to the callback given to webserver,
+        %   which can be '' if all pages are routed.
+        %
+        % See also: webserver.param, webserver.webserver.
+            coder.cinclude('httpd.h');
+            coder.ceval('web_route', cstring(method), cstring(pattern), cstring(entry));
+        end
         
         function details()
         %webserver.details Show HTTP header details
@@ -153,6 +339,10 @@ classdef webserver < handle %#codegen
             % webserver.file(filename, type) send the specified file to the requesting browser, with
             % the specified MIME type.
             %
+            % Notes::
+            % - Byte range requests are supported, so interrupted downloads can be resumed
+            %   and browsers can seek within served video.  If-Range is honoured.
+            %
             % See also: webserver.template, webserver.html, webserver.error.
 
             coder.ceval('web_file', cstring(filename), cstring(type));
@@ -171,6 +361,345 @@ classdef webserver < handle %#codegen
             coder.ceval('web_data', s, length(s), cstring(type));
         end
         
+        function token = defer()
+            %webserver.defer Defer the response to this request
+            %
+            % token = webserver.defer() indicates that the response to the current request
+            % will be sent later, by webserver.complete, and returns a token identifying the
+            % request.  The callback should then return, and the web server carries on
+            % serving other requests while the response is computed.
+            %
+            % Notes::
+            % - The token would typically be passed to another thread, eg. via a shared
+            %   struct and a semaphore.
+            % - The id is a small integer which indexes into an internal table.  If an error
+            %   is obtained about too few deferred requests then increase NDEFERRED in httpd.c
+            %   and recompile.
+            %
+            % See also: webserver.complete.
+            coder.cinclude('httpd.h');
+            token = int32(0);
+            token = coder.ceval('web_defer');
+        end
+
+        function ok = complete(token, s, type, status)
+            %webserver.complete Send a deferred response
+            %
+            % webserver.complete(token, str) sends the string str as the HTML response to the
+            % deferred request identified by token.  It can be called from any thread.
+            %
+            % webserver.complete(token, data, type) as above but the response is the
+            % character or uint8 array data with the specified MIME type.
+            %
+            % webserver.complete(token, data, type, status) as above but with the specified
+            % HTTP status code, the default is 200.
+            %
+            % ok = webserver.complete(...) is false if the client has gone away.
+            %
+            % See also: webserver.defer.
+            coder.cinclude('httpd.h');
+            if nargin < 3
+                type = 'text/html';
+            end
+            if nargin < 4
+                status = 200;
+            end
+            ok = int32(0);
+            ok = coder.ceval('web_complete', token, int32(status), coder.ref(s), int32(length(s)), cstring(type));
+        end
+
+        function id = stream(type)
+            %webserver.stream Start a streaming response
+            %
+            % id = webserver.stream(type) responds to the current request with a stream of
+            % the specified MIME type, and returns a stream id.  Data is sent on the stream
+            % using webserver.stream_send, from any thread, until webserver.stream_close is
+            % called.
+            %
+            % Notes::
+            % - The response uses chunked transfer encoding and the connection is kept open.
+            % - Each stream has a bounded queue, if the client is too slow the oldest
+            %   queued chunk is discarded.
+            % - The stream id is a small integer which indexes into an internal stream table.  If an error
+            %   is obtained about too few streams then increase NSTREAMS in httpd.c and recompile.
+            %
+            % See also: webserver.mjpeg, webserver.sse, webserver.stream_send, webserver.stream_close.
+            coder.cinclude('httpd.h');
+            id = int32(0);
+            id = coder.ceval('web_stream', cstring(type));
+        end
+
+        function id = mjpeg()
+            %webserver.mjpeg Start an MJPEG video stream
+            %
+            % id = webserver.mjpeg() responds to the current request with a
+            % multipart/x-mixed-replace stream, and returns a stream id.  Frames are sent
+            % using webserver.stream_frame.
+            %
+            % See also: webserver.stream_frame, webserver.stream_close.
+            coder.cinclude('httpd.h');
+            id = int32(0);
+            id = coder.ceval('web_stream_mjpeg');
+        end
+
+        function id = sse()
+            %webserver.sse Start a Server-Sent Events stream
+            %
+            % id = webserver.sse() responds to the current request with a text/event-stream
+            % stream, and returns a stream id.  Events are sent using webserver.stream_event.
+            %
+            % See also: webserver.stream_event, webserver.stream_close.
+            coder.cinclude('httpd.h');
+            id = int32(0);
+            id = coder.ceval('web_stream_sse');
+        end
+
+        function ok = stream_send(id, data)
+            %webserver.stream_send Send data on a stream
+            %
+            % ok = webserver.stream_send(id, data) queues the character or uint8 array data
+            % on the specified stream.  Returns false if the client has disconnected, in
+            % which case the stream should be closed.
+            %
+            % See also: webserver.stream, webserver.stream_close.
+            coder.cinclude('httpd.h');
+            ok = int32(0);
+            ok = coder.ceval('web_stream_send', id, coder.ref(data), int32(length(data)));
+        end
+
+        function ok = stream_frame(id, data, type)
+            %webserver.stream_frame Send a frame on an MJPEG stream
+            %
+            % ok = webserver.stream_frame(id, data) queues the uint8 array data, a JPEG
+            % image, as the next frame of the specified MJPEG stream.
+            %
+            % ok = webserver.stream_frame(id, data, type) as above but the frame has the
+            % specified MIME type.
+            %
+            % Returns false if the client has disconnected.
+            %
+            % See also: webserver.mjpeg, webserver.stream_close.
+            coder.cinclude('httpd.h');
+            if nargin < 3
+                type = 'image/jpeg';
+            end
+            ok = int32(0);
+            ok = coder.ceval('web_stream_frame', id, coder.ref(data), int32(length(data)), cstring(type));
+        end
+
+        function ok = stream_event(id, event, data)
+            %webserver.stream_event Send an event on an SSE stream
+            %
+            % ok = webserver.stream_event(id, event, data) queues the character array data
+            % as an event of the specified name.  If event is empty the browser receives
+            % it as a "message" event.  Returns false if the client has disconnected.
+            %
+            % Notes::
+            % - Each line of data is sent as a separate SSE data field, and the browser joins
+            %   them again with newlines, so data can be eg. pretty-printed JSON.
+            % - event must not contain newlines.
+            %
+            % See also: webserver.sse, webserver.stream_close.
+            coder.cinclude('httpd.h');
+            ok = int32(0);
+            ok = coder.ceval('web_stream_event', id, cstring(event), cstring(data));
+        end
+
+        function stream_close(id)
+            %webserver.stream_close Finish a stream
+            %
+            % webserver.stream_close(id) ends the specified stream once any queued data
+            % has been sent, and releases the stream id.
+            %
+            % See also: webserver.stream.
+            coder.cinclude('httpd.h');
+            coder.ceval('web_stream_close', id);
+        end
+
+        function id = websocket()
+            %webserver.websocket Accept a websocket connection
+            %
+            % id = webserver.websocket() accepts the websocket upgrade for the current
+            % request and returns a websocket id.  Messages are exchanged using
+            % webserver.ws_send and webserver.ws_recv, from any thread, until
+            % webserver.ws_close is called.
+            %
+            % Notes::
+            % - Returns -1, and sends an error to the browser, if the request is not a
+            %   websocket upgrade.
+            % - The websocket id is a small integer which indexes into an internal table.  If an error
+            %   is obtained about too few websockets then increase NWEBSOCKETS in httpd.c and recompile.
+            %
+            % See also: webserver.isWebSocket, webserver.ws_send, webserver.ws_recv, webserver.ws_close.
+            coder.cinclude('httpd.h');
+            id = int32(0);
+            id = coder.ceval('web_websocket');
+        end
+
+        function ok = ws_send(id, data, binary)
+            %webserver.ws_send Send a websocket message
+            %
+            % ok = webserver.ws_send(id, data) sends the character array data as a text
+            % message on the specified websocket.
+            %
+            % ok = webserver.ws_send(id, data, binary) as above but if binary is true the
+            % data, eg. a uint8 array, is sent as a binary message.
+            %
+            % Returns false if the connection has closed.
+            %
+            % Notes::
+            % - The connection only opens after the callback that called webserver.websocket
+            %   returns.  Messages sent before then, including from that callback, are held
+            %   and sent when it opens, up to NWSMESSAGES in httpd.c, beyond which they are
+            %   dropped.
+            % - If the client doesn't accept a message within WS_SENDTIMEOUT in httpd.c,
+            %   default 5s, the connection is closed and false is returned.
+            %
+            % See also: webserver.websocket, webserver.ws_recv.
+            coder.cinclude('httpd.h');
+            if nargin < 3
+                binary = false;
+            end
+            ok = int32(0);
+            ok = coder.ceval('web_ws_send', id, coder.ref(data), int32(length(data)), int32(binary));
+        end
+
+        function [s, ok] = ws_recv(id, block)
+            %webserver.ws_recv Receive a websocket message
+            %
+            % s = webserver.ws_recv(id) is a character array containing the next message
+            % received on the specified websocket.  It blocks until a message arrives.
+            %
+            % s = webserver.ws_recv(id, block) as above but if block is false it returns
+            % immediately, with an empty array if no message is waiting.
+            %
+            % [s,ok] = webserver.ws_recv(...) as above but ok is false if the connection
+            % has closed.
+            %
+            % Notes::
+            % - Messages longer than 4096 bytes are truncated.
+            %
+            % See also: webserver.websocket, webserver.ws_send.
+            coder.cinclude('httpd.h');
+            if nargin < 2
+                block = true;
+            end
+            coder.varsize('s');
+            s = '';
+
+            BUFSIZ = 4096;
+            buf = char(zeros(1,BUFSIZ)); % create a buffer to write into
+
+            n = int32(0);
+            n = coder.ceval('web_ws_recv', id, coder.wref(buf), BUFSIZ, int32(block));
+            ok = n >= 0;
+            if n > 0
+                s = buf(1:n);
+            end
+        end
+
+        function ws_close(id)
+            %webserver.ws_close Close a websocket
+            %
+            % webserver.ws_close(id) closes the specified websocket and releases the id.
+            % This must also be called after the client has disconnected.
+            %
+            % See also: webserver.websocket.
+            coder.cinclude('httpd.h');
+            coder.ceval('web_ws_close', id);
+        end
+
+        function v = isWebSocket()
+            %webserver.isWebSocket Test for websocket upgrade request
+            %
+            % v = webserver.isWebSocket() is true if this request is asking to upgrade to
+            % a websocket.
+            %
+            % See also: webserver.websocket.
+            v = int32(0);
+            v = coder.ceval('web_isWebSocket');
+        end
+
+        function json(values)
+            %webserver.json Send struct as JSON to browser
+            %
+            % webserver.json(values) sends the struct values to the requesting browser as a
+            % JSON object.  Numeric and logical fields can be scalars, vectors or matrices
+            % and character fields are sent as strings.
+            %
+            % Notes::
+            % - A matrix is sent as an array of rows.
+            % - Floating point values are formatted with the fewest digits that convert back
+            %   to the same value, NaN and Inf are sent as null.
+            %
+            % See also: webserver.binary, webserver.template.
+            coder.cinclude('httpd.h');
+
+            coder.ceval('web_json_begin');
+            names = fieldnames(values);
+            for i=1:length(names)
+                name = names{i};
+                v = values.(name);
+                if ischar(v)
+                    coder.ceval('web_json_string', cstring(name), cstring(v));
+                else
+                    coder.ceval('web_json_number', cstring(name), coder.ref(v), ...
+                        webserver.typecode(v), int32(size(v,1)), int32(size(v,2)));
+                end
+            end
+            coder.ceval('web_json_end');
+        end
+
+        function binary(v, type)
+            %webserver.binary Send numeric array as binary to browser
+            %
+            % webserver.binary(v) sends the numeric array v to the requesting browser as
+            % raw little-endian values preceded by a small header giving the type and shape.
+            %
+            % webserver.binary(v, 'single') as above but double values are sent as float32.
+            %
+            % Notes::
+            % - The header is 'STL', a type character ('d', 'f', 'i', 'l' or 'B'), a uint32
+            %   number of dimensions, and a uint32 for each dimension, padded to a multiple
+            %   of 8 bytes.
+            % - Elements are in MATLAB column-major order.
+            %
+            % See also: webserver.json, webserver.data.
+            coder.cinclude('httpd.h');
+
+            outtype = webserver.typecode(v);
+            if nargin > 1 && strcmp(type, 'single')
+                outtype = int32(1);
+            end
+            dims = int32(size(v));
+            coder.ceval('web_binary', coder.ref(v), webserver.typecode(v), outtype, ...
+                int32(length(dims)), coder.ref(dims));
+        end
+
+        function t = typecode(v)
+            %webserver.typecode Element type code for C encoders
+            %
+            % t = webserver.typecode(v) is the integer code used by the C encoders for the
+            % class of v.
+            switch class(v)
+                case 'double'
+                    t = int32(0);
+                case 'single'
+                    t = int32(1);
+                case 'int32'
+                    t = int32(2);
+                case 'uint8'
+                    t = int32(3);
+                case 'logical'
+                    t = int32(4);
+                case 'int64'
+                    t = int32(5);
+                otherwise
+                    t = int32(0);
+                    error('webserver: unsupported type for encoding');
+            end
+        end
+
         function v = isPOST()
             %webserver.isPOST Test for POST request
             %
@@ -262,8 +791,10 @@ classdef webserver < handle %#codegen
             % Notes::
             % - POST data is typically sent from the browser using <form> and <input> tags.
             % - Returns empty string if the key is not found.
+            % - If webserver.upload_dir has been set, the value for a file upload is the
+            %   path of the file holding the uploaded data.
             %
-            % See also: webserver.isPOST, webserver.url.
+            % See also: webserver.isPOST, webserver.url, webserver.upload_dir.
             coder.cinclude('httpd.h');
             coder.varsize('s');
             s = '';
@@ -284,5 +815,21 @@ classdef webserver < handle %#codegen
             end
         end
         
+        function upload_dir(dir)
+            %webserver.upload_dir Stream file uploads to a directory
+            %
+            % webserver.upload_dir(dir) causes files uploaded by POST requests to be written
+            % to a temporary file in the directory dir as they arrive, rather than being held
+            % in memory.  webserver.postarg returns the path of the file.
+            %
+            % Notes::
+            % - The file is deleted when the callback returns, move or copy it to keep it.
+            % - An empty dir restores the default, where uploads are held in memory.
+            %
+            % See also: webserver.postarg.
+            coder.cinclude('httpd.h');
+            coder.ceval('web_upload_dir', cstring(dir));
+        end
+
     end % methods(Static)
 end % classdef
\ No newline at end of file